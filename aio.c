@@ -0,0 +1,479 @@
+/***********************************************************************
+ * aio.c
+ *
+ * Asynchronous block read engine.  See aio.h for documentation.
+ *
+ * The io_uring engine talks to the kernel through the raw system calls
+ * and the shared submission and completion rings, so no library beyond
+ * libc is needed.  Each request owns a slot in g_reqs; the slot's index
+ * is the request's io_uring user_data, and the slot holds the request's
+ * copy of the iovec array until the request completes.
+ ***********************************************************************/
+
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "aio.h"
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define AIO_URING
+#endif
+
+
+/* A request slot. */
+typedef struct aioreq_t
+{
+   struct iovec iov[AIO_MAX_IOV];
+   uint64_t tag;
+   int res;     /* Result, for the blocking engine */
+   int next;    /* Next slot in the free or completed list */
+} aioreq_t;
+
+
+/* Private global variables. */
+
+/* Request slots, the head of the free slot list, and the number of
+ * slots in use.
+ */
+static aioreq_t *g_reqs = NULL;
+static int g_free = -1;
+static unsigned int g_inflight = 0;
+/* Completed requests not yet reaped, oldest first, for the blocking
+ * engine.
+ */
+static int g_doneHead = -1;
+static int g_doneTail = -1;
+
+#ifdef AIO_URING
+/* The io_uring instance, or -1 if the blocking engine is in use. */
+static int g_ring = -1;
+/* Submission ring. */
+static unsigned int *g_sqHead;
+static unsigned int *g_sqTail;
+static unsigned int *g_sqArray;
+static unsigned int g_sqMask;
+static struct io_uring_sqe *g_sqes;
+/* Number of submission entries not yet handed to the kernel. */
+static unsigned int g_toSubmit = 0;
+/* Completion ring. */
+static unsigned int *g_cqHead;
+static unsigned int *g_cqTail;
+static unsigned int g_cqMask;
+static struct io_uring_cqe *g_cqes;
+/* Ring mappings, for aio_exit(). */
+static void *g_sqMap = MAP_FAILED;
+static void *g_cqMap = MAP_FAILED;
+static void *g_sqeMap = MAP_FAILED;
+static size_t g_sqMapLen;
+static size_t g_cqMapLen;
+static size_t g_sqeMapLen;
+#endif
+
+
+/* Prototypes for private helper functions. */
+static int getslot(void);
+static void putslot(int slot);
+#ifdef AIO_URING
+static int uringSetup(unsigned int depth);
+static void uringTeardown(void);
+static int uringEnter(unsigned int submit, unsigned int wait);
+static int uringReap(aiodone_t done, void *arg);
+static int uringFail(aiodone_t done, void *arg);
+#endif
+
+
+int aio_init(unsigned int depth)
+{
+   unsigned int i;
+
+   if (g_reqs != NULL || depth == 0
+       || (g_reqs = calloc(depth, sizeof(aioreq_t))) == NULL)
+      return -1;
+
+   for (i = 0; i < depth; i++)
+      g_reqs[i].next = i + 1 < depth ? (int) i + 1 : -1;
+   g_free = 0;
+   g_inflight = 0;
+   g_doneHead = g_doneTail = -1;
+
+#ifdef AIO_URING
+   if (uringSetup(depth) == -1)
+      uringTeardown();
+#endif
+
+   return 0;
+}
+
+
+void aio_exit(void)
+{
+   while (g_inflight > 0)
+      aio_reap(1, NULL, NULL);
+
+#ifdef AIO_URING
+   uringTeardown();
+#endif
+
+   free(g_reqs);
+   g_reqs = NULL;
+   g_free = -1;
+}
+
+
+const char *aio_engine(void)
+{
+#ifdef AIO_URING
+   if (g_ring != -1)
+      return "io_uring";
+#endif
+   return "preadv";
+}
+
+
+int aio_readv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+              uint64_t tag)
+{
+   int slot;
+   aioreq_t *req;
+   ssize_t res;
+#ifdef AIO_URING
+   unsigned int index;
+   struct io_uring_sqe *sqe;
+#endif
+
+   if (iovcnt <= 0 || iovcnt > AIO_MAX_IOV || (slot = getslot()) == -1)
+      return -1;
+
+   req = &g_reqs[slot];
+   memcpy(req->iov, iov, iovcnt * sizeof(struct iovec));
+   req->tag = tag;
+   g_inflight++;
+
+#ifdef AIO_URING
+   if (g_ring != -1)
+   {
+      /* There are never more requests than submission entries, so the
+       * ring can't be full.
+       */
+      index = *g_sqTail & g_sqMask;
+      sqe = &g_sqes[index];
+      memset(sqe, 0, sizeof(struct io_uring_sqe));
+      sqe->opcode = IORING_OP_READV;
+      sqe->fd = fd;
+      sqe->addr = (uint64_t) (uintptr_t) req->iov;
+      sqe->len = iovcnt;
+      sqe->off = offset;
+      sqe->user_data = slot;
+      g_sqArray[index] = index;
+      __atomic_store_n(g_sqTail, *g_sqTail + 1, __ATOMIC_RELEASE);
+      g_toSubmit++;
+      return 0;
+   }
+#endif
+
+   /* Blocking engine: read now, report the completion later. */
+   do
+      res = preadv(fd, req->iov, iovcnt, offset);
+   while (res == -1 && errno == EINTR);
+
+   req->res = res == -1 ? -errno : (int) res;
+   req->next = -1;
+   if (g_doneTail == -1)
+      g_doneHead = slot;
+   else
+      g_reqs[g_doneTail].next = slot;
+   g_doneTail = slot;
+
+   return 0;
+}
+
+
+void aio_submit(void)
+{
+#ifdef AIO_URING
+   if (g_ring != -1 && g_toSubmit > 0)
+      uringEnter(g_toSubmit, 0);
+#endif
+}
+
+
+int aio_reap(int wait, aiodone_t done, void *arg)
+{
+   int count = 0;
+   int slot;
+   uint64_t tag;
+   int res;
+#ifdef AIO_URING
+   int waiting;
+   int failed;
+
+   if (g_ring != -1)
+   {
+      do
+      {
+         waiting = wait && g_inflight > 0;
+         failed = (g_toSubmit > 0 || waiting)
+                  && uringEnter(g_toSubmit, waiting) == -1;
+         count = uringReap(done, arg);
+
+         /* If the kernel can't wait for the requests in flight, they
+          * would be waited for forever, so give up on the ring.
+          */
+         if (failed && waiting && count == 0)
+            return uringFail(done, arg);
+      }
+      while (count == 0 && wait && g_inflight > 0);
+
+      return count;
+   }
+#endif
+
+   (void) wait;
+
+   while ((slot = g_doneHead) != -1)
+   {
+      if ((g_doneHead = g_reqs[slot].next) == -1)
+         g_doneTail = -1;
+
+      tag = g_reqs[slot].tag;
+      res = g_reqs[slot].res;
+      putslot(slot);
+
+      if (done != NULL)
+         done(tag, res, arg);
+      count++;
+   }
+
+   return count;
+}
+
+
+unsigned int aio_inflight(void)
+{
+   return g_inflight;
+}
+
+
+/* Take a request slot from the free list.
+ *
+ * Returns the slot's index, or -1 if all slots are in use.
+ */
+static int getslot(void)
+{
+   int slot;
+
+   if ((slot = g_free) != -1)
+      g_free = g_reqs[slot].next;
+
+   return slot;
+}
+
+
+/* Return a request slot to the free list.
+ */
+static void putslot(int slot)
+{
+   g_reqs[slot].next = g_free;
+   g_free = slot;
+   g_inflight--;
+}
+
+
+#ifdef AIO_URING
+
+/* Create an io_uring instance with room for depth requests and map its
+ * rings.
+ *
+ * Returns 0 on success.  Otherwise, returns -1, possibly leaving a
+ * partially set up ring for uringTeardown().
+ */
+static int uringSetup(unsigned int depth)
+{
+   struct io_uring_params p;
+   uint8_t *sq;
+   uint8_t *cq;
+
+   memset(&p, 0, sizeof p);
+
+   if ((g_ring = (int) syscall(__NR_io_uring_setup, depth, &p)) < 0)
+   {
+      g_ring = -1;
+      return -1;
+   }
+
+   g_sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+   g_cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+   g_sqeMapLen = p.sq_entries * sizeof(struct io_uring_sqe);
+
+   /* Newer kernels map both rings with one mapping. */
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+   {
+      if (g_cqMapLen > g_sqMapLen)
+         g_sqMapLen = g_cqMapLen;
+      g_cqMapLen = g_sqMapLen;
+   }
+
+   g_sqMap = mmap(NULL, g_sqMapLen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, g_ring, IORING_OFF_SQ_RING);
+   if (g_sqMap == MAP_FAILED)
+      return -1;
+
+   if (p.features & IORING_FEAT_SINGLE_MMAP)
+      g_cqMap = g_sqMap;
+   else if ((g_cqMap = mmap(NULL, g_cqMapLen, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, g_ring,
+                            IORING_OFF_CQ_RING)) == MAP_FAILED)
+      return -1;
+
+   g_sqeMap = mmap(NULL, g_sqeMapLen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, g_ring, IORING_OFF_SQES);
+   if (g_sqeMap == MAP_FAILED)
+      return -1;
+
+   sq = g_sqMap;
+   cq = g_cqMap;
+   g_sqHead = (unsigned int *) (sq + p.sq_off.head);
+   g_sqTail = (unsigned int *) (sq + p.sq_off.tail);
+   g_sqMask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+   g_sqArray = (unsigned int *) (sq + p.sq_off.array);
+   g_sqes = g_sqeMap;
+   g_cqHead = (unsigned int *) (cq + p.cq_off.head);
+   g_cqTail = (unsigned int *) (cq + p.cq_off.tail);
+   g_cqMask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+   g_cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+   g_toSubmit = 0;
+
+   return 0;
+}
+
+
+/* Unmap the rings and close the io_uring instance, if any.  Afterwards
+ * the blocking engine is in use.
+ */
+static void uringTeardown(void)
+{
+   if (g_sqeMap != MAP_FAILED)
+      munmap(g_sqeMap, g_sqeMapLen);
+   if (g_cqMap != MAP_FAILED && g_cqMap != g_sqMap)
+      munmap(g_cqMap, g_cqMapLen);
+   if (g_sqMap != MAP_FAILED)
+      munmap(g_sqMap, g_sqMapLen);
+   if (g_ring != -1)
+      close(g_ring);
+
+   g_sqMap = g_cqMap = g_sqeMap = MAP_FAILED;
+   g_ring = -1;
+}
+
+
+/* Hand submit queued entries to the kernel and, if wait is true, wait
+ * for at least one completion.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int uringEnter(unsigned int submit, unsigned int wait)
+{
+   long ret;
+
+   do
+      ret = syscall(__NR_io_uring_enter, g_ring, submit, wait,
+                    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+   while (ret == -1 && errno == EINTR);
+
+   if (ret == -1)
+      return -1;
+
+   g_toSubmit -= (unsigned int) ret < submit ? (unsigned int) ret : submit;
+   return 0;
+}
+
+
+/* Process the entries in the completion ring.
+ *
+ * Returns the number of completions processed.
+ */
+static int uringReap(aiodone_t done, void *arg)
+{
+   int count = 0;
+   unsigned int head = *g_cqHead;
+   struct io_uring_cqe *cqe;
+   int slot;
+   uint64_t tag;
+   int res;
+
+   while (head != __atomic_load_n(g_cqTail, __ATOMIC_ACQUIRE))
+   {
+      cqe = &g_cqes[head & g_cqMask];
+      slot = (int) cqe->user_data;
+      res = cqe->res;
+      __atomic_store_n(g_cqHead, ++head, __ATOMIC_RELEASE);
+
+      tag = g_reqs[slot].tag;
+      putslot(slot);
+
+      if (done != NULL)
+         done(tag, res, arg);
+      count++;
+   }
+
+   return count;
+}
+
+
+/* Give up on the io_uring instance after io_uring_enter() has failed
+ * while waiting.  The entries the kernel hasn't taken from the
+ * submission ring are taken back and complete with -EIO at once.  The
+ * requests it has taken may still be reading into their buffers, so
+ * they are waited for, with io_uring_enter() if it works again and
+ * otherwise by polling the completion ring, before the ring is torn
+ * down.  Later requests use the blocking engine.
+ *
+ * Returns the number of completions processed.
+ */
+static int uringFail(aiodone_t done, void *arg)
+{
+   static const struct timespec pause = { 0, 1000000 };
+   unsigned int head = __atomic_load_n(g_sqHead, __ATOMIC_ACQUIRE);
+   unsigned int tail = *g_sqTail;
+   int count = 0;
+   int slot;
+   uint64_t tag;
+
+   /* Without SQPOLL the kernel only takes entries inside
+    * io_uring_enter(), so the ones it hasn't taken can be withdrawn.
+    */
+   __atomic_store_n(g_sqTail, head, __ATOMIC_RELEASE);
+   g_toSubmit = 0;
+
+   for (; head != tail; head++)
+   {
+      slot = (int) g_sqes[g_sqArray[head & g_sqMask]].user_data;
+      tag = g_reqs[slot].tag;
+      putslot(slot);
+
+      if (done != NULL)
+         done(tag, -EIO, arg);
+      count++;
+   }
+
+   count += uringReap(done, arg);
+   while (g_inflight > 0)
+   {
+      if (uringEnter(0, 1) == -1)
+         nanosleep(&pause, NULL);
+      count += uringReap(done, arg);
+   }
+
+   uringTeardown();
+   return count;
+}
+
+#endif
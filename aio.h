@@ -0,0 +1,82 @@
+/***********************************************************************
+ * aio.h
+ *
+ * Asynchronous block read engine.  Reads are queued with aio_readv()
+ * and complete, in any order, when aio_reap() is called.  The engine
+ * uses io_uring when the kernel provides it; otherwise each read is
+ * performed with a blocking preadv() when it is queued, and its
+ * completion is reported by the next aio_reap().
+ ***********************************************************************/
+
+
+#ifndef __AIO_H
+#define __AIO_H
+
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+
+/* Largest number of buffers in one request. */
+#define AIO_MAX_IOV 64
+
+
+/* Completion callback.  tag is the value passed to aio_readv() and res
+ * is the number of bytes read, or a negative errno value.
+ */
+typedef void (*aiodone_t)(uint64_t tag, int res, void *arg);
+
+
+/* Set up the engine to keep up to depth requests in flight.  If
+ * io_uring isn't available, the blocking fallback is used.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int aio_init(unsigned int depth);
+
+
+/* Shut down the engine.  Requests still in flight are waited for and
+ * their completions discarded.
+ */
+void aio_exit(void);
+
+
+/* Returns the name of the engine in use: "io_uring" or "preadv". */
+const char *aio_engine(void);
+
+
+/* Queue a read of iovcnt buffers, described by iov, from the file
+ * descriptor fd starting at byte offset.  iovcnt may not exceed
+ * AIO_MAX_IOV.  iov is copied, but the buffers it describes must remain
+ * valid until the request completes.  Queued requests are handed to the
+ * kernel by aio_submit() or aio_reap().
+ *
+ * Returns 0 on success.  Returns -1 if the queue is full; reap some
+ * completions and try again.
+ */
+int aio_readv(int fd, const struct iovec *iov, int iovcnt, off_t offset,
+              uint64_t tag);
+
+
+/* Hand any queued requests to the kernel without waiting.
+ */
+void aio_submit(void);
+
+
+/* Submit queued requests and call done for each completed request.  If
+ * wait is true and requests are in flight, block until at least one
+ * completes.  If io_uring fails while waiting, the requests not yet
+ * handed to the kernel complete with -EIO, those the kernel has are
+ * waited for, and the blocking engine is used from then on.
+ *
+ * Returns the number of completions processed.
+ */
+int aio_reap(int wait, aiodone_t done, void *arg);
+
+
+/* Returns the number of requests queued or in flight. */
+unsigned int aio_inflight(void);
+
+
+#endif
@@ -0,0 +1,868 @@
+/***********************************************************************
+ * bcache.c
+ *
+ * Block cache.  See bcache.h for documentation.
+ *
+ * Each cache slot holds one block and is in one of three states: EMPTY,
+ * VALID, or PENDING while a prefetch into it is in flight.  Slots are
+ * found by block number through a hash table of chains.  EMPTY and VALID
+ * slots are also kept on an LRU list, most recently used first; PENDING
+ * slots are off the list, so a slot is never reused while the kernel may
+ * still be writing into it.
+ *
+ * Prefetches are issued on the block device's file descriptor, when it
+ * has one; otherwise they are read through the backend as they are
+ * issued.
+ *
+ * The overlay is a table of blocks, also hashed by block number, that
+ * only grows until it is committed or discarded.  Overlay blocks are
+ * never prefetched, since the device's copy is stale.  A batch of writes
+ * is held in an overlay that lasts until the batch is flushed.
+ *
+ * Committed blocks are scheduled like an elevator.  Block numbers run
+ * sector by sector along a track, then head by head and cylinder by
+ * cylinder, so sorting them sorts the requests by cylinder, head and
+ * sector too.  Runs of consecutive blocks are merged into one request,
+ * and the runs are written going up from the block after the last one
+ * transferred, then going down through the rest.
+ ***********************************************************************/
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include "bcache.h"
+#include "aio.h"
+
+
+/* Depth of the aio queue. */
+#define BC_AIO_DEPTH 256
+
+/* Slot states. */
+#define BC_EMPTY 0
+#define BC_VALID 1
+#define BC_PENDING 2
+
+/* No slot. */
+#define BC_NONE -1
+
+/* Largest number of blocks transferred at once through g_run. */
+#define BC_RUN_BLOCKS AIO_MAX_IOV
+
+/* Initial number of overlay blocks and hash buckets. */
+#define BC_OV_INITIAL 64
+
+
+/* A run of blocks gathered for one prefetch request. */
+typedef struct bcrun_t
+{
+   unsigned int first;
+   int count;
+   struct iovec iov[AIO_MAX_IOV];
+} bcrun_t;
+
+
+/* A cache slot. */
+typedef struct bcslot_t
+{
+   unsigned int blocknum;
+   int state;
+   int hashNext;
+   int lruPrev;
+   int lruNext;
+} bcslot_t;
+
+
+/* Private global variables. */
+
+/* The cached device; ops is NULL if there is none. */
+static blockdev_t g_bcDev = { NULL, NULL, -1 };
+/* Slots and their blocks. */
+static bcslot_t *g_slots;
+static block_t *g_data;
+/* Hash table of slot chains, g_hashMask + 1 buckets. */
+static int *g_hash;
+static unsigned int g_hashMask;
+/* Most and least recently used slots on the LRU list. */
+static int g_lruHead = BC_NONE;
+static int g_lruTail = BC_NONE;
+/* Buffer in which runs of blocks are gathered, BC_RUN_BLOCKS long. */
+static block_t *g_run;
+/* Overlay: g_ovUsed of g_ovSize blocks in use, with their block numbers
+ * and hash chains, and g_ovMask + 1 hash buckets.  g_ovBlocks is NULL if
+ * writes go to the device.
+ */
+static block_t *g_ovBlocks = NULL;
+static unsigned int *g_ovNums;
+static int *g_ovNext;
+static int *g_ovHash;
+static unsigned int g_ovMask;
+static unsigned int g_ovSize;
+static unsigned int g_ovUsed;
+/* True if the overlay holds a batch, not changes made under bc_overlay(). */
+static int g_ovBatch = 0;
+/* Blocks per track, to which prefetches are widened, or 0. */
+static unsigned int g_trackBlocks = 0;
+/* The block after the last one transferred, where the elevator starts. */
+static unsigned int g_bcPos = 0;
+
+
+/* Prototypes for private helper functions. */
+static int lookup(unsigned int blocknum);
+static int victim(unsigned int blocknum);
+static void hashRemove(int slot);
+static void lruRemove(int slot);
+static void lruPush(int slot);
+static void release(int slot, const uint8_t *buf);
+static int enqueue(bcrun_t *run, unsigned int blocknum);
+static int issue(unsigned int first, const struct iovec *iov, int count);
+static void prefetchDone(uint64_t tag, int res, void *arg);
+static void waitFor(int slot);
+static int ovAlloc(unsigned int size);
+static void ovFree(void);
+static void ovReset(void);
+static int ovLookup(unsigned int blocknum);
+static int ovPut(const uint8_t *buf, unsigned int blocknum);
+static int ovCompare(const void *a, const void *b);
+static int ovWrite(const unsigned int *order, unsigned int count);
+
+
+int bc_init(const blockdev_t *dev, unsigned int capacity)
+{
+   unsigned int i;
+
+   if (g_bcDev.ops != NULL || capacity == 0)
+      return -1;
+
+   for (g_hashMask = 1; g_hashMask < capacity; g_hashMask <<= 1)
+      ;
+
+   g_slots = malloc(capacity * sizeof(bcslot_t));
+   g_data = malloc(capacity * sizeof(block_t));
+   g_hash = malloc(g_hashMask * sizeof(int));
+   g_run = malloc(BC_RUN_BLOCKS * sizeof(block_t));
+   g_hashMask--;
+
+   if (g_slots == NULL || g_data == NULL || g_hash == NULL || g_run == NULL
+       || aio_init(BC_AIO_DEPTH) == -1)
+   {
+      free(g_slots);
+      free(g_data);
+      free(g_hash);
+      free(g_run);
+      return -1;
+   }
+
+   for (i = 0; i <= g_hashMask; i++)
+      g_hash[i] = BC_NONE;
+
+   g_lruHead = g_lruTail = BC_NONE;
+   for (i = 0; i < capacity; i++)
+   {
+      g_slots[i].blocknum = 0;
+      g_slots[i].state = BC_EMPTY;
+      g_slots[i].hashNext = BC_NONE;
+      lruPush(i);
+   }
+
+   g_bcDev = *dev;
+   return 0;
+}
+
+
+void bc_exit(void)
+{
+   if (g_bcDev.ops == NULL)
+      return;
+
+   while (aio_inflight() > 0)
+      aio_reap(1, prefetchDone, NULL);
+   aio_exit();
+
+   free(g_slots);
+   free(g_data);
+   free(g_hash);
+   free(g_run);
+   ovFree();
+   g_bcDev.ops = NULL;
+}
+
+
+int bc_read(block_t buf, unsigned int blocknum)
+{
+   int slot;
+   int i;
+
+   if ((slot = lookup(blocknum)) != BC_NONE)
+   {
+      waitFor(slot);
+
+      if (g_slots[slot].state == BC_VALID)
+      {
+         memcpy(buf, g_data[slot], BLOCKSIZE);
+         lruRemove(slot);
+         lruPush(slot);
+         return 0;
+      }
+
+      lruRemove(slot);
+   }
+   else
+      slot = victim(blocknum);
+
+   if (g_ovBlocks != NULL && (i = ovLookup(blocknum)) != BC_NONE)
+      memcpy(buf, g_ovBlocks[i], BLOCKSIZE);
+   else if (bd_read(&g_bcDev, buf, blocknum, 1) == -1)
+   {
+      release(slot, NULL);
+      return -1;
+   }
+   else
+      g_bcPos = blocknum + 1;
+
+   release(slot, buf);
+   return 0;
+}
+
+
+int bc_write(block_t buf, unsigned int blocknum)
+{
+   int slot;
+
+   if ((slot = lookup(blocknum)) != BC_NONE)
+   {
+      waitFor(slot);
+      lruRemove(slot);
+   }
+   else
+      slot = victim(blocknum);
+
+   if (g_ovBlocks != NULL ? ovPut(buf, blocknum) == -1
+       : bd_write(&g_bcDev, buf, blocknum, 1) == -1)
+   {
+      release(slot, NULL);
+      return -1;
+   }
+
+   release(slot, buf);
+   return 0;
+}
+
+
+int bc_writerun(const uint8_t *buf, unsigned int blocknum, unsigned int count)
+{
+   unsigned int i;
+   size_t done = 0;
+   size_t len = (size_t) count * BLOCKSIZE;
+   int slot;
+
+   /* A prefetch in flight could land on top of the new data. */
+   for (i = 0; i < count; i++)
+      if ((slot = lookup(blocknum + i)) != BC_NONE)
+         waitFor(slot);
+
+   for (; g_ovBlocks != NULL && done < len; done += BLOCKSIZE)
+      if (ovPut(buf + done, blocknum + done / BLOCKSIZE) == -1)
+         break;
+
+   if (g_ovBlocks == NULL && bd_write(&g_bcDev, buf, blocknum, count) == 0)
+   {
+      done = len;
+      g_bcPos = blocknum + count;
+   }
+
+   /* Update the cached copies of the blocks, or drop them if the write
+    * failed.
+    */
+   for (i = 0; i < count; i++)
+      if ((slot = lookup(blocknum + i)) != BC_NONE)
+      {
+         lruRemove(slot);
+         release(slot, done == len ? buf + i * BLOCKSIZE : NULL);
+      }
+
+   return done == len ? 0 : -1;
+}
+
+
+void bc_prefetch(const unsigned int *blocknums, unsigned int n)
+{
+   unsigned int i;
+   unsigned int blk;
+   unsigned int end;
+   unsigned int track = (unsigned int) -1;
+   int stop = 0;
+   bcrun_t run;
+
+   run.count = 0;
+
+   for (i = 0; i < n && !stop; i++)
+   {
+      blk = blocknums[i];
+      end = blk + 1;
+
+      /* Widen the block to the rest of its track, unless the previous
+       * block was on the same track.
+       */
+      if (g_trackBlocks > 0)
+      {
+         if (blk / g_trackBlocks == track)
+            continue;
+         track = blk / g_trackBlocks;
+         end = (track + 1) * g_trackBlocks;
+      }
+
+      for (; blk < end && !stop; blk++)
+         stop = enqueue(&run, blk) == -1;
+   }
+
+   if (run.count > 0)
+      issue(run.first, run.iov, run.count);
+
+   aio_submit();
+}
+
+
+void bc_geometry(unsigned int trackBlocks)
+{
+   g_trackBlocks = trackBlocks <= AIO_MAX_IOV ? trackBlocks : 0;
+}
+
+
+int bc_readrun(uint8_t *buf, unsigned int blocknum, size_t len)
+{
+   unsigned int full = len / BLOCKSIZE;
+   size_t part;
+   unsigned int i;
+   int j;
+   block_t tail;
+
+   if (full > 0 && bd_read(&g_bcDev, buf, blocknum, full) == -1)
+      return -1;
+
+   /* A partial last block is read whole and trimmed. */
+   if (len % BLOCKSIZE != 0)
+   {
+      if (bd_read(&g_bcDev, tail, blocknum + full, 1) == -1)
+         return -1;
+      memcpy(buf + (size_t) full * BLOCKSIZE, tail, len % BLOCKSIZE);
+   }
+
+   for (i = 0; g_ovUsed > 0 && (size_t) i * BLOCKSIZE < len; i++)
+      if ((j = ovLookup(blocknum + i)) != BC_NONE)
+      {
+         part = len - (size_t) i * BLOCKSIZE;
+         memcpy(buf + (size_t) i * BLOCKSIZE, g_ovBlocks[j],
+                part < BLOCKSIZE ? part : BLOCKSIZE);
+      }
+
+   return 0;
+}
+
+
+int bc_overlay(void)
+{
+   if (g_bcDev.ops == NULL)
+      return -1;
+
+   return g_ovBlocks != NULL ? 0 : ovAlloc(BC_OV_INITIAL);
+}
+
+
+int bc_commit(void)
+{
+   unsigned int *order;
+   unsigned int i;
+   unsigned int start;
+   unsigned int count;
+   int rv = 0;
+
+   if (g_ovBlocks == NULL || g_ovUsed == 0)
+      return 0;
+
+   if ((order = malloc(g_ovUsed * sizeof(unsigned int))) == NULL)
+      return -1;
+
+   for (i = 0; i < g_ovUsed; i++)
+      order[i] = i;
+   qsort(order, g_ovUsed, sizeof(unsigned int), ovCompare);
+
+   for (start = 0; start < g_ovUsed && g_ovNums[order[start]] < g_bcPos;
+        start++)
+      ;
+
+   /* Going up: each run starts at order[i]. */
+   for (i = start; rv == 0 && i < g_ovUsed; i += count)
+   {
+      for (count = 1; count < BC_RUN_BLOCKS && i + count < g_ovUsed
+              && g_ovNums[order[i + count]] == g_ovNums[order[i]] + count;
+           count++)
+         ;
+      rv = ovWrite(order + i, count);
+   }
+
+   /* Going down: each run ends at order[i - 1]. */
+   for (i = start; rv == 0 && i > 0; i -= count)
+   {
+      for (count = 1; count < BC_RUN_BLOCKS && count < i
+              && g_ovNums[order[i - 1 - count]] == g_ovNums[order[i - 1]]
+                 - count;
+           count++)
+         ;
+      rv = ovWrite(order + i - count, count);
+   }
+
+   free(order);
+   if (rv == 0)
+      ovReset();
+   return rv;
+}
+
+
+int bc_batch(void)
+{
+   if (g_bcDev.ops == NULL)
+      return -1;
+
+   if (g_ovBlocks != NULL)
+      return 0;
+
+   if (ovAlloc(BC_OV_INITIAL) == -1)
+      return -1;
+   g_ovBatch = 1;
+   return 0;
+}
+
+
+int bc_flush(void)
+{
+   int rv;
+
+   if (!g_ovBatch)
+      return 0;
+
+   rv = bc_commit();
+   ovFree();
+   g_ovBatch = 0;
+   return rv;
+}
+
+
+int bc_discard(void)
+{
+   unsigned int i;
+   int slot;
+
+   if (g_ovBlocks == NULL)
+      return -1;
+
+   /* Cached copies of the overlay's blocks are newer than the device's. */
+   for (i = 0; i < g_ovUsed; i++)
+      if ((slot = lookup(g_ovNums[i])) != BC_NONE)
+      {
+         waitFor(slot);
+         lruRemove(slot);
+         release(slot, NULL);
+      }
+
+   ovReset();
+   return 0;
+}
+
+
+unsigned int bc_dirty(void)
+{
+   return g_ovUsed;
+}
+
+
+unsigned int bc_held(unsigned int blocknum, unsigned int count)
+{
+   unsigned int i;
+   unsigned int held = 0;
+
+   for (i = 0; g_ovUsed > 0 && i < count; i++)
+      if (ovLookup(blocknum + i) != BC_NONE)
+         held++;
+
+   return held;
+}
+
+
+/* Returns the slot holding block blocknum, or BC_NONE.
+ */
+static int lookup(unsigned int blocknum)
+{
+   int slot;
+
+   for (slot = g_hash[blocknum & g_hashMask];
+        slot != BC_NONE && g_slots[slot].blocknum != blocknum;
+        slot = g_slots[slot].hashNext)
+      ;
+
+   return slot;
+}
+
+
+/* Take the least recently used slot for block blocknum.  The slot is
+ * removed from the LRU list and entered in the hash table, with state
+ * BC_EMPTY.
+ *
+ * Returns the slot, or BC_NONE if every slot has a prefetch in flight.
+ */
+static int victim(unsigned int blocknum)
+{
+   int slot;
+   int *bucket;
+
+   if ((slot = g_lruTail) == BC_NONE)
+      return BC_NONE;
+
+   lruRemove(slot);
+   hashRemove(slot);
+
+   bucket = &g_hash[blocknum & g_hashMask];
+   g_slots[slot].blocknum = blocknum;
+   g_slots[slot].state = BC_EMPTY;
+   g_slots[slot].hashNext = *bucket;
+   *bucket = slot;
+
+   return slot;
+}
+
+
+/* Remove slot from its hash chain.
+ */
+static void hashRemove(int slot)
+{
+   int *link = &g_hash[g_slots[slot].blocknum & g_hashMask];
+
+   while (*link != BC_NONE && *link != slot)
+      link = &g_slots[*link].hashNext;
+
+   if (*link == slot)
+      *link = g_slots[slot].hashNext;
+   g_slots[slot].hashNext = BC_NONE;
+}
+
+
+/* Remove slot from the LRU list.
+ */
+static void lruRemove(int slot)
+{
+   bcslot_t *s = &g_slots[slot];
+
+   if (s->lruPrev != BC_NONE)
+      g_slots[s->lruPrev].lruNext = s->lruNext;
+   else
+      g_lruHead = s->lruNext;
+
+   if (s->lruNext != BC_NONE)
+      g_slots[s->lruNext].lruPrev = s->lruPrev;
+   else
+      g_lruTail = s->lruPrev;
+}
+
+
+/* Put slot at the most recently used end of the LRU list.
+ */
+static void lruPush(int slot)
+{
+   g_slots[slot].lruPrev = BC_NONE;
+   g_slots[slot].lruNext = g_lruHead;
+
+   if (g_lruHead != BC_NONE)
+      g_slots[g_lruHead].lruPrev = slot;
+   else
+      g_lruTail = slot;
+
+   g_lruHead = slot;
+}
+
+
+/* Put slot, which is off the LRU list, back on it.  If buf isn't NULL,
+ * the slot receives a copy of it and becomes valid; otherwise the slot
+ * becomes empty.  Does nothing if slot is BC_NONE.
+ */
+static void release(int slot, const uint8_t *buf)
+{
+   if (slot == BC_NONE)
+      return;
+
+   if (buf != NULL)
+      memcpy(g_data[slot], buf, BLOCKSIZE);
+   g_slots[slot].state = buf != NULL ? BC_VALID : BC_EMPTY;
+   lruPush(slot);
+}
+
+
+/* Add block blocknum to the prefetch run, issuing the run first if the
+ * block can't extend it.  Blocks in the overlay, cached, or in flight
+ * are skipped.
+ *
+ * Returns 0 on success, -1 if prefetching should stop because the aio
+ * queue is full or every slot has a prefetch in flight.
+ */
+static int enqueue(bcrun_t *run, unsigned int blocknum)
+{
+   int slot;
+
+   if (g_ovBlocks != NULL && ovLookup(blocknum) != BC_NONE)
+      return 0;
+
+   slot = lookup(blocknum);
+
+   /* Issue the current run if this block can't extend it. */
+   if (run->count > 0 && ((slot != BC_NONE && g_slots[slot].state != BC_EMPTY)
+                          || blocknum != run->first + run->count
+                          || run->count == AIO_MAX_IOV))
+   {
+      if (issue(run->first, run->iov, run->count) == -1)
+      {
+         run->count = 0;
+         return -1;
+      }
+      run->count = 0;
+   }
+
+   if (slot != BC_NONE)
+   {
+      if (g_slots[slot].state != BC_EMPTY)
+         return 0;
+      lruRemove(slot);
+   }
+   else if ((slot = victim(blocknum)) == BC_NONE)
+      return -1;
+
+   if (run->count == 0)
+      run->first = blocknum;
+   g_slots[slot].state = BC_PENDING;
+   run->iov[run->count].iov_base = g_data[slot];
+   run->iov[run->count].iov_len = BLOCKSIZE;
+   run->count++;
+   return 0;
+}
+
+
+/* Queue a read of count consecutive blocks, starting with block first,
+ * into the buffers described by iov.  The blocks' slots must be
+ * BC_PENDING.  If the aio queue is full, the slots are released empty.
+ * A device without a file descriptor is read now, with one request
+ * through g_run, and the read completes at once.
+ *
+ * Returns 0 on success, -1 if the queue is full.
+ */
+static int issue(unsigned int first, const struct iovec *iov, int count)
+{
+   uint64_t tag = (uint64_t) first << 8 | count;
+   int i;
+
+   if (g_bcDev.fd == -1)
+   {
+      if (bd_read(&g_bcDev, g_run[0], first, count) == -1)
+         prefetchDone(tag, -1, NULL);
+      else
+      {
+         for (i = 0; i < count; i++)
+            memcpy(iov[i].iov_base, g_run[i], BLOCKSIZE);
+         g_bcPos = first + count;
+         prefetchDone(tag, count * BLOCKSIZE, NULL);
+      }
+      return 0;
+   }
+
+   if (aio_readv(g_bcDev.fd, iov, count, (off_t) first * BLOCKSIZE, tag)
+       == 0)
+      return 0;
+
+   prefetchDone(tag, -1, NULL);
+   return -1;
+}
+
+
+/* Completion callback for a prefetch.  The tag holds the first block
+ * number of the request and the number of blocks.  Blocks that were read
+ * in full become valid; the rest are left empty.  Either way, the slots
+ * go back on the LRU list.
+ */
+static void prefetchDone(uint64_t tag, int res, void *arg)
+{
+   unsigned int first = (unsigned int) (tag >> 8);
+   unsigned int count = (unsigned int) (tag & 0xff);
+   unsigned int i;
+   int slot;
+
+   (void) arg;
+
+   for (i = 0; i < count; i++)
+   {
+      if ((slot = lookup(first + i)) == BC_NONE
+          || g_slots[slot].state != BC_PENDING)
+         continue;
+
+      g_slots[slot].state = res >= (int) ((i + 1) * BLOCKSIZE)
+         ? BC_VALID : BC_EMPTY;
+      lruPush(slot);
+   }
+}
+
+
+/* Wait for any prefetch into slot to complete.
+ */
+static void waitFor(int slot)
+{
+   while (g_slots[slot].state == BC_PENDING)
+      aio_reap(1, prefetchDone, NULL);
+}
+
+
+/* Set up an empty overlay with room for size blocks, size a power of
+ * two.
+ *
+ * Returns 0 on success, -1 if memory can't be had.
+ */
+static int ovAlloc(unsigned int size)
+{
+   g_ovBlocks = malloc(size * sizeof(block_t));
+   g_ovNums = malloc(size * sizeof(unsigned int));
+   g_ovNext = malloc(size * sizeof(int));
+   g_ovHash = malloc(size * sizeof(int));
+
+   if (g_ovBlocks == NULL || g_ovNums == NULL || g_ovNext == NULL
+       || g_ovHash == NULL)
+   {
+      ovFree();
+      return -1;
+   }
+
+   g_ovMask = size - 1;
+   g_ovSize = size;
+   ovReset();
+   return 0;
+}
+
+
+/* Free the overlay.  Afterwards, writes go to the device.
+ */
+static void ovFree(void)
+{
+   free(g_ovBlocks);
+   free(g_ovNums);
+   free(g_ovNext);
+   free(g_ovHash);
+   g_ovBlocks = NULL;
+   g_ovNums = NULL;
+   g_ovNext = g_ovHash = NULL;
+   g_ovSize = g_ovUsed = 0;
+}
+
+
+/* Empty the overlay, keeping its memory for the next writes.
+ */
+static void ovReset(void)
+{
+   unsigned int i;
+
+   for (i = 0; i < g_ovSize; i++)
+      g_ovHash[i] = BC_NONE;
+   g_ovUsed = 0;
+}
+
+
+/* Returns the overlay's index for block blocknum, or BC_NONE.
+ */
+static int ovLookup(unsigned int blocknum)
+{
+   int i;
+
+   for (i = g_ovHash[blocknum & g_ovMask];
+        i != BC_NONE && g_ovNums[i] != blocknum; i = g_ovNext[i])
+      ;
+
+   return i;
+}
+
+
+/* Copy buf into the overlay as block blocknum, replacing any earlier
+ * copy.  The overlay doubles in size when it fills up, and its hash
+ * table with it.
+ *
+ * Returns 0 on success, -1 if memory can't be had.
+ */
+static int ovPut(const uint8_t *buf, unsigned int blocknum)
+{
+   unsigned int size = g_ovSize * 2;
+   unsigned int i;
+   int j;
+   void *p;
+
+   if ((j = ovLookup(blocknum)) == BC_NONE)
+   {
+      if (g_ovUsed == g_ovSize)
+      {
+         if ((p = realloc(g_ovBlocks, size * sizeof(block_t))) == NULL)
+            return -1;
+         g_ovBlocks = p;
+         if ((p = realloc(g_ovNums, size * sizeof(unsigned int))) == NULL)
+            return -1;
+         g_ovNums = p;
+         if ((p = realloc(g_ovNext, size * sizeof(int))) == NULL)
+            return -1;
+         g_ovNext = p;
+         if ((p = realloc(g_ovHash, size * sizeof(int))) == NULL)
+            return -1;
+         g_ovHash = p;
+
+         g_ovSize = size;
+         g_ovMask = size - 1;
+         for (i = 0; i < size; i++)
+            g_ovHash[i] = BC_NONE;
+         for (i = 0; i < g_ovUsed; i++)
+         {
+            g_ovNext[i] = g_ovHash[g_ovNums[i] & g_ovMask];
+            g_ovHash[g_ovNums[i] & g_ovMask] = i;
+         }
+      }
+
+      j = g_ovUsed++;
+      g_ovNums[j] = blocknum;
+      g_ovNext[j] = g_ovHash[blocknum & g_ovMask];
+      g_ovHash[blocknum & g_ovMask] = j;
+   }
+
+   memcpy(g_ovBlocks[j], buf, BLOCKSIZE);
+   return 0;
+}
+
+
+/* qsort() comparison of two overlay indexes by block number.
+ */
+static int ovCompare(const void *a, const void *b)
+{
+   unsigned int x = g_ovNums[*(const unsigned int *) a];
+   unsigned int y = g_ovNums[*(const unsigned int *) b];
+
+   return x < y ? -1 : x > y;
+}
+
+
+/* Gather the count overlay blocks order lists, which have consecutive
+ * block numbers, into g_run and write them with one request.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int ovWrite(const unsigned int *order, unsigned int count)
+{
+   unsigned int first = g_ovNums[order[0]];
+   unsigned int i;
+
+   for (i = 0; i < count; i++)
+      memcpy(g_run[i], g_ovBlocks[order[i]], BLOCKSIZE);
+
+   if (bd_write(&g_bcDev, g_run[0], first, count) == -1)
+      return -1;
+
+   g_bcPos = first + count;
+   return 0;
+}
@@ -0,0 +1,144 @@
+/***********************************************************************
+ * bcache.h
+ *
+ * Block cache between the file system layer and the driver.  Blocks
+ * read through the cache are kept, least recently used first out, and
+ * blocks can be prefetched: bc_prefetch() queues asynchronous reads
+ * through the aio engine, and a later bc_read() of a prefetched block
+ * waits only for that block's read to complete.  Writes go through to
+ * the device immediately, unless the cache has an overlay: then written
+ * blocks are kept in memory, reads see them in place of the device's
+ * copies, and the device is left alone until the overlay is committed.
+ * A batch of writes is held the same way until it is flushed, so its
+ * blocks reach the device sorted and merged into runs.
+ ***********************************************************************/
+
+
+#ifndef __BCACHE_H
+#define __BCACHE_H
+
+
+#include "blockdev.h"
+
+
+/* Set up a cache of capacity blocks for the block device dev.  The
+ * cache keeps a copy of dev; the device is not closed by bc_exit().
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_init(const blockdev_t *dev, unsigned int capacity);
+
+
+/* Discard the cache, waiting for any prefetches still in flight.
+ */
+void bc_exit(void);
+
+
+/* Read physical block blocknum into buf, from the cache if possible.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_read(block_t buf, unsigned int blocknum);
+
+
+/* Write buf to physical block blocknum, updating the cache.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_write(block_t buf, unsigned int blocknum);
+
+
+/* Write the count blocks in buf to count consecutive physical blocks,
+ * starting with blocknum, with one write to the device.  Cached copies
+ * of the blocks are updated.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_writerun(const uint8_t *buf, unsigned int blocknum, unsigned int count);
+
+
+/* Queue reads of the n physical blocks listed in blocknums, which are
+ * not waited for.  Runs of consecutive block numbers are read with one
+ * request.  Blocks already cached or in flight are skipped, and
+ * prefetching stops early if the cache or the aio queue fills up.
+ */
+void bc_prefetch(const unsigned int *blocknums, unsigned int n);
+
+
+/* Set the number of blocks per track.  If it is not 0, prefetches are
+ * widened to the whole of each track they touch, which a drive reads in
+ * about the time it takes to read part of it.  Tracks longer than
+ * AIO_MAX_IOV blocks aren't widened to.
+ */
+void bc_geometry(unsigned int trackBlocks);
+
+
+/* Read len bytes, starting at the beginning of physical block blocknum,
+ * into buf with one read from the device, bypassing the cache.  A
+ * partial last block costs a second read.  Blocks in the overlay are
+ * copied over the device's data.
+ *
+ * May be called from several threads at once, as long as nothing writes
+ * to the cache or the overlay meanwhile: it changes no shared state, and
+ * only looks blocks up in the overlay.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_readrun(uint8_t *buf, unsigned int blocknum, size_t len);
+
+
+/* Start keeping written blocks in an overlay instead of writing them to
+ * the device.  Does nothing if there is an overlay already.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_overlay(void);
+
+
+/* Write the overlay's blocks to the device and empty the overlay.  The
+ * blocks are sorted, consecutive blocks are merged into one write, and
+ * the runs are written in elevator order: up from the last block
+ * transferred, then down.  On failure the overlay is kept, so the commit
+ * can be tried again.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_commit(void);
+
+
+/* Drop the overlay's blocks, and any cached copies of them, so reads see
+ * the device again.  The overlay stays in place, empty.
+ *
+ * Returns 0 on success, -1 if there is no overlay.
+ */
+int bc_discard(void);
+
+
+/* Start a batch of writes, which are held until bc_flush().  Does
+ * nothing if there is an overlay.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_batch(void);
+
+
+/* Write the blocks of the batch begun by bc_batch() as bc_commit() does,
+ * and end the batch.  Does nothing if there is no batch.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bc_flush(void);
+
+
+/* Returns the number of blocks in the overlay. */
+unsigned int bc_dirty(void);
+
+
+/* Returns the number of the count consecutive blocks, starting with
+ * blocknum, that are in the overlay, so that the device's copies of them
+ * are out of date.
+ */
+unsigned int bc_held(unsigned int blocknum, unsigned int count);
+
+
+#endif
@@ -0,0 +1,227 @@
+/***********************************************************************
+ * bench.c
+ *
+ * Benchmarks for the vectorized kernels in vecops.c.  Each kernel is run
+ * at every implementation level the CPU supports, over a FAT16-sized
+ * table and a directory of DIR_BLOCKS blocks, and its output is checked
+ * against the scalar kernel's.
+ *
+ * Usage: bench [entries]
+ ***********************************************************************/
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+#include "vecops.h"
+
+
+#define DEFAULT_ENTRIES 65536
+#define REPEAT 200
+#define DIR_BLOCKS 64
+#define DIR_BYTES (DIR_BLOCKS * VEC_DIR_ENTRIES * VEC_DIRENT_SIZE)
+
+
+double now(void);
+double benchLevel(int level, unsigned int n, const uint8_t *packed,
+                  const uint16_t *fat, uint16_t *unpacked, uint8_t *repacked,
+                  unsigned int *found);
+double benchDir(const uint8_t *dir, dirmasks_t *masks);
+void makeDir(uint8_t *dir);
+
+
+int main(int argc, char *argv[])
+{
+   unsigned int n = argc > 1 ? (unsigned int) atoi(argv[1]) : DEFAULT_ENTRIES;
+   unsigned int i;
+   unsigned int found[2];
+   unsigned int scalarFound[2];
+   int level;
+   int actual;
+   double scalar = 0.0;
+   double t;
+   static uint8_t dir[DIR_BYTES];
+   static dirmasks_t masks[DIR_BLOCKS];
+   static dirmasks_t scalarMasks[DIR_BLOCKS];
+   uint8_t *packed;
+   uint8_t *repacked;
+   uint16_t *fat;
+   uint16_t *unpacked;
+   uint16_t *scalarUnpacked;
+
+   n &= ~1u;
+   packed = malloc(3 * n / 2 + 1);
+   repacked = malloc(3 * n / 2 + 1);
+   fat = malloc(n * sizeof(uint16_t));
+   unpacked = malloc(n * sizeof(uint16_t));
+   scalarUnpacked = malloc(n * sizeof(uint16_t));
+   assert(packed && repacked && fat && unpacked && scalarUnpacked);
+
+   /* A nearly full FAT: the only run of 16 free clusters is near the
+    * end, with isolated free clusters in the last quarter.
+    */
+   srand(1);
+   for (i = 0; i < n; i++)
+      fat[i] = (uint16_t) (1 + rand() % 0xff0);
+   for (i = 3 * n / 4; i < n; i += 97)
+      fat[i] = 0;
+   for (i = n - 40; i < n - 24; i++)
+      fat[i] = 0;
+
+   for (i = 0; i < 3 * n / 2; i++)
+      packed[i] = (uint8_t) rand();
+
+   makeDir(dir);
+
+   printf("%u entries, %d directory blocks, %d repetitions\n\n", n,
+          DIR_BLOCKS, REPEAT);
+   printf("%-8s %12s %12s %12s %12s %12s %9s\n", "level", "unpack12",
+          "pack12", "findfree(1)", "findfree(16)", "scandir", "speedup");
+
+   for (level = VEC_SCALAR; level <= VEC_AVX2; level++)
+   {
+      if ((actual = vec_setlevel(level)) != level)
+         continue;
+
+      memset(unpacked, 0, n * sizeof(uint16_t));
+      memset(repacked, 0, 3 * n / 2);
+      memset(found, 0, sizeof found);
+      memset(masks, 0, sizeof masks);
+
+      t = benchLevel(level, n, packed, fat, unpacked, repacked, found);
+      t += benchDir(dir, masks);
+
+      /* Every level must agree with the scalar kernels. */
+      if (level == VEC_SCALAR)
+      {
+         scalar = t;
+         memcpy(scalarUnpacked, unpacked, n * sizeof(uint16_t));
+         memcpy(scalarFound, found, sizeof found);
+         memcpy(scalarMasks, masks, sizeof masks);
+      }
+      else
+      {
+         assert(memcmp(scalarUnpacked, unpacked, n * sizeof(uint16_t)) == 0);
+         assert(memcmp(scalarFound, found, sizeof found) == 0);
+         assert(memcmp(scalarMasks, masks, sizeof masks) == 0);
+      }
+      assert(memcmp(packed, repacked, 3 * n / 2) == 0);
+
+      printf("%8.2fx\n", scalar / t);
+   }
+
+   free(packed);
+   free(repacked);
+   free(fat);
+   free(unpacked);
+   free(scalarUnpacked);
+   return 0;
+}
+
+
+/* Returns the current time in seconds.
+ */
+double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/* Time the kernels at the currently selected level and print a row of
+ * per-call times in microseconds.  unpacked receives the unpacked form
+ * of packed, repacked receives the result of packing it again, and found
+ * receives the results of the two free-run searches of fat.
+ *
+ * Returns the total time per repetition of all the kernels.
+ */
+double benchLevel(int level, unsigned int n, const uint8_t *packed,
+                  const uint16_t *fat, uint16_t *unpacked, uint8_t *repacked,
+                  unsigned int *found)
+{
+   int r;
+   int k;
+   double start;
+   double t[4];
+
+   start = now();
+   for (r = 0; r < REPEAT; r++)
+      vec_unpack12(unpacked, packed, n);
+   t[0] = (now() - start) / REPEAT;
+
+   start = now();
+   for (r = 0; r < REPEAT; r++)
+      vec_pack12(repacked, unpacked, n);
+   t[1] = (now() - start) / REPEAT;
+
+   start = now();
+   for (r = 0; r < REPEAT; r++)
+      found[0] = vec_findfree(fat, 2, n, 1);
+   t[2] = (now() - start) / REPEAT;
+
+   start = now();
+   for (r = 0; r < REPEAT; r++)
+      found[1] = vec_findfree(fat, 2, n, 16);
+   t[3] = (now() - start) / REPEAT;
+
+   printf("%-8s", vec_levelname(level));
+   for (k = 0; k < 4; k++)
+      printf(" %10.1fus", t[k] * 1e6);
+
+   return t[0] + t[1] + t[2] + t[3];
+}
+
+
+/* Time scanning every block of the directory dir for a name and print
+ * the per-call time for the whole directory, in microseconds.  masks
+ * receives the masks of each block.
+ *
+ * Returns the time per repetition.
+ */
+double benchDir(const uint8_t *dir, dirmasks_t *masks)
+{
+   int r;
+   int b;
+   double start;
+   double t;
+
+   start = now();
+   for (r = 0; r < REPEAT; r++)
+      for (b = 0; b < DIR_BLOCKS; b++)
+         vec_scandir(dir + b * VEC_DIR_ENTRIES * VEC_DIRENT_SIZE,
+                     (const uint8_t *) "FILE0999TXT", &masks[b]);
+   t = (now() - start) / REPEAT;
+
+   printf(" %10.1fus", t * 1e6);
+   return t;
+}
+
+
+/* Fill dir with a mix of file, free, deleted, hidden and long file name
+ * entries, ending with an end-of-directory marker.
+ */
+void makeDir(uint8_t *dir)
+{
+   int i;
+   int entries = DIR_BYTES / VEC_DIRENT_SIZE;
+   uint8_t *entry;
+
+   memset(dir, 0, DIR_BYTES);
+
+   for (i = 0; i < entries - 5; i++)
+   {
+      entry = dir + i * VEC_DIRENT_SIZE;
+      sprintf((char *) entry, "FILE%04dTXT", i);
+      entry[11] = (uint8_t) (rand() % 4 == 0 ? 0x0f : rand() % 0x40);
+      entry[12] = (uint8_t) rand();
+
+      if (rand() % 8 == 0)
+         entry[0] = 0xe5;
+   }
+}
@@ -0,0 +1,386 @@
+/***********************************************************************
+ * blockdev.c
+ *
+ * Block device backends.  See blockdev.h for documentation.
+ *
+ * The file backend keeps the driver's device descriptor as its context.
+ * The RAM disk backend keeps the whole image in one buffer.
+ *
+ * The simulated drive keeps a clock, the cylinder the head is over, and
+ * the geometry.  The disk's rotational position is the clock modulo the
+ * time of a revolution, and sector s of a track passes under the head
+ * s sector times into each revolution, so the sectors of one request
+ * follow each other without waiting.  A mutex serializes requests, as
+ * the drive would.
+ ***********************************************************************/
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include "blockdev.h"
+
+
+/* Timing of the simulated drive, in microseconds: the time of a
+ * revolution at 300 RPM, a step of one cylinder, the head settling after
+ * a seek, and the controller's handling of a command.  The command time
+ * is why a request for the sector after the previous request's last one
+ * waits most of a revolution.
+ */
+#define SIM_REVOLUTION 200000
+#define SIM_STEP 3000
+#define SIM_SETTLE 15000
+#define SIM_COMMAND 2000
+
+
+/* A RAM disk: blocks blocks of data. */
+typedef struct ramdisk_t
+{
+   uint8_t *data;
+   unsigned int blocks;
+} ramdisk_t;
+
+
+/* A simulated drive in front of the device lower. */
+typedef struct simdrive_t
+{
+   blockdev_t lower;
+   bdsimstats_t *stats;
+   unsigned int trackBlocks;
+   unsigned int heads;
+   unsigned int sectorTime;
+   unsigned int cylinder;
+   pthread_mutex_t lock;
+} simdrive_t;
+
+
+/* Prototypes for private helper functions. */
+static int fileRead(void *ctx, uint8_t *buf, unsigned int blocknum,
+                    unsigned int count);
+static int fileWrite(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                     unsigned int count);
+static int fileClose(void *ctx);
+static int ramRead(void *ctx, uint8_t *buf, unsigned int blocknum,
+                   unsigned int count);
+static int ramWrite(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                    unsigned int count);
+static int ramClose(void *ctx);
+static void simSeek(simdrive_t *sim, unsigned int blocknum,
+                    unsigned int count);
+static int simRead(void *ctx, uint8_t *buf, unsigned int blocknum,
+                   unsigned int count);
+static int simWrite(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                    unsigned int count);
+static int simClose(void *ctx);
+
+
+/* Backend operations tables. */
+static const bdops_t fileops = { fileRead, fileWrite, fileClose };
+static const bdops_t ramops = { ramRead, ramWrite, ramClose };
+static const bdops_t simops = { simRead, simWrite, simClose };
+
+
+int bd_openfile(blockdev_t *dev, const char *pathname)
+{
+   int fd;
+
+   if ((fd = fdimgopen(pathname)) == -1)
+      return -1;
+
+   dev->ops = &fileops;
+   dev->ctx = (void *) (intptr_t) fd;
+   dev->fd = fd;
+   return 0;
+}
+
+
+int bd_openram(blockdev_t *dev, const char *pathname)
+{
+   int fd;
+   struct stat st;
+   ramdisk_t *ram;
+   size_t done = 0;
+   ssize_t n = 0;
+
+   if ((fd = open(pathname, O_RDONLY)) == -1)
+      return -1;
+
+   if (fstat(fd, &st) == -1 || st.st_size < BLOCKSIZE
+       || (ram = malloc(sizeof(ramdisk_t))) == NULL)
+   {
+      close(fd);
+      return -1;
+   }
+
+   ram->blocks = st.st_size / BLOCKSIZE;
+   if ((ram->data = malloc((size_t) ram->blocks * BLOCKSIZE)) == NULL)
+   {
+      free(ram);
+      close(fd);
+      return -1;
+   }
+
+   while (done < (size_t) ram->blocks * BLOCKSIZE)
+   {
+      n = read(fd, ram->data + done, (size_t) ram->blocks * BLOCKSIZE - done);
+      if (n == -1 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         break;
+      done += n;
+   }
+   close(fd);
+
+   if (n <= 0)
+   {
+      ramClose(ram);
+      return -1;
+   }
+
+   dev->ops = &ramops;
+   dev->ctx = ram;
+   dev->fd = -1;
+   return 0;
+}
+
+
+int bd_opensim(blockdev_t *dev, const blockdev_t *lower, bdsimstats_t *stats)
+{
+   block_t boot;
+   simdrive_t *sim;
+
+   /* The sectors per track and head counts are 16 bit little endian
+    * fields at offsets 24 and 26 of the boot block.
+    */
+   if (bd_read(lower, boot, 0, 1) == -1
+       || (boot[24] | boot[25] << 8) == 0 || (boot[26] | boot[27] << 8) == 0
+       || (sim = malloc(sizeof(simdrive_t))) == NULL)
+      return -1;
+
+   sim->lower = *lower;
+   sim->stats = stats;
+   sim->trackBlocks = boot[24] | boot[25] << 8;
+   sim->heads = boot[26] | boot[27] << 8;
+   sim->sectorTime = SIM_REVOLUTION / sim->trackBlocks;
+   sim->cylinder = 0;
+   pthread_mutex_init(&sim->lock, NULL);
+
+   dev->ops = &simops;
+   dev->ctx = sim;
+   dev->fd = -1;
+   return 0;
+}
+
+
+int bd_read(const blockdev_t *dev, uint8_t *buf, unsigned int blocknum,
+            unsigned int count)
+{
+   return dev->ops->read(dev->ctx, buf, blocknum, count);
+}
+
+
+int bd_write(const blockdev_t *dev, const uint8_t *buf,
+             unsigned int blocknum, unsigned int count)
+{
+   return dev->ops->write(dev->ctx, buf, blocknum, count);
+}
+
+
+int bd_close(blockdev_t *dev)
+{
+   int rv = dev->ops->close != NULL ? dev->ops->close(dev->ctx) : 0;
+
+   dev->ops = NULL;
+   dev->ctx = NULL;
+   dev->fd = -1;
+   return rv;
+}
+
+
+/* Read count blocks from the image file with pread().
+ */
+static int fileRead(void *ctx, uint8_t *buf, unsigned int blocknum,
+                    unsigned int count)
+{
+   int fd = (int) (intptr_t) ctx;
+   size_t len = (size_t) count * BLOCKSIZE;
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len)
+   {
+      n = pread(fd, buf + done, len - done,
+                (off_t) blocknum * BLOCKSIZE + done);
+      if (n == -1 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      done += n;
+   }
+
+   return 0;
+}
+
+
+/* Write count blocks to the image file with pwrite().
+ */
+static int fileWrite(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                     unsigned int count)
+{
+   int fd = (int) (intptr_t) ctx;
+   size_t len = (size_t) count * BLOCKSIZE;
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len)
+   {
+      n = pwrite(fd, buf + done, len - done,
+                 (off_t) blocknum * BLOCKSIZE + done);
+      if (n == -1 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      done += n;
+   }
+
+   return 0;
+}
+
+
+/* Close the image file through the driver.
+ */
+static int fileClose(void *ctx)
+{
+   return fdimgclose((int) (intptr_t) ctx);
+}
+
+
+/* Copy count blocks out of the RAM disk.
+ */
+static int ramRead(void *ctx, uint8_t *buf, unsigned int blocknum,
+                   unsigned int count)
+{
+   ramdisk_t *ram = ctx;
+
+   if (blocknum > ram->blocks || count > ram->blocks - blocknum)
+      return -1;
+
+   memcpy(buf, ram->data + (size_t) blocknum * BLOCKSIZE,
+          (size_t) count * BLOCKSIZE);
+   return 0;
+}
+
+
+/* Copy count blocks into the RAM disk.
+ */
+static int ramWrite(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                    unsigned int count)
+{
+   ramdisk_t *ram = ctx;
+
+   if (blocknum > ram->blocks || count > ram->blocks - blocknum)
+      return -1;
+
+   memcpy(ram->data + (size_t) blocknum * BLOCKSIZE, buf,
+          (size_t) count * BLOCKSIZE);
+   return 0;
+}
+
+
+/* Free the RAM disk.
+ */
+static int ramClose(void *ctx)
+{
+   ramdisk_t *ram = ctx;
+
+   free(ram->data);
+   free(ram);
+   return 0;
+}
+
+
+/* Charge the simulated drive for a request of count blocks starting with
+ * block blocknum.  The caller holds the drive's lock.
+ */
+static void simSeek(simdrive_t *sim, unsigned int blocknum,
+                    unsigned int count)
+{
+   bdsimstats_t *st = sim->stats;
+   unsigned int revolution = sim->sectorTime * sim->trackBlocks;
+   unsigned int cylinder;
+   unsigned int start;
+   unsigned int angle;
+   unsigned int i;
+
+   st->requests++;
+   st->blocks += count;
+   st->time += SIM_COMMAND;
+
+   for (i = 0; i < count; i++)
+   {
+      cylinder = (blocknum + i) / (sim->trackBlocks * sim->heads);
+      if (cylinder != sim->cylinder)
+      {
+         st->seeks++;
+         st->time += SIM_SETTLE + (unsigned long long) SIM_STEP
+            * (cylinder > sim->cylinder ? cylinder - sim->cylinder
+               : sim->cylinder - cylinder);
+         sim->cylinder = cylinder;
+      }
+
+      /* Wait for the sector to come around, then transfer it. */
+      start = (blocknum + i) % sim->trackBlocks * sim->sectorTime;
+      angle = st->time % revolution;
+      st->time += (start + revolution - angle) % revolution + sim->sectorTime;
+   }
+}
+
+
+/* Read count blocks through the simulated drive.
+ */
+static int simRead(void *ctx, uint8_t *buf, unsigned int blocknum,
+                   unsigned int count)
+{
+   simdrive_t *sim = ctx;
+   int rv;
+
+   pthread_mutex_lock(&sim->lock);
+   simSeek(sim, blocknum, count);
+   rv = bd_read(&sim->lower, buf, blocknum, count);
+   pthread_mutex_unlock(&sim->lock);
+
+   return rv;
+}
+
+
+/* Write count blocks through the simulated drive.
+ */
+static int simWrite(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                    unsigned int count)
+{
+   simdrive_t *sim = ctx;
+   int rv;
+
+   pthread_mutex_lock(&sim->lock);
+   simSeek(sim, blocknum, count);
+   rv = bd_write(&sim->lower, buf, blocknum, count);
+   pthread_mutex_unlock(&sim->lock);
+
+   return rv;
+}
+
+
+/* Close the simulated drive and the device behind it.
+ */
+static int simClose(void *ctx)
+{
+   simdrive_t *sim = ctx;
+   int rv = bd_close(&sim->lower);
+
+   pthread_mutex_destroy(&sim->lock);
+   free(sim);
+   return rv;
+}
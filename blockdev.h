@@ -0,0 +1,112 @@
+/***********************************************************************
+ * blockdev.h
+ *
+ * Block device backends.  A block device is a table of operations and
+ * the backend's private context, chosen when the volume is mounted, so
+ * the file system can run on an image file, on a RAM disk loaded from an
+ * image, or on callbacks supplied by the caller.  Blocks are BLOCKSIZE
+ * bytes and are transferred in runs of consecutive blocks.
+ ***********************************************************************/
+
+
+#ifndef __BLOCKDEV_H
+#define __BLOCKDEV_H
+
+
+#include "driver.h"
+
+
+/* Backend operations.  read and write transfer count consecutive blocks,
+ * starting with block blocknum, and return 0 on success or -1 on
+ * failure.  read may be called from several threads at once, but never
+ * at the same time as write.  close releases the backend and returns 0
+ * on success or -1 on failure; it may be NULL.
+ */
+typedef struct bdops_t
+{
+   int (*read)(void *ctx, uint8_t *buf, unsigned int blocknum,
+               unsigned int count);
+   int (*write)(void *ctx, const uint8_t *buf, unsigned int blocknum,
+                unsigned int count);
+   int (*close)(void *ctx);
+} bdops_t;
+
+
+/* A block device.  fd is a file descriptor holding the device's blocks,
+ * on which reads may be issued asynchronously, or -1 if there is none.
+ */
+typedef struct blockdev_t
+{
+   const bdops_t *ops;
+   void *ctx;
+   int fd;
+} blockdev_t;
+
+
+/* Open the image in the file pathname, through the driver, as the block
+ * device dev.  Blocks are read and written with one system call per run.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bd_openfile(blockdev_t *dev, const char *pathname);
+
+
+/* Load the image in the file pathname into memory as the block device
+ * dev.  Writes change only the copy in memory, which is freed when the
+ * device is closed.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bd_openram(blockdev_t *dev, const char *pathname);
+
+
+/* Totals kept by a simulated drive.  time is in microseconds. */
+typedef struct bdsimstats_t
+{
+   unsigned long requests;
+   unsigned long blocks;
+   unsigned long seeks;
+   unsigned long long time;
+} bdsimstats_t;
+
+
+/* Open the block device dev as a simulated floppy drive in front of the
+ * block device lower.  Every request is passed on to lower and charged
+ * the time a 300 RPM drive would take: the controller's handling of the
+ * command, a seek to the request's cylinder, the rotation until each
+ * sector comes under the head, and the sector's transfer.  The geometry
+ * is taken from the sectors per track and head counts in lower's boot
+ * block.  The totals are added to *stats, which must outlive dev.  dev
+ * owns lower and closes it when it is closed.
+ *
+ * Returns 0 on success.  Otherwise, returns -1 and lower is left open.
+ */
+int bd_opensim(blockdev_t *dev, const blockdev_t *lower, bdsimstats_t *stats);
+
+
+/* Read count consecutive blocks, starting with block blocknum, from dev
+ * into buf.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bd_read(const blockdev_t *dev, uint8_t *buf, unsigned int blocknum,
+            unsigned int count);
+
+
+/* Write count consecutive blocks from buf to dev, starting with block
+ * blocknum.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bd_write(const blockdev_t *dev, const uint8_t *buf,
+             unsigned int blocknum, unsigned int count);
+
+
+/* Close dev.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+int bd_close(blockdev_t *dev);
+
+
+#endif
@@ -10,23 +10,76 @@
  * You'll need to use mdir and/or dosfsck to truly determine if you
  * implementations of fd_del(), fd_creat(), and fd_append() are working
  * correctly.
+ *
+ * The FAT16 tests at the end run on a volume built from scratch by
+ * makefat16(), so they write to it whether or not TEST_WRITES is
+ * defined.  The image is removed once they pass.
  ***********************************************************************/
 
-/* Uncomment the following to test fd_del(), fd_creat(), and fd_append().
- * Once writes have been made to the floppy image, it must be restored
- * to its original state before rerunning this program.
+/* Uncomment the following to test fd_del(), fd_creat(), fd_append(),
+ * and the other operations that write to the floppy image: long file
+ * names, renaming, truncation and reserved clusters, overlays, lazy
+ * mounts, index files, and large directories.  The floppy image is left
+ * as the fd_del(), fd_creat(), and fd_append() tests leave it, but once
+ * writes have been made, it must be restored to its original state
+ * before rerunning this program.
  */
 //#define TEST_WRITES
 
 
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include "fsops.h"
+#include "fstypes.h"
+
+
+/* The FAT16 volume built by makefat16(): 4MB, one block per cluster, a
+ * 512 entry root directory, and no files.
+ */
+#define FAT16_IMAGE "exercise16.img"
+#define FAT16_BLOCKS 8192
+#define FAT16_FAT_BLOCKS 33
+#define FAT16_CLUSTERS (FAT16_BLOCKS - 1 - 2 * FAT16_FAT_BLOCKS - 32)
+
+/* The index file used to test fd_index(). */
+#define INDEX_FILE "exercise.idx"
+
+
+/* Looks for the entry with a given long name during fd_iterdir(). */
+struct findlong
+{
+   const char *longName;
+   char name[13];              /* The entry's short name, or "" */
+};
+
+
+static int makefat16(const char *img);
+static int findlongfn(const struct fd_dirent *entry, void *arg);
+
+
+/* Buffers for fd_read_many() and for checking it against fd_read(). */
+static char manyBufs[4][32768];
+static char oneBuf[32768];
 
 
 int main(void)
 {
+   struct fd_readreq reqs[4] =
+   {
+      { "FILE1.TXT", manyBufs[0], 0, sizeof(manyBufs[0]), 0 },
+      { "FILEK.TXT", manyBufs[1], 1000, 10000, 0 },
+      { "SUB/SUBSUB/FILE2.TXT", manyBufs[2], 0, sizeof(manyBufs[2]), 0 },
+      { "NOFILE.TXT", manyBufs[3], 0, sizeof(manyBufs[3]), 0 }
+   };
+   struct fd_statfs before;
+   struct fd_statfs st;
+   struct fd_statfs after;
+   struct findlong find;
+   blockdev_t bd;
+   char name[32];
    int dev;
+   int i;
 
    assert((dev = fd_mount("floppyData.img")) != -1);
 
@@ -108,6 +161,30 @@ int main(void)
    assert(fd_cd("..") == 0);
    assert(fd_cd("NEW") == 0);
 
+   printf("============================================================"
+          "==========\n");
+   printf ("Reading FILE1.TXT, FILEK.TXT, and SUB/SUBSUB/FILE2.TXT at "
+           "once\n");
+   printf("============================================================"
+          "==========\n");
+   assert(fd_read_many(reqs, 4) == 3);
+   assert(reqs[0].result == 1538);
+   assert(reqs[1].result == 10000);
+   assert(reqs[2].result == 9062);
+   assert(reqs[3].result == -1);
+   for (i = 0; i < 2; i++)
+   {
+      assert(fd_read(reqs[i].path, reqs[i].offset, oneBuf, reqs[i].len)
+             == reqs[i].result);
+      assert(memcmp(manyBufs[i], oneBuf, reqs[i].result) == 0);
+   }
+   assert(fd_cd("SUB") == 0);
+   assert(fd_cd("SUBSUB") == 0);
+   assert(fd_read("FILE2.TXT", 0, oneBuf, sizeof(oneBuf)) == 9062);
+   assert(memcmp(manyBufs[2], oneBuf, 9062) == 0);
+   assert(fd_cd("..") == 0);
+   assert(fd_cd("..") == 0);
+
 #ifdef TEST_WRITES
 
    printf("============================================================"
@@ -182,6 +259,214 @@ int main(void)
    assert(fd_cd("..") == 0);
    assert(fd_del("TROUBLE.TXT") == 35);
 
+   printf("============================================================"
+          "==========\n");
+   printf ("Creating long file names\n");
+   printf("============================================================"
+          "==========\n");
+   assert(fd_statfs(&before) == 0);
+   assert(fd_mkdir("Projects", 0) == 0);
+   find.longName = "Projects";
+   find.name[0] = '\0';
+   assert(fd_iterdir(NULL, 0, findlongfn, &find) > 0);
+   assert(strcmp(find.name, "PROJEC~1") == 0);
+   assert(fd_mkdir("PROJECTS", 0) == -1);
+   assert(fd_cd("projects") == 0);
+   assert(fd_creat(".bashrc") == 0);
+   assert(fd_creat(".BASHRC") == -1);
+   assert(fd_creat(".") == -1);
+   assert(fd_creat("..") == -1);
+   assert(fd_creat("A much longer name.text") == 0);
+   assert(fd_append("A much longer name.text", "This is some data.\r\n", 20)
+          == 20);
+   assert(fd_creat("README.TXT") == 0);
+   find.longName = "";
+   find.name[0] = '\0';
+   assert(fd_iterdir(NULL, FD_DIR_NODOTS, findlongfn, &find) > 0);
+   assert(strcmp(find.name, "README.TXT") == 0);
+   assert(fd_dir(0) == 5);
+   assert(fd_type("a much longer NAME.TEXT") == 20);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Renaming and moving files and directories\n");
+   printf("============================================================"
+          "==========\n");
+   assert(fd_rename(".bashrc", ".profile") == 0);
+   assert(fd_type(".bashrc") == -1);
+   assert(fd_type(".profile") == 0);
+   assert(fd_rename(".profile", "README.TXT") == -1);
+   assert(fd_rename("NOFILE.TXT", "SOMEFILE.TXT") == -1);
+   assert(fd_cd("..") == 0);
+   assert(fd_rename("Projects/.profile", "NEW") == 0);
+   assert(fd_cd("NEW") == 0);
+   assert(fd_type(".profile") == 0);
+   assert(fd_del(".profile") == 0);
+   assert(fd_cd("..") == 0);
+   assert(fd_rename("Projects", "Projects/Inner") == -1);
+   assert(fd_mkdir("Inner", 0) == 0);
+   assert(fd_rename("Inner", "Projects") == 0);
+   assert(fd_cd("Inner") == -1);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_cd("Inner") == 0);
+   assert(fd_cd("..") == 0);
+   assert(fd_type("A much longer name.text") == 20);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Reserving and truncating clusters\n");
+   printf("============================================================"
+          "==========\n");
+   assert(fd_statfs(&st) == 0);
+   assert(fd_fallocate("A much longer name.text", 10 * st.clusterBytes)
+          == 9);
+   assert(fd_statfs(&after) == 0);
+   assert(after.freeClusters == st.freeClusters - 9);
+   assert(fd_type("A much longer name.text") == 20);
+   assert(fd_append("A much longer name.text", oneBuf, 2 * st.clusterBytes)
+          == (int) (2 * st.clusterBytes));
+   assert(fd_statfs(&after) == 0);
+   assert(after.freeClusters == st.freeClusters - 9);
+   assert(fd_truncate("A much longer name.text", 100) == 9);
+   assert(fd_truncate("A much longer name.text", 200) == -1);
+   assert(fd_truncate("Inner", 0) == -1);
+   assert(fd_fallocate("Inner", 0) == -1);
+   assert(fd_statfs(&after) == 0);
+   assert(after.freeClusters == st.freeClusters);
+   assert(fd_fallocate("A much longer name.text", 8 * st.clusterBytes)
+          == 7);
+   assert(fd_unmount(dev) != -1);
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_statfs(&after) == 0);
+   assert(after.freeClusters == st.freeClusters);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_type("A much longer name.text") == 100);
+   assert(fd_unmount(dev) != -1);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Discarding and committing an overlay\n");
+   printf("============================================================"
+          "==========\n");
+   assert((dev = fd_overlay("floppyData.img")) != -1);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_creat("Scratch file") == 0);
+   assert(fd_append("Scratch file", oneBuf, 3000) == 3000);
+   assert(fd_discard(dev) > 0);
+   assert(fd_type("A much longer name.text") == -1);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_type("Scratch file") == -1);
+   assert(fd_creat("Scratch file") == 0);
+   assert(fd_append("Scratch file", oneBuf, 3000) == 3000);
+   assert(fd_commit(dev) > 0);
+   assert(fd_discard(dev) == 0);
+   assert(fd_unmount(dev) != -1);
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_read("Scratch file", 0, manyBufs[0], 4000) == 3000);
+   assert(memcmp(manyBufs[0], oneBuf, 3000) == 0);
+   assert(fd_unmount(dev) != -1);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Writing to a lazily mounted volume\n");
+   printf("============================================================"
+          "==========\n");
+   assert(bd_openfile(&bd, "floppyData.img") == 0);
+   assert((dev = fd_mountlazy(&bd)) != -1);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_type("A much longer name.text") == 100);
+   assert(fd_del("Scratch file") == 6);
+   assert(fd_creat("Lazy.txt") == 0);
+   assert(fd_append("Lazy.txt", oneBuf, 1000) == 1000);
+   assert(fd_statfs(&after) == 0);
+   assert(fd_unmount(dev) != -1);
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_statfs(&st) == 0);
+   assert(st.freeClusters == after.freeClusters);
+   assert(st.files == after.files);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_read("Lazy.txt", 0, manyBufs[0], 4000) == 1000);
+   assert(memcmp(manyBufs[0], oneBuf, 1000) == 0);
+   assert(fd_unmount(dev) != -1);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Saving and loading an index file\n");
+   printf("============================================================"
+          "==========\n");
+   remove(INDEX_FILE);
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_index(INDEX_FILE) == 0);
+   assert(fd_statfs(&st) == 0);
+   assert(fd_unmount(dev) != -1);
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_index(INDEX_FILE) == 1);
+   assert(fd_statfs(&after) == 0);
+   assert(memcmp(&st, &after, sizeof(st)) == 0);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_del("Lazy.txt") == 2);
+   assert(fd_statfs(&st) == 0);
+   assert(fd_unmount(dev) != -1);
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_index(INDEX_FILE) == 1);
+   assert(fd_statfs(&after) == 0);
+   assert(memcmp(&st, &after, sizeof(st)) == 0);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_type("Lazy.txt") == -1);
+   assert(fd_unmount(dev) != -1);
+   assert(remove(INDEX_FILE) == 0);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Filling a directory with 200 long file names\n");
+   printf("============================================================"
+          "==========\n");
+   assert((dev = fd_mount("floppyData.img")) != -1);
+   assert(fd_cd("Projects") == 0);
+   assert(fd_mkdir("Many", 200 * 3) == 0);
+   assert(fd_cd("Many") == 0);
+   for (i = 0; i < 200; i++)
+   {
+      sprintf(name, "Entry number %d", i);
+      assert(fd_creat(name) == 0);
+   }
+   for (i = 0; i < 200; i += 2)
+   {
+      sprintf(name, "ENTRY NUMBER %d", i);
+      assert(fd_del(name) == 0);
+   }
+   for (i = 0; i < 200; i++)
+   {
+      sprintf(name, "entry number %d", i);
+      assert(fd_type(name) == (i % 2 == 0 ? -1 : 0));
+      assert(fd_creat(name) == (i % 2 == 0 ? 0 : -1));
+   }
+   assert(fd_dir(0) == 202);
+   for (i = 0; i < 200; i++)
+   {
+      sprintf(name, "Entry number %d", i);
+      assert(fd_del(name) == 0);
+   }
+   assert(fd_dir(0) == 2);
+
+   printf("============================================================"
+          "==========\n");
+   printf ("Removing the long file name tests\n");
+   printf("============================================================"
+          "==========\n");
+   assert(fd_cd("..") == 0);
+   assert(fd_rmdir("Many") > 0);
+   assert(fd_rmdir("Inner") == 1);
+   assert(fd_del("A much longer name.text") == 1);
+   assert(fd_del("README.TXT") == 0);
+   assert(fd_cd("..") == 0);
+   assert(fd_rmdir("Projects") > 0);
+   assert(fd_statfs(&after) == 0);
+   assert(after.freeClusters == before.freeClusters);
+   assert(after.files == before.files);
+   assert(after.dirs == before.dirs);
+
    printf("\n\nRun\n"
           "   /sbin/dosfsck -v floppyData.img\n"
           "and check for errors.\n");
@@ -193,5 +478,128 @@ int main(void)
 
    assert(fd_unmount(dev) != -1);
 
+   printf("============================================================"
+          "==========\n");
+   printf ("Building and filling a FAT16 volume\n");
+   printf("============================================================"
+          "==========\n");
+   assert(makefat16(FAT16_IMAGE) == 0);
+   assert((dev = fd_mount(FAT16_IMAGE)) != -1);
+   assert(fd_statfs(&before) == 0);
+   assert(before.clusterBytes == BLOCKSIZE);
+   assert(before.clusters == FAT16_CLUSTERS);
+   assert(before.freeClusters == FAT16_CLUSTERS);
+   assert(fd_dir(0) == 0);
+   for (i = 0; i < (int) sizeof(oneBuf); i++)
+      oneBuf[i] = 'a' + i % 26;
+   assert(fd_mkdir("Sub", 0) == 0);
+   assert(fd_cd("Sub") == 0);
+   assert(fd_creat("A large file.dat") == 0);
+   find.longName = "A large file.dat";
+   find.name[0] = '\0';
+   assert(fd_iterdir(NULL, 0, findlongfn, &find) > 0);
+   assert(strcmp(find.name, "ALARGE~1.DAT") == 0);
+   for (i = 0; i < 80; i++)
+      assert(fd_append("A large file.dat", oneBuf, sizeof(oneBuf))
+             == (int) sizeof(oneBuf));
+   assert(fd_read("A large file.dat", 4500 * BLOCKSIZE + 10, manyBufs[0],
+                  1000) == 1000);
+   assert(memcmp(manyBufs[0], oneBuf + (4500 * BLOCKSIZE + 10)
+                 % sizeof(oneBuf), 1000) == 0);
+   assert(fd_cd("..") == 0);
+   for (i = 0; i < 100; i++)
+   {
+      sprintf(name, "ROOT%03d.TXT", i);
+      assert(fd_creat(name) == 0);
+      assert(fd_append(name, oneBuf, i) == i);
+   }
+   assert(fd_dir(0) == 101);
+   assert(fd_statfs(&st) == 0);
+   assert(st.files == 101);
+   assert(st.dirs == 1);
+   assert(fd_unmount(dev) != -1);
+
+   assert(bd_openfile(&bd, FAT16_IMAGE) == 0);
+   assert((dev = fd_mountlazy(&bd)) != -1);
+   assert(fd_type("ROOT099.TXT") == 99);
+   assert(fd_cd("Sub") == 0);
+   assert(fd_truncate("A large file.dat", 1000) == 5118);
+   assert(fd_statfs(&after) == 0);
+   assert(after.freeClusters == st.freeClusters + 5118);
+   assert(fd_unmount(dev) != -1);
+   assert(remove(FAT16_IMAGE) == 0);
+
    return 0;
 }
+
+
+/* Write an empty FAT16 volume, as described above FAT16_IMAGE, to the
+ * file img.
+ *
+ * Returns 0 on success.  Otherwise, returns -1.
+ */
+static int makefat16(const char *img)
+{
+   static uint8_t block[BLOCKSIZE];
+   bootblock_t *boot = (bootblock_t *) block;
+   FILE *fp;
+   int fat;
+
+   if ((fp = fopen(img, "wb")) == NULL)
+      return -1;
+
+   memset(block, 0, sizeof(block));
+   memcpy(boot->ignore1, "\xeb\x3c\x90MKFAT16 ", 11);
+   boot->bytesPerSector = BLOCKSIZE;
+   boot->sectorsPerCluster = 1;
+   boot->numReservedSectors = 1;
+   boot->numFATs = 2;
+   boot->maxNumRootDirEntries = 512;
+   boot->totalSectors = FAT16_BLOCKS;
+   boot->ignore2 = 0xf8;
+   boot->sectorsPerFAT = FAT16_FAT_BLOCKS;
+   boot->sectorsPerTrack = 32;
+   boot->numHeads = 2;
+   boot->bootSignature = 0x29;
+   boot->volumeId = 0x16161616;
+   memcpy(boot->volumeLabel, "EXERCISE16 ", 11);
+   memcpy(boot->filesystemType, "FAT16   ", 8);
+   block[BLOCKSIZE - 2] = 0x55;
+   block[BLOCKSIZE - 1] = 0xaa;
+   fwrite(block, BLOCKSIZE, 1, fp);
+
+   /* The first two entries of each FAT hold the media byte and an end
+    * of chain mark.  The rest of the image is left as a hole of zeros.
+    */
+   memset(block, 0, sizeof(block));
+   memcpy(block, "\xf8\xff\xff\xff", 4);
+   for (fat = 0; fat < 2; fat++)
+   {
+      fseek(fp, (long) (1 + fat * FAT16_FAT_BLOCKS) * BLOCKSIZE, SEEK_SET);
+      fwrite(block, BLOCKSIZE, 1, fp);
+   }
+
+   fseek(fp, (long) FAT16_BLOCKS * BLOCKSIZE - 1, SEEK_SET);
+   if (fputc(0, fp) == EOF || ferror(fp))
+   {
+      fclose(fp);
+      return -1;
+   }
+
+   return fclose(fp) == 0 ? 0 : -1;
+}
+
+
+/* fd_iterdir() callback: copy the short name of the entry whose long
+ * name is fl->longName, or "" for an entry without one, and stop.
+ */
+static int findlongfn(const struct fd_dirent *entry, void *arg)
+{
+   struct findlong *fl = arg;
+
+   if (strcmp(entry->longName, fl->longName) != 0)
+      return 0;
+
+   strcpy(fl->name, entry->name);
+   return 1;
+}
@@ -13,6 +13,12 @@
  *    - Ensure that we can't create a file using an in-use name.
  *    - Ensure that a file in a sub-directory can be deleted correctly.
  *    - Ensure that we can't append to a file that doesn't exist.
+ *    - Ensure that we can't create or rename "." or "..".
+ *    - Ensure that we can't rename a file that doesn't exist, or onto an
+ *      in-use name.
+ *    - Ensure that we can't truncate a file to more than its size.
+ *    - Ensure that we can't reserve clusters for a directory.
+ *    - Ensure that we can't discard changes without an overlay.
  ***********************************************************************/
 
 
@@ -53,6 +59,14 @@ int main(void)
    assert(fd_del("FILEJ.TXT") == 51);
    assert(fd_dir(0) == 21);
    assert(fd_append("NOFILE.TXT", "Data", 4) == -1);
+   assert(fd_creat(".") == -1);
+   assert(fd_creat("..") == -1);
+   assert(fd_rename("..", "OLD") == -1);
+   assert(fd_rename("NOFILE.TXT", "SOMEFILE.TXT") == -1);
+   assert(fd_rename("FILE1.TXT", "FILEK.TXT") == -1);
+   assert(fd_truncate("FILE1.TXT", 2000) == -1);
+   assert(fd_fallocate("SUB", 1000) == -1);
+   assert(fd_discard(dev) == -1);
 
    assert(fd_unmount(dev) != -1);
 
@@ -0,0 +1,82 @@
+/***********************************************************************
+ * fdproto.h
+ *
+ * Wire protocol of the image server.  A client sends a request header
+ * followed by len bytes of arguments, and the server answers each
+ * request, in order, with a reply header followed by len bytes of
+ * results.  The server and its clients run on the same host, so fields
+ * are in host byte order.
+ *
+ * Path and name arguments are null terminated strings, one after
+ * another; data, for FDP_APPEND, follows the last string.  status is
+ * the return value of the fd_* function the request maps to, or -1 if
+ * the request is malformed.  Each connection has its own current
+ * working directory, which starts at the root.
+ ***********************************************************************/
+
+
+#ifndef __FDPROTO_H
+#define __FDPROTO_H
+
+
+#include <stdint.h>
+
+
+/* Largest argument or result payload, in bytes. */
+#define FDP_MAX_PAYLOAD (16 * 1024 * 1024)
+
+
+/* Request operations, with their arguments and results.  Unless noted
+ * otherwise, a reply carries only status.
+ */
+#define FDP_CD 1         /* dir */
+#define FDP_LIST 2       /* [dir]; arg[0] fd_iterdir() flags; entries */
+#define FDP_READ 3       /* file; arg[0] offset, arg[1] length; data */
+#define FDP_CREAT 4      /* file */
+#define FDP_DEL 5        /* file */
+#define FDP_MKDIR 6      /* dir; arg[0] entries hint */
+#define FDP_RMDIR 7      /* dir */
+#define FDP_COPY 8       /* src, dst */
+#define FDP_RENAME 9     /* oldPath, newPath */
+#define FDP_APPEND 10    /* file, data */
+#define FDP_TRUNCATE 11  /* file; arg[0] size */
+#define FDP_FALLOCATE 12 /* file; arg[0] size */
+#define FDP_DU 13        /* [dir]; a struct fd_usage */
+#define FDP_IMPORT 14    /* hostPath, file */
+#define FDP_EXPORT 15    /* imageDir, hostDir */
+#define FDP_COMMIT 16
+#define FDP_DISCARD 17
+#define FDP_STATFS 18    /* a struct fd_statfs */
+
+
+/* Request header. */
+typedef struct fdp_req_t
+{
+   uint32_t len;
+   uint32_t op;
+   uint32_t arg[2];
+} fdp_req_t;
+
+
+/* Reply header. */
+typedef struct fdp_rep_t
+{
+   uint32_t len;
+   int32_t status;
+} fdp_rep_t;
+
+
+/* An FDP_LIST result entry, followed by nameLen bytes of 8.3 name and
+ * longLen bytes of long name, neither null terminated.
+ */
+typedef struct fdp_entry_t
+{
+   uint32_t size;
+   uint32_t cluster;
+   uint16_t attributes;
+   uint8_t nameLen;
+   uint8_t longLen;
+} fdp_entry_t;
+
+
+#endif
@@ -3,125 +3,871 @@
  *
  * Tom Kelliher, Goucher College (c) 2016
  *
- * DOS FAT12 filesystem operations for Project 5.  Refer to the
+ * DOS FAT12/FAT16 filesystem operations for Project 5.  Refer to the
  * documentation below and to the project description.
  ***********************************************************************/
 
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <ctype.h>
 #include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
 #include "fstypes.h"
 #include "fsops.h"
+#include "vecops.h"
+#include "bcache.h"
+
+
+/* Maximum length of an 8.3 format file name, including the terminating
+ * null character, plus some slack.
+ */
+#define NAME_LEN 16
+
+/* Number of blocks in the block cache. */
+#define CACHE_BLOCKS 4096
+
+/* Number of blocks a chain walk keeps queued for reading ahead of its
+ * position.  See chainStart().
+ */
+#define RA_BLOCKS 256
+
+/* Size of the buffers fd_import() and fd_export() stream file data
+ * through.  A multiple of BLOCKSIZE.
+ */
+#define XFER_CHUNK (1024 * 1024)
+
+/* Number of worker threads fd_export() extracts files with.  Extraction
+ * is I/O bound, so this needn't match the number of processors.
+ */
+#define EXPORT_WORKERS 8
+
+/* Number of worker threads fd_read_many() reads with. */
+#define READ_WORKERS 8
+
+/* Deepest directory nesting the tree walker follows, which keeps a
+ * directory loop in a damaged image from being followed forever.
+ */
+#define MAX_DEPTH 64
+
+/* States of a directory usage aggregate. */
+#define AGG_EMPTY 0
+#define AGG_VALID 1
+#define AGG_STALE 2
+
+/* Maximum length of a path, including the terminating null character. */
+#define PATH_LEN 256
+
+/* Maximum length of a path built by the tree walker, including the
+ * terminating null character.
+ */
+#define WALK_PATH_LEN 4096
+
+/* Long file name entries: the characters each holds, the most a name
+ * can have, and the sequence number flag marking the last one.
+ */
+#define LFN_CHARS 13
+#define LFN_ENTRIES 20
+#define LFN_LAST 0x40
+
+/* Most directories whose long file name index is kept.  See
+ * lfnindex().
+ */
+#define LFN_INDEXES 32
+
+/* Most directories whose entry map is kept.  See dirmap(). */
+#define DIR_MAPS 32
+
+/* Number of clusters covered by each leaf of the free space tree.  See
+ * freeupdate().
+ */
+#define FREE_GROUP 64
+
+/* First bytes of an index file, and the length n of a section of one
+ * padded so that the next section is aligned.  See fd_index().
+ */
+#define INDEX_MAGIC "FDINDEX1"
+#define INDEX_PAD(n) (((size_t) (n) + 7) & ~(size_t) 7)
+
+/* Starting value of a 64-bit FNV-1a hash. */
+#define FNV_BASIS 0xcbf29ce484222325ull
+
+
+/* A FAT entry codec.  The codec matching the volume's FAT width is
+ * selected at mount time.  The FAT is unpacked into 16-bit entries when
+ * the volume is mounted, and modified regions are packed again when it
+ * is flushed; everything else is independent of the width.  A region is
+ * the smallest run of whole blocks holding a whole number of entries.
+ */
+typedef struct fatcodec_t
+{
+   unsigned int regionEntries;
+   unsigned int regionBlocks;
+   void (*unpack)(uint16_t *dst, const uint8_t *src, unsigned int n);
+   void (*pack)(uint8_t *dst, const uint16_t *src, unsigned int n);
+   unsigned int eocMin;   /* Smallest end-of-chain marker */
+   unsigned int eoc;      /* End-of-chain marker written by this code */
+   unsigned int bad;      /* Bad cluster marker */
+} fatcodec_t;
+
+
+/* Position within a cluster chain: a cluster and a block offset within
+ * that cluster, plus the state of the walk's read-ahead.  See
+ * chainStart(), chainBlk() and chainNext().
+ */
+typedef struct chainpos_t
+{
+   unsigned int cluster;
+   unsigned int offset;
+   unsigned int window;      /* Read-ahead window, in blocks */
+   unsigned int raCluster;   /* Next cluster to read ahead */
+   unsigned int raBlocks;    /* Blocks queued at or after this position */
+} chainpos_t;
+
+
+/* A long file name being assembled from its entries.  The entries
+ * precede the short entry they belong to in reverse order: the one
+ * holding the end of the name, whose sequence number is flagged with
+ * LFN_LAST, comes first, and the one holding the start of the name,
+ * with sequence number 1, comes last.  Entries are numbered by their
+ * position in the directory.
+ */
+typedef struct lfnstate_t
+{
+   uint16_t chars[LFN_ENTRIES * LFN_CHARS + 1];
+   unsigned int seq;         /* Sequence number of the last entry, or 0 */
+   unsigned int next;        /* Position the next entry must be at */
+   unsigned int first;       /* Position of the name's first entry */
+   uint8_t checksum;
+} lfnstate_t;
+
+
+/* A slot of a long file name index. */
+typedef struct lfnslot_t
+{
+   uint32_t hash;
+   unsigned int name;        /* Offset in names plus 1, or 0 if empty */
+   uint8_t shortName[11];
+} lfnslot_t;
+
+
+/* Index of the long file names in a directory, mapping each name, case
+ * insensitively, to the short name of its entry.  The names are kept in
+ * names; the slots are a hash table with linear probing.
+ */
+typedef struct lfnindex_t
+{
+   unsigned int dir;
+   unsigned int size;        /* Slots, a power of two, or 0 */
+   unsigned int used;
+   lfnslot_t *slots;
+   char *names;
+   size_t namesLen;
+   size_t namesAlloc;
+   struct lfnindex_t *next;
+} lfnindex_t;
+
+
+/* Map of the entries of a directory, so that entries can be allocated
+ * and short names looked up without reading the directory.  For each
+ * block it keeps the mask of free entries, as from vec_scandir(), and
+ * for a sub-directory the block's physical block number.  The names of
+ * the live entries (see scanblock()) up to the first end marker, which
+ * are the ones a search sees, are kept by position in a hash table with
+ * chaining: buckets and links hold positions plus 1, or 0 at the end of
+ * a chain.
+ */
+typedef struct dirmap_t
+{
+   unsigned int dir;
+   unsigned int blocks;
+   unsigned int alloc;       /* Blocks there is room for */
+   unsigned int hint;        /* No block before this has a free entry */
+   unsigned int end;         /* First block with an end marker, or blocks */
+   unsigned int last;        /* Last cluster of a sub-directory */
+   uint16_t *free;
+   uint16_t *live;           /* Entries whose names are in the table */
+   unsigned int *blks;
+   uint8_t (*names)[11];
+   unsigned int *links;
+   unsigned int *buckets;
+   unsigned int nbuckets;    /* A power of two */
+   struct dirmap_t *next;
+} dirmap_t;
+
+
+/* A file or directory for fd_export() to create on the host.  Files
+ * are extracted by the workers; directories are created during the walk
+ * and only have their times set afterwards, once the files in them have
+ * been written.
+ */
+typedef struct exportjob_t
+{
+   char *path;                 /* Host path */
+   int isDir;
+   unsigned int cluster;       /* First cluster */
+   unsigned int size;
+   struct timespec times[2];   /* Access and modification times */
+} exportjob_t;
+
+
+/* State shared by fd_export() and its workers. */
+typedef struct exportctx_t
+{
+   exportjob_t *jobs;
+   unsigned int count;
+   unsigned int alloc;
+   unsigned int files;    /* Number of jobs that are files */
+   unsigned int next;     /* Next job for a worker to take */
+   unsigned int failed;   /* Number of jobs that failed */
+} exportctx_t;
+
+
+/* Argument for exportentry(). */
+typedef struct exportwalk_t
+{
+   exportctx_t *ctx;
+   const char *hostDir;
+} exportwalk_t;
+
+
+/* A run of consecutive blocks for fd_read_many() to read: len bytes,
+ * starting at the beginning of physical block blk, into out, for the
+ * request req.
+ */
+typedef struct readseg_t
+{
+   unsigned int blk;
+   unsigned int len;
+   uint8_t *out;
+   unsigned int req;
+} readseg_t;
+
+
+/* State shared by fd_read_many() and its workers. */
+typedef struct readctx_t
+{
+   struct fd_readreq *reqs;
+   readseg_t *segs;
+   unsigned int count;
+   unsigned int alloc;
+   unsigned int next;     /* Next segment for a worker to take */
+} readctx_t;
+
+
+/* A directory being walked by walktree(): its entries, the next one to
+ * visit, and the length of the directory's path.
+ */
+typedef struct walkframe_t
+{
+   struct fd_dirent *entries;
+   int count;
+   int next;
+   size_t pathLen;
+} walkframe_t;
+
+
+/* Called by walktree() after the entries below the directory entry have
+ * been walked.  complete is false if the directory couldn't be read.
+ */
+typedef void (*walkleave_t)(const struct fd_dirent *entry,
+                            unsigned int depth, int complete, void *arg);
+
+
+/* Cached usage totals of the sub-tree below a directory, keyed by the
+ * directory's first cluster (0 for the root).  parent is the parent
+ * directory's first cluster, so that a change to a directory can mark
+ * the aggregates of all the directories above it stale too.
+ */
+typedef struct aggregate_t
+{
+   unsigned int cluster;
+   unsigned int parent;
+   int state;
+   struct fd_usage usage;
+} aggregate_t;
+
+
+/* State of an aggregate computation: running totals and first clusters
+ * of the directories on the walker's path, by depth.
+ */
+typedef struct aggctx_t
+{
+   struct fd_usage totals[MAX_DEPTH + 1];
+   unsigned int clusters[MAX_DEPTH + 1];
+   int error;
+} aggctx_t;
+
+
+/* State of an fd_iterdir() or readentries() call.  If fn is NULL, the
+ * entries are collected in entries.
+ */
+typedef struct iterctx_t
+{
+   unsigned int flags;
+   fd_dirfn fn;
+   void *arg;
+   int count;
+   int stopped;
+   struct fd_dirent *entries;
+   unsigned int alloc;
+} iterctx_t;
+
+
+/* Header of an index file, followed by the free space tree, the valid
+ * directory usage aggregates, and the long file name indexes, each an
+ * indexlfn_t followed by its slots and names.  See fd_index().  layout
+ * encodes the sizes of the structures, so that an index written by a
+ * different build is rejected.  The fields before bodySum identify the
+ * volume and image; bodySum is a checksum of everything after it.
+ */
+typedef struct indexhdr_t
+{
+   char magic[8];
+   uint32_t layout;
+   uint32_t volumeId;
+   uint64_t fatSum;
+   int64_t imageSize;
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint32_t numClusters;
+   uint32_t freeLeaves;
+   uint64_t bodySum;
+   uint32_t freeClusters;
+   uint32_t badClusters;
+   uint32_t countsValid;
+   uint32_t files;
+   uint32_t dirs;
+   uint32_t aggCount;
+   uint32_t lfnCount;
+} indexhdr_t;
+
+
+/* A long file name index in an index file. */
+typedef struct indexlfn_t
+{
+   uint32_t dir;
+   uint32_t size;
+   uint32_t used;
+   uint32_t namesLen;
+} indexlfn_t;
+
+
+/* Free space summary of a range of clusters: the lengths of the run of
+ * free clusters at its start, of the run at its end, and of its longest
+ * run.  See freeupdate().
+ */
+typedef struct freerun_t
+{
+   unsigned int head;
+   unsigned int tail;
+   unsigned int longest;
+} freerun_t;
 
 
 /* Private global variables. */
 
-/* In-memory cached copy of floppy image's FAT. */
-static fat_t g_fat;
-/* In-memory cached copy of floppy images's root directory. */
-static root_t g_root;
+/* Geometry of the mounted volume. */
+static fsgeom_t g_geom;
+/* Codec for the mounted volume's FAT entries. */
+static const fatcodec_t *g_codec;
+/* In-memory cached copy of the image's first FAT, unpacked into one
+ * 16-bit element per entry.  Covers whole codec regions, so it may be
+ * slightly longer than the FAT itself.
+ */
+static uint16_t *g_fat;
+/* Number of codec regions in the FAT. */
+static unsigned int g_fatRegions;
+/* One flag per FAT region; set if the cached region differs from disk. */
+static uint8_t *g_fatDirty;
+/* One flag per FAT region; set once the region has been read into the
+ * cache.  g_fatMissing regions haven't been.  See fatfault().
+ */
+static uint8_t *g_fatResident;
+static unsigned int g_fatMissing;
+/* In-memory cached copy of the image's root directory, g_geom.rootBlocks
+ * blocks long.
+ */
+static uint8_t *g_root;
+/* One flag per root directory block; set if the cached block differs
+ * from disk.
+ */
+static uint8_t *g_rootDirty;
+/* One flag per root directory block; set once the block has been read
+ * into the cache.  See rootblock().
+ */
+static uint8_t *g_rootResident;
+/* Cluster at which the next search for a free FAT entry starts. */
+static unsigned int g_nextFree = 2;
 /* if cwdHead == 0, the root directory is the current working directory.
- * Otherwise, cwdHead holds the logical block number of the first
- * block of the current working directory.
+ * Otherwise, cwdHead holds the number of the first cluster of the
+ * current working directory.
  */
 static unsigned int g_cwdHead = 0;
 /* Device number of mounted floppy disk image. */
 static int g_dev = -1;
+/* Block device of the mounted image. */
+static blockdev_t g_bdev;
+/* Hash table of directory usage aggregates, g_aggSize entries, with
+ * linear probing.  g_aggUsed entries are in use.
+ */
+static aggregate_t *g_agg = NULL;
+static unsigned int g_aggSize = 0;
+static unsigned int g_aggUsed = 0;
+/* Long file name indexes, most recently used first. */
+static lfnindex_t *g_lfnIndexes = NULL;
+/* Directory entry maps, most recently used first. */
+static dirmap_t *g_dirMaps = NULL;
+/* Free space summaries of the data clusters, as a binary tree in an
+ * array: node 1 is the root, the children of node n are nodes 2n and
+ * 2n + 1, and the g_freeLeaves leaves each cover FREE_GROUP clusters.
+ */
+static freerun_t *g_freeTree = NULL;
+static unsigned int g_freeLeaves = 0;
+/* Numbers of free and bad clusters, kept by putfatentry() once
+ * g_freeValid is set.  See freebuild().
+ */
+static unsigned int g_freeClusters = 0;
+static unsigned int g_badClusters = 0;
+static int g_freeValid = 0;
+/* Numbers of files and sub-directories on the volume, kept up to date
+ * once g_countsValid is set.
+ */
+static unsigned int g_files = 0;
+static unsigned int g_dirs = 0;
+static int g_countsValid = 0;
+/* Path of the index file written at unmount, or NULL.  See fd_index(). */
+static char *g_indexPath = NULL;
+/* First clusters of the files given reserved clusters by fd_fallocate(),
+ * g_spareUsed of g_spareAlloc.  See releasespare().
+ */
+static unsigned int *g_spare = NULL;
+static unsigned int g_spareUsed = 0;
+static unsigned int g_spareAlloc = 0;
 
 
 /* Prototypes for private helper functions.  Prototypes for public
  * API functions should be in fsops.h
  */
-static int fd_dir_root(int showAll);
-static int fd_dir_subdir(int showAll);
+static int readgeom(const bootblock_t *boot, fsgeom_t *geom);
+static void freecaches(void);
+static int flushfat(void);
+static void flushroot(void);
+static int mountdev(const blockdev_t *dev, int lazy);
+static int loadmeta(void);
+static void dropmeta(void);
+static int fatfault(unsigned int first, unsigned int end);
+static int rootfault(unsigned int first, unsigned int end);
+static uint8_t *rootblock(unsigned int b);
+static int indexstat(indexhdr_t *hdr);
+static int loadindex(const char *path);
+static int indexvalid(const uint8_t *map, size_t len, const indexhdr_t *want);
+static int saveindex(const char *path);
+static uint64_t fnv64(uint64_t sum, const uint8_t *buf, size_t len);
+static uint32_t indexlayout(void);
+static int walkdir(unsigned int dir,
+                   int (*visit)(const direntry_t *direntry,
+                                const char *longName, void *arg),
+                   void *arg);
+static int resolveDir(const char *path, unsigned int *cluster);
+static int readentries(unsigned int dir, unsigned int flags,
+                       struct fd_dirent **entries);
+static void sortentries(struct fd_dirent *entries, int count,
+                        unsigned int flags);
+static int walktree(unsigned int dir, unsigned int flags, fd_walkfn visit,
+                    walkleave_t leave, void *arg);
+static int aggvisit(const char *path, const struct fd_dirent *entry,
+                    unsigned int depth, void *arg);
+static void aggleave(const struct fd_dirent *entry, unsigned int depth,
+                     int complete, void *arg);
+static void addusage(struct fd_usage *sum, const struct fd_usage *usage);
+static aggregate_t *aggfind(unsigned int cluster);
+static aggregate_t *aggstore(unsigned int cluster, unsigned int parent,
+                             const struct fd_usage *usage);
+static void aggdirty(unsigned int dir);
+static unsigned int parentdir(unsigned int dir);
+static int exportentry(const char *path, const struct fd_dirent *entry,
+                       unsigned int depth, void *arg);
+static exportjob_t *addjob(exportctx_t *ctx, const char *hostDir,
+                           const char *path, const struct fd_dirent *entry);
+static void *exportworker(void *arg);
+static int exportfile(const exportjob_t *job, uint8_t *buf);
+static int sendrun(int outFd, unsigned int blk, unsigned int len,
+                   int *zeroCopy, uint8_t **buf);
+static int planread(readctx_t *ctx, unsigned int req);
+static int addseg(readctx_t *ctx, unsigned int blk, unsigned int len,
+                  uint8_t *out, unsigned int req);
+static int cmpseg(const void *a, const void *b);
+static void *readworker(void *arg);
+static void fattime(const struct fd_time *t, struct timespec *ts);
 static int direntryFree(const direntry_t *direntry);
 static int hidden(const direntry_t *direntry);
 static int subdirectory(const direntry_t *direntry);
 static int longFN(const direntry_t *direntry);
-static void list(const direntry_t *direntry);
+static int list(const struct fd_dirent *entry, void *arg);
+static int iterentry(const direntry_t *direntry, const char *longName,
+                     void *arg);
+static void decodeentry(const direntry_t *direntry, const char *longName,
+                        struct fd_dirent *entry);
+static const char *entryname(const struct fd_dirent *entry);
+static void decodetime(unsigned int date, unsigned int time,
+                       struct fd_time *t);
+static int cmpname(const void *a, const void *b);
+static int cmpsize(const void *a, const void *b);
+static int cmptime(const void *a, const void *b);
 static char *getfilename(const direntry_t *direntry, char *fn);
+static char *upcase(char *buf, const char *name);
+static int packname(const char *name, uint8_t *packed);
+static int packpattern(const char *pattern, uint8_t *packed);
+static int wildcard(const char *name);
+static int matchname(const uint8_t *pattern, const direntry_t *direntry);
+static int matchcwd(const uint8_t *pattern,
+                    int (*fn)(direntry_t *direntry, void *arg), void *arg);
+static int delentry(direntry_t *direntry, void *arg);
+static int typeentry(direntry_t *direntry, void *arg);
+static unsigned int typefile(const direntry_t *direntry);
+static uint8_t lfnchecksum(const uint8_t *name);
+static void lfnfeed(lfnstate_t *lfn, const uint8_t *ent, unsigned int index);
+static char *lfnname(lfnstate_t *lfn, const direntry_t *direntry,
+                     unsigned int index, char *buf);
+static unsigned int lfnentries(const dirmasks_t *masks);
+static void putlfnentry(uint8_t *ent, unsigned int seq, int last,
+                        const uint16_t *chars, uint8_t checksum);
+static char *utf16to8(const uint16_t *src, char *dst);
+static int longvalid(const char *name);
+static int utf8to16(const char *src, uint16_t *dst);
+static int shortname(const char *name);
+static int makealias(unsigned int dir, const char *name, char *alias);
+static int aliaschar(int c);
+static lfnindex_t *lfnindex(unsigned int dir);
+static int lfnadd(const direntry_t *direntry, const char *longName,
+                  void *arg);
+static int lfninsert(lfnindex_t *idx, uint32_t hash, unsigned int name,
+                     const uint8_t *shortName);
+static int lfnlookup(unsigned int dir, const char *name, uint8_t *packed);
+static void lfndrop(unsigned int dir);
+static void lfnfree(lfnindex_t *idx);
+static uint32_t lfnhash(const char *name);
+static int lfnequal(const char *a, const char *b);
+static int fold(int c);
+static dirmap_t *dirmap(unsigned int dir);
+static dirmap_t *dirmapfind(unsigned int dir);
+static int dirmapsize(dirmap_t *map, unsigned int blocks);
+static int dirmapblock(dirmap_t *map, unsigned int b, const uint8_t *entries);
+static const uint8_t *dirmapread(const dirmap_t *map, unsigned int b,
+                                 block_t block);
+static void dirmapscan(unsigned int dir, unsigned int index,
+                       const direntry_t *direntry);
+static int dirmapgrow(dirmap_t *map, unsigned int cluster);
+static int dirmaplookup(const dirmap_t *map, const uint8_t *packed);
+static void dirmaplink(dirmap_t *map, unsigned int pos);
+static void dirmapunlink(dirmap_t *map, unsigned int pos);
+static void dirmapdrop(unsigned int dir);
+static void dirmapfree(dirmap_t *map);
+static unsigned int namehash(const uint8_t *packed);
+static unsigned int scanblock(const uint8_t *block, const uint8_t *name,
+                              dirmasks_t *masks);
 static void putdirentry(direntry_t *direntry, const char *fn,
                         unsigned int attrib, struct tm *time,
                         unsigned int strtBlk, unsigned int size);
+static void touchdirentry(direntry_t *direntry, struct tm *entryTime);
+static unsigned int appendbytes(direntry_t *direntry, const char *data,
+                                unsigned int len);
+static ssize_t readfull(int fd, uint8_t *buf, unsigned int len);
+static int writefull(int fd, const uint8_t *buf, unsigned int len);
 static struct tm *getTime(void);
-static direntry_t *searchRoot(const char *name);
-static direntry_t *searchSubdir(const char *name, block_t block,
-                                unsigned int *blkindex);
-static direntry_t *getFreeRootEntry(void);
-static direntry_t *getFreeSubDirEntry(block_t block,
-                                      unsigned int *blkindex);
+static direntry_t *searchRoot(const uint8_t *packed);
+static direntry_t *searchSubdir(unsigned int dir, const uint8_t *packed,
+                                block_t block, unsigned int *blkindex);
+static direntry_t *searchDir(unsigned int dir, const char *name,
+                             block_t block, unsigned int *blkindex);
+static direntry_t *searchCwd(const char *name, block_t block,
+                             unsigned int *blkindex);
+static void writedirentry(unsigned int dir, const direntry_t *direntry,
+                          block_t block, unsigned int blkindex);
+static direntry_t *entryat(unsigned int dir, unsigned int index,
+                           block_t block, unsigned int *blkindex);
+static unsigned int entryindex(unsigned int dir, const direntry_t *direntry,
+                               block_t block, unsigned int blkindex);
+static unsigned int lfnfirst(unsigned int dir, unsigned int index,
+                             const direntry_t *direntry);
+static int allocslots(unsigned int dir, unsigned int count,
+                      unsigned int *first);
+static void eraserange(unsigned int dir, unsigned int from, unsigned int to);
+static void eraseentry(unsigned int dir, const direntry_t *direntry,
+                       block_t block, unsigned int blkindex);
+static int newentry(unsigned int dir, const char *file, unsigned int attrib,
+                    unsigned int cluster, unsigned int size);
+static int placeentry(unsigned int dir, const char *file,
+                      const direntry_t *record);
+static int creatlong(unsigned int dir, const char *name,
+                     const direntry_t *record);
+static char *longname(unsigned int dir, const direntry_t *direntry,
+                      block_t block, unsigned int blkindex, char *buf);
+static int initdir(unsigned int head, unsigned int parent);
+static int dotsonly(const direntry_t *direntry, const char *longName,
+                    void *arg);
+static int splitpath(const char *path, unsigned int *dir, char *name);
+static int clusterio(unsigned int *cluster, uint8_t *buf, unsigned int count,
+                     int write);
 static unsigned int ltop(unsigned int lblock);
-static unsigned int getFreeFatEntry(const fat_t fat);
-static unsigned int getfatentry(const fat_t fat, unsigned int index);
-static void putfatentry(fat_t fat, unsigned int index, unsigned int val);
+static void chainStart(chainpos_t *pos, unsigned int cluster,
+                       unsigned int window);
+static unsigned int chainBlk(const chainpos_t *pos);
+static void chainNext(chainpos_t *pos);
+static void readahead(chainpos_t *pos);
+static unsigned int getFreeFatEntry(const uint16_t *fat);
+static unsigned int allocCluster(unsigned int prev);
+static unsigned int allocClusters(unsigned int prev, unsigned int count,
+                                  unsigned int *head);
+static unsigned int freeChain(unsigned int first);
+static unsigned int cutChain(direntry_t *direntry, unsigned int keep);
+static unsigned int spareClusters(const direntry_t *direntry,
+                                  unsigned int *last);
+static int addspare(unsigned int cluster);
+static void releasespare(void);
+static int releasevisit(const char *path, const struct fd_dirent *entry,
+                        unsigned int depth, void *arg);
+static unsigned int getfatentry(const uint16_t *fat, unsigned int index);
+static int putfatentry(uint16_t *fat, unsigned int index, unsigned int val);
+static void freebuild(void);
+static void freeupdate(unsigned int index);
+static void freeleaf(unsigned int leaf, freerun_t *run);
+static void freemerge(freerun_t *run, const freerun_t *left,
+                      const freerun_t *right, unsigned int span);
+static void unpack16(uint16_t *dst, const uint8_t *src, unsigned int n);
+static void pack16(uint8_t *dst, const uint16_t *src, unsigned int n);
 static int lastBlk(unsigned int blknum);
 static int cwdIsRoot(void);
 
 
-/* Mount a floppy disk image.  img is the image's file name.  This
- * function also caches the image's FAT and root directory in private
- * global variables fat and root.
+/* The supported FAT entry codecs. */
+static const fatcodec_t fat12codec =
+   { 1024, 3, vec_unpack12, vec_pack12, 0xff8, 0xfff, 0xff7 };
+static const fatcodec_t fat16codec =
+   { 256, 1, unpack16, pack16, 0xfff8, 0xffff, 0xfff7 };
+
+
+/* Mount a FAT12 or FAT16 disk image.  img is the image's file name.
+ * The image is opened with the file backend and mounted with
+ * fd_mountdev().
  *
  * Returns the device number on success.  Otherwise, it returns -1.
  */
 int fd_mount(const char *img)
 {
-   int i;
-   /* readblock() works with blocks.  The following blocks variable is
-    * used to treat the fat and root caches as arrays of blocks.
-    */
-   block_t *blocks;
+   blockdev_t dev;
+   int rv;
 
-   if (g_dev != -1 || (g_dev = fdimgopen(img)) == -1)
+   if (g_dev != -1 || bd_openfile(&dev, img) == -1)
       return -1;
 
-   /* Cache the first FAT */
-   blocks = (block_t *) g_fat;
-   for (i = 0; i < FAT_BLOCKS; i++)
-      readblock(g_dev, blocks[i], i + FAT1_START);
+   if ((rv = fd_mountdev(&dev)) == -1)
+      bd_close(&dev);
+
+   return rv;
+}
 
-   /* Cache the root directory */
-   blocks = (block_t *) g_root;
-   for (i = 0; i < ROOT_BLOCKS; i++)
-      readblock(g_dev, blocks[i], i + ROOT_START);
 
-   return g_dev;
+/* Mount the FAT12 or FAT16 volume on the block device dev, which may use
+ * any backend.  The volume's geometry is read from the boot block.  This
+ * function also caches the volume's FAT and root directory in private
+ * global variables g_fat and g_root, and sets up the block cache through
+ * which data and sub-directory blocks are read.  On success the volume
+ * owns dev, and fd_unmount() closes it.
+ *
+ * Returns the device number on success: dev's file descriptor, or 0 if
+ * it has none.  Otherwise, it returns -1 and dev is left open.
+ */
+int fd_mountdev(const blockdev_t *dev)
+{
+   return mountdev(dev, 0);
+}
+
+
+/* Mount the volume on the block device dev as fd_mountdev() does, but
+ * read only the boot block up front.  Each FAT region and root
+ * directory block is read the first time it is used, so a caller that
+ * touches one file reads little more than that file's blocks, however
+ * large the volume.  Searching for free clusters, fd_statfs() and
+ * fd_export() read the rest of the FAT.
+ *
+ * Returns the device number on success, as for fd_mountdev().
+ * Otherwise, it returns -1 and dev is left open.
+ */
+int fd_mountlazy(const blockdev_t *dev)
+{
+   return mountdev(dev, 1);
 }
 
 
 
 /* Unmount the floppy disk image with device number dev.  This function
- * flushes the cached FAT and root directory to the image file before
- * unmounting it.
+ * flushes the modified regions of the cached FAT, to every FAT copy, and
+ * the modified blocks of the cached root directory to the image file
+ * before unmounting it and closing its block device.  The writes go out
+ * as one batch, sorted and merged.  If the image was mounted with
+ * fd_overlay(), changes not committed with fd_commit() are discarded
+ * instead.  Clusters reserved with fd_fallocate() that are still unused
+ * are freed first, and an index attached with fd_index() is written
+ * last.
  *
  * Returns 0 on success.  Otherwise, it returns -1;
  */
 int fd_unmount(int dev)
 {
-   int i;
-   int devTmp = dev;
-   /* writeblock() works with blocks.  The following blocks variable is
-    * used to treat the fat and root caches as arrays of blocks.
-    */
-   block_t *blocks;
+   if (dev == -1 || dev != g_dev)
+      return -1;
+
+   releasespare();
+   bc_batch();
+   flushfat();
+   flushroot();
+   bc_flush();
 
-   /* Write both FATs */
-   blocks = (block_t *) g_fat;
-   for (i = 0; i < FAT_BLOCKS; i++)
+   if (g_indexPath != NULL)
    {
-      writeblock(dev, blocks[i], i + FAT1_START);
-      writeblock(dev, blocks[i], i + FAT2_START);
+      if (bc_dirty() == 0)
+         saveindex(g_indexPath);
+      free(g_indexPath);
+      g_indexPath = NULL;
    }
 
-   /* Write the root directory */
-   blocks = (block_t *) g_root;
-   for (i = 0; i < ROOT_BLOCKS; i++)
-      writeblock(dev, blocks[i], i + ROOT_START);
-
+   bc_exit();
+   freecaches();
    g_dev = -1;
-   return fdimgclose(devTmp);
+   return bd_close(&g_bdev);
+}
+
+
+/* Mount an image as fd_mount() does, but with a copy-on-write overlay:
+ * written blocks are kept in memory, keyed by block number, and reads of
+ * other blocks fall through to the image, which isn't changed until
+ * fd_commit().  fd_discard() returns to the image as it is, so resetting
+ * a volume after a speculative change costs time in proportion to the
+ * blocks changed, not a copy of the image.
+ *
+ * Returns the device number on success.  Otherwise, it returns -1.
+ */
+int fd_overlay(const char *img)
+{
+   int dev;
+
+   if ((dev = fd_mount(img)) != -1 && bc_overlay() == -1)
+   {
+      fd_unmount(dev);
+      return -1;
+   }
+
+   return dev;
+}
+
+
+/* Write the changes made to the volume with device number dev, mounted
+ * with fd_overlay(), to the image.  The cached FAT and root directory are
+ * flushed to the overlay, and the overlay's blocks are written in block
+ * order.  The volume stays mounted with an empty overlay.  Without an
+ * overlay, only the FAT and root directory are flushed.  Either way,
+ * clusters reserved with fd_fallocate() that are still unused are freed
+ * first, as at unmount.
+ *
+ * Returns the number of blocks written on success.  Otherwise, it returns
+ * -1; the changes are still in the overlay.
+ */
+int fd_commit(int dev)
+{
+   unsigned int dirty;
+
+   if (dev == -1 || dev != g_dev)
+      return -1;
+
+   releasespare();
+   if (flushfat() == -1)
+      return -1;
+   flushroot();
+
+   dirty = bc_dirty();
+   return bc_commit() == -1 ? -1 : (int) dirty;
+}
+
+
+/* Drop the changes made to the volume with device number dev, mounted
+ * with fd_overlay(), since it was mounted or last committed.  The cached
+ * FAT and root directory are dropped, to be read from the image again as
+ * they are used, as are cached usage totals and long name indexes, and
+ * the root directory becomes the current working directory.
+ *
+ * Returns the number of blocks dropped on success.  Returns -1 if the
+ * volume has no overlay.
+ */
+int fd_discard(int dev)
+{
+   unsigned int dirty;
+
+   if (dev == -1 || dev != g_dev)
+      return -1;
+
+   dirty = bc_dirty();
+   if (bc_discard() == -1)
+      return -1;
+   dropmeta();
+
+   free(g_agg);
+   lfnfree(g_lfnIndexes);
+   dirmapfree(g_dirMaps);
+   free(g_spare);
+   g_agg = NULL;
+   g_aggSize = g_aggUsed = 0;
+   g_lfnIndexes = NULL;
+   g_dirMaps = NULL;
+   g_spare = NULL;
+   g_spareUsed = g_spareAlloc = 0;
+
+   g_nextFree = 2;
+   g_cwdHead = 0;
+   return dirty;
+}
+
+
+/* Attach the index file path to the mounted volume.  The index holds
+ * state that is otherwise rebuilt from the FAT and directories after
+ * each mount: the free space summary, the file and directory counts,
+ * the cached directory usage totals and the long file name indexes.  If
+ * path holds an index of the image as it is now, that state is loaded
+ * from it.  Either way, the index is written to path when the volume is
+ * unmounted, unless an overlay is left with uncommitted changes.
+ *
+ * An index is valid if it was written for the same volume ID, FAT
+ * contents, and image file size and modification time, so an image
+ * changed by anything else is caught.  The FAT is read in full to check
+ * it.  fd_index() should be called right after mounting, before the
+ * volume is changed.
+ *
+ * Returns 1 if the index was loaded, 0 if path holds no valid index, or
+ * -1 if the volume has no image file or path can't be kept.
+ */
+int fd_index(const char *path)
+{
+   indexhdr_t hdr;
+
+   if (g_dev == -1 || indexstat(&hdr) == -1)
+      return -1;
+
+   free(g_indexPath);
+   if ((g_indexPath = strdup(path)) == NULL)
+      return -1;
+
+   return loadindex(path) == 0;
 }
 
 
@@ -137,14 +883,16 @@ int fd_unmount(int dev)
  */
 int fd_dir(int showAll)
 {
+   unsigned int size = 0;
+   int count;
 
-  if (cwdIsRoot()){
-    return fd_dir_root(showAll);
-   }
-  else{
-    fd_dir_subdir(showAll);
-  }
-   return -1;
+   count = fd_iterdir(NULL, showAll ? FD_DIR_HIDDEN : 0, list, &size);
+
+   if (cwdIsRoot())
+      printf("# of Entries: %d\n# Bytes: %u\n", count, size);
+   else
+      printf("# Entries: %d\n# Bytes: %u\n", count, size);
+   return count;
 }
 
 
@@ -166,37 +914,65 @@ int fd_dir(int showAll)
  */
 int fd_cd(const char *dir)
 {
-  char sstring[16];
-  int i;
-  block_t block;
-  unsigned int bi;
-  direntry_t *direntry;
-  //prevents segmentation faults
-  if(dir == NULL) return -1;
-  //in case of edge cases
-  if ((unsigned char) dir[0] == (unsigned char) 0xe5) return -1;
-  //doesn't change directory because the root is it's own parent
-  if (strcmp(dir, "..") == 0 && cwdIsRoot()) return 0;
+   char name[FD_NAME_MAX + 1];
+   block_t block;
+   unsigned int bi;
+   direntry_t *direntry;
+
+   if (upcase(name, dir) == NULL)
+      return -1;
 
-  //turns string into an uppercase copy of dir
-  strcpy(sstring, dir);
-  for (i = 0; i < 16; i++){
-    sstring[i] = toupper(sstring[i]);}
+   /* The root is its own parent. */
+   if (strcmp(name, "..") == 0 && cwdIsRoot())
+      return 0;
 
-  if(cwdIsRoot()){
-    direntry = searchRoot(sstring);}
-  else direntry = searchSubDir(sstring, block, &bi);
+   if ((direntry = searchCwd(name, block, &bi)) == NULL
+       || !subdirectory(direntry))
+      return -1;
 
-  if (direntry == NULL) return -1;
-  if (!subdirectory(direntry)) return -1;
+   g_cwdHead = direntry->firstSector;
+   return 0;
+}
 
-  g_cwdHead = direntry->firstSector;
 
-  return 0;
 
+/* Returns the current working directory, as a handle for fd_setcwd():
+ * the first cluster of the directory, or 0 for the root.
+ */
+unsigned int fd_getcwd(void)
+{
+   return g_cwdHead;
 }
 
 
+/* Make the directory cwd, a handle returned by fd_getcwd(), the current
+ * working directory.  This lets several users of one mounted volume each
+ * keep their own working directory.  The directory may have been removed
+ * since its handle was taken, so its "." entry is checked.
+ *
+ * Returns 0 on success, -1 if cwd no longer names a directory.
+ */
+int fd_setcwd(unsigned int cwd)
+{
+   block_t block;
+   unsigned int bi;
+   direntry_t *direntry;
+
+   if (cwd != 0)
+   {
+      if (lastBlk(cwd) || getfatentry(g_fat, cwd) == 0)
+         return -1;
+
+      direntry = entryat(cwd, 0, block, &bi);
+      if (memcmp(direntry->filename, ".          ", 11) != 0
+          || !subdirectory(direntry) || direntry->firstSector != cwd)
+         return -1;
+   }
+
+   g_cwdHead = cwd;
+   return 0;
+}
+
 
 /* Type (list) the contents of file, located in the current working
  * directory.
@@ -209,126 +985,578 @@ int fd_cd(const char *dir)
  * If the first character of file is 0xe5, return -1.  If the file
  * corresponds to a directory, return -1.
  *
+ * file may also be a DOS wildcard pattern (see packpattern()), in which
+ * case every matching file is typed, in directory order, during one
+ * pass over the directory.
+ *
  * On success, returns the number of characters typed.  Otherwise, returns -1.
+ * For a pattern, returns -1 if no file matches.
  */
 int fd_type(const char *file)
 {
-  char string[16];
-  int i = 0;
-  int sec = 0;
-  int fsize = 0;
-  int nchar = 0;
-  block_t block;
-  unsigned int bindex;
-  direntry_t *direntry;
-
-  //in case of edge cases
-  if (file == NULL) return -1;
-  if ((unsigned char) file[0] == (unsigned char) 0xe5) return-1;
-
-  //turns string into an uppercase copy of the file
-  strcpy(string, file);
-  for (i = 0; i < 16; i++) string[i] = toupper(string[i]);
-  //searches in the direnty for the appropriate place
-  if (cwdIsRoot()) direntry = searchRoot(string);
-  else direntry = searchSubDir(string, block, &bindex);
-  //checks for failure
-  if (direntry == NULL) return -1;
-  if (subdirectory(direntry)) return -1;
-  //reads the file
-  sec = direntry->firstSector;
-  fsize = direntry->fileSize;
-
-  if (!sec) return -1;
-  //keeps reading while there is still more to read
-  while(!lastBlk(sec)){
-    readblock(g_dev, block, ltop(sec));
-    sec = getfatentry(g_fat, sec);
-    for (i=0; i < BLOCKSIZE && nchar < fsize; i++) {
-      putchar(block[i]);
-      nchar++;
-    }
-  }
-  return nchar;
-}
+   char name[FD_NAME_MAX + 1];
+   uint8_t pattern[11];
+   unsigned int nchar = 0;
+   block_t block;
+   unsigned int bindex;
+   direntry_t *direntry;
 
+   if (upcase(name, file) == NULL)
+      return -1;
 
-/* Delete the file in the current working directory named file.  Its
- * directory entry should be marked free and the blocks allocated to 
- * it should also be marked free.  If the freed directory entry is in a
- * sub-directory, the modified block must be written back to disk
- * immediately.
- *
- * Because file might contain lower case characters, toupper() should be used
- * to convert all characters to upper case.  Do _not_ modify the string
- * pointed to by dir.  The "const" attribute attached to dir causes the
- * compiler to enforce this restriction.
- *
- * If the first character of file is 0xe5, return -1.  If file corresponds
- * to a directory, return -1.
- *
- * On success, return the number of blocks freed.  Otherwise, return
- * -1.
- */
-int fd_del(const char *file){
+   if (wildcard(name))
+   {
+      if (packpattern(name, pattern) == -1
+          || matchcwd(pattern, typeentry, &nchar) == 0)
+         return -1;
+      return nchar;
+   }
 
+   if ((direntry = searchCwd(name, block, &bindex)) == NULL
+       || subdirectory(direntry))
+      return -1;
 
-   return -1;
+   return typefile(direntry);
 }
 
 
-/* Create a new file with the name passed in the 8.3 format string parameter
- * file in the current working directory.  The file's attributes should be
- * set to 0.  The creation, write, and access times should be set to the
- * current time in the current time zone.  The file's starting block should
- * be set to 0 and its size should be set to 0 bytes.  See the Section 2
- * man page for time() and the manpage for localtime() for getting the
- * current time and converting it to the current time zone.  Or, use the
- * getTime() helper function.
- *
- * Because file might contain lower case characters, toupper() should be used
- * to convert all characters to upper case.  Do _not_ modify the string
- * pointed to by dir.  The "const" attribute attached to dir causes the
- * compiler to enforce this restriction.
- *
- * The 8.3 format file name in file should be converted to upper case.
+/* Read up to len bytes of file, in the current working directory,
+ * starting offset bytes into the file, into buf.  The clusters before
+ * offset are skipped in the cached FAT, and each run of consecutive
+ * clusters is read with one request; only a block the read starts in
+ * the middle of goes through the block cache.
  *
- * Returns -1 if the first character of file is 0xe5, if the directory
- * already contains an entry with the same filename, or if the directory
- * entry can't be created.  Otherwise, returns 0.
+ * Returns the number of bytes read, which is less than len only at the
+ * end of the file, or -1 if file doesn't exist, is a sub-directory, or
+ * can't be read.
  */
-int fd_creat(const char *file)
+int fd_read(const char *file, unsigned int offset, void *buf,
+            unsigned int len)
 {
-  int i;
-  char string[16];
-  block_t block;
-  unsigned int blkindex;
-  direntry_t *direntry;
-  time_t t;
-  //edge casews
-  if (file == NULL) return -1;
-  if ((unsigned char) file[0] == (unsigned char) 0xe5) return -1;
-  //translates again to uppercase
-  strcpy(string, file);
-  for (i=0; i < 16; i++) {
-    string[i] = toupper(file[i]); }
-  //makes sure there's no other files or subdirectories with the same name
-  if (cwdIsRoot()) direntry = searchRoot(string);
-  else direntry = getFreeSubDirEntry(block, &blkindex);
+   char name[FD_NAME_MAX + 1];
+   block_t block;
+   unsigned int bindex;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int cluster;
+   unsigned int extent;
+   unsigned int blk;
+   unsigned int n;
+   unsigned int part;
+   unsigned int done = 0;
+   uint8_t *out = buf;
+   direntry_t *direntry;
 
-  if (direntry == NULL) return -1;
-  t = time(NULL);
-  
-  putdirentry(direntry, string, 0, localtime(&t), 0, 0);
-  if(!cwdIsRoot()){
-    writeblock(g_dev, block, ltop(blkindex));
-  }
+   if (upcase(name, file) == NULL
+       || (direntry = searchCwd(name, block, &bindex)) == NULL
+       || subdirectory(direntry))
+      return -1;
 
-   return 0;
+   if (offset >= direntry->fileSize)
+      return 0;
+   if (len > direntry->fileSize - offset)
+      len = direntry->fileSize - offset;
+
+   for (cluster = direntry->firstSector;
+        offset >= clusterBytes && !lastBlk(cluster); offset -= clusterBytes)
+      cluster = getfatentry(g_fat, cluster);
+
+   while (done < len && !lastBlk(cluster))
+   {
+      for (extent = 1; extent * clusterBytes - offset < len - done
+              && getfatentry(g_fat, cluster + extent - 1) == cluster + extent;
+           extent++)
+         ;
+
+      blk = ltop(cluster) + offset / BLOCKSIZE;
+      n = extent * clusterBytes - offset;
+      if (n > len - done)
+         n = len - done;
+
+      if (offset % BLOCKSIZE != 0)
+      {
+         part = BLOCKSIZE - offset % BLOCKSIZE;
+         if (part > n)
+            part = n;
+         if (bc_read(block, blk++) == -1)
+            return -1;
+         memcpy(out + done, block + offset % BLOCKSIZE, part);
+         done += part;
+         n -= part;
+      }
+
+      if (n > 0 && bc_readrun(out + done, blk, n) == -1)
+         return -1;
+      done += n;
+
+      offset = 0;
+      cluster = getfatentry(g_fat, cluster + extent - 1);
+   }
+
+   return done;
 }
 
 
-/* Append len characters of data to file in the current working directory.
+/* Read many files at once.  Each of the count requests in reqs names a
+ * file, a path as for fd_iterdir(), and asks for up to len bytes of it,
+ * starting offset bytes in, to be read into buf; its result is set to
+ * the number of bytes read, as for fd_read(), or -1.
+ *
+ * The files' cluster chains are followed in the cached FAT first, and
+ * every run of consecutive clusters becomes a segment of at most
+ * XFER_CHUNK bytes.  The segments of all the files are sorted by block
+ * number into one schedule, which a pool of READ_WORKERS threads works
+ * through in order, each reading a segment straight into its buffer with
+ * one request.  Only a block a read starts in the middle of goes through
+ * the block cache, before the workers start.
+ *
+ * Returns the number of requests read, or -1 if memory runs out, in
+ * which case every result is -1.
+ */
+int fd_read_many(struct fd_readreq *reqs, unsigned int count)
+{
+   unsigned int i;
+   unsigned int workers;
+   unsigned int done = 0;
+   pthread_t threads[READ_WORKERS];
+   readctx_t ctx;
+
+   memset(&ctx, 0, sizeof ctx);
+   ctx.reqs = reqs;
+   for (i = 0; i < count; i++)
+      if (planread(&ctx, i) == -1)
+      {
+         free(ctx.segs);
+         for (i = 0; i < count; i++)
+            reqs[i].result = -1;
+         return -1;
+      }
+
+   qsort(ctx.segs, ctx.count, sizeof(readseg_t), cmpseg);
+
+   workers = ctx.count < READ_WORKERS ? ctx.count : READ_WORKERS;
+   for (i = 0; i < workers; i++)
+      if (pthread_create(&threads[i], NULL, readworker, &ctx) != 0)
+         break;
+
+   /* If no thread could be started, do the work here. */
+   if ((workers = i) == 0)
+      readworker(&ctx);
+
+   for (i = 0; i < workers; i++)
+      pthread_join(threads[i], NULL);
+
+   free(ctx.segs);
+   for (i = 0; i < count; i++)
+      if (reqs[i].result != -1)
+         done++;
+
+   return done;
+}
+
+
+/* Write the contents of file, a path as for fd_iterdir(), to the file
+ * descriptor outFd, which may be a file, a pipe or a socket, and must
+ * not be non-blocking.
+ *
+ * The file's runs of consecutive clusters are sent with sendfile()
+ * straight from the image file, so the data doesn't pass through this
+ * process.  A run with blocks in the overlay, whose copies in the image
+ * are out of date, is read through the block cache and written instead,
+ * XFER_CHUNK bytes at a time, and so is every run if the volume has no
+ * image file or outFd can't take sendfile().
+ *
+ * Returns the number of bytes written, which is less than the file's
+ * size only if its chain is short, or -1 if file doesn't exist, is a
+ * sub-directory, or can't be read or written.
+ */
+int fd_sendfile(const char *file, int outFd)
+{
+   char name[FD_NAME_MAX + 1];
+   char upper[FD_NAME_MAX + 1];
+   block_t block;
+   unsigned int bi;
+   unsigned int dir;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int cluster;
+   unsigned int extent;
+   unsigned int left;
+   unsigned int n;
+   unsigned int done = 0;
+   int zeroCopy = g_bdev.fd != -1;
+   uint8_t *buf = NULL;
+   direntry_t *direntry;
+
+   if (splitpath(file, &dir, name) == -1
+       || upcase(upper, name) == NULL
+       || (direntry = searchDir(dir, upper, block, &bi)) == NULL
+       || subdirectory(direntry))
+      return -1;
+
+   left = direntry->fileSize;
+   for (cluster = direntry->firstSector; left > 0 && !lastBlk(cluster);
+        cluster = getfatentry(g_fat, cluster + extent - 1))
+   {
+      for (extent = 1; extent * clusterBytes < left
+              && getfatentry(g_fat, cluster + extent - 1) == cluster + extent;
+           extent++)
+         ;
+
+      n = extent * clusterBytes < left ? extent * clusterBytes : left;
+      if (sendrun(outFd, ltop(cluster), n, &zeroCopy, &buf) == -1)
+      {
+         free(buf);
+         return -1;
+      }
+      done += n;
+      left -= n;
+   }
+
+   free(buf);
+   return done;
+}
+
+
+/* Delete the file in the current working directory named file.  Its
+ * directory entry should be marked free and the blocks allocated to 
+ * it should also be marked free.  If the freed directory entry is in a
+ * sub-directory, the modified block must be written back to disk
+ * immediately.
+ *
+ * Because file might contain lower case characters, toupper() should be used
+ * to convert all characters to upper case.  Do _not_ modify the string
+ * pointed to by dir.  The "const" attribute attached to dir causes the
+ * compiler to enforce this restriction.
+ *
+ * If the first character of file is 0xe5, return -1.  If file corresponds
+ * to a directory, return -1.
+ *
+ * file may also be a DOS wildcard pattern (see packpattern()), in which
+ * case every matching file is deleted during one pass over the
+ * directory.  Each directory block holding deleted entries is written
+ * once, and the freed clusters only reach the disk when the FAT is
+ * flushed.
+ *
+ * On success, return the number of clusters freed (on a floppy, a
+ * cluster is one block).  Otherwise, return -1.  For a pattern, return
+ * -1 if no file matches.
+ */
+int fd_del(const char *file)
+{
+   char name[FD_NAME_MAX + 1];
+   uint8_t pattern[11];
+   block_t block;
+   unsigned int bindex;
+   unsigned int freed = 0;
+   direntry_t *direntry;
+
+   if (upcase(name, file) == NULL)
+      return -1;
+
+   if (wildcard(name))
+   {
+      if (packpattern(name, pattern) == -1
+          || matchcwd(pattern, delentry, &freed) == 0)
+         return -1;
+      return freed;
+   }
+
+   if ((direntry = searchCwd(name, block, &bindex)) == NULL
+       || subdirectory(direntry))
+      return -1;
+
+   freed = freeChain(direntry->firstSector);
+   eraseentry(g_cwdHead, direntry, block, bindex);
+   g_files--;
+
+   return freed;
+}
+
+
+/* Create a new file with the name passed in the 8.3 format string parameter
+ * file in the current working directory.  The file's attributes should be
+ * set to 0.  The creation, write, and access times should be set to the
+ * current time in the current time zone.  The file's starting block should
+ * be set to 0 and its size should be set to 0 bytes.  See the Section 2
+ * man page for time() and the manpage for localtime() for getting the
+ * current time and converting it to the current time zone.  Or, use the
+ * getTime() helper function.
+ *
+ * Because file might contain lower case characters, toupper() should be used
+ * to convert all characters to upper case.  Do _not_ modify the string
+ * pointed to by dir.  The "const" attribute attached to dir causes the
+ * compiler to enforce this restriction.
+ *
+ * The 8.3 format file name in file should be converted to upper case.
+ *
+ * Returns -1 if the first character of file is 0xe5, if the directory
+ * already contains an entry with the same filename, or if the directory
+ * entry can't be created.  Otherwise, returns 0.
+ */
+int fd_creat(const char *file)
+{
+   return newentry(g_cwdHead, file, 0, 0, 0);
+}
+
+
+/* Create a sub-directory named dir in the current working directory,
+ * with "." and ".." entries.  hint is the number of entries the
+ * directory is expected to hold, or 0 if unknown; long file names take
+ * one entry per 13 characters, plus one.  Enough clusters for hint
+ * entries are allocated up front, consecutive ones where possible, so
+ * that filling the directory doesn't grow it a cluster at a time.
+ *
+ * Returns -1 if dir can't be created, as for fd_creat(), or if there
+ * aren't enough free clusters.  Otherwise, returns 0.
+ */
+int fd_mkdir(const char *dir, unsigned int hint)
+{
+   unsigned int perCluster = g_geom.blocksPerCluster * DIR_ENTRIES;
+   unsigned int count = (hint + 2 + perCluster - 1) / perCluster;
+   unsigned int head = 0;
+   unsigned int got;
+
+   if (hint > g_geom.numClusters * perCluster)
+      return -1;
+
+   if ((got = allocClusters(0, count, &head)) < count)
+   {
+      if (got > 0)
+         freeChain(head);
+      return -1;
+   }
+
+   if (initdir(head, g_cwdHead) == -1
+       || newentry(g_cwdHead, dir, SUBDIRECTORY, head, 0) == -1)
+   {
+      freeChain(head);
+      return -1;
+   }
+
+   return 0;
+}
+
+
+/* Remove the empty sub-directory dir from the current working
+ * directory.  A directory is empty if it holds nothing but its "." and
+ * ".." entries.
+ *
+ * Because dir might contain lower case characters, toupper() should be
+ * used to convert all characters to upper case.
+ *
+ * Returns -1 if dir isn't a sub-directory or isn't empty.  Otherwise,
+ * returns the number of clusters freed.
+ */
+int fd_rmdir(const char *dir)
+{
+   char name[FD_NAME_MAX + 1];
+   block_t block;
+   unsigned int bindex;
+   unsigned int cluster;
+   direntry_t *direntry;
+
+   if (upcase(name, dir) == NULL || strcmp(name, ".") == 0
+       || strcmp(name, "..") == 0)
+      return -1;
+
+   if ((direntry = searchCwd(name, block, &bindex)) == NULL
+       || !subdirectory(direntry) || (cluster = direntry->firstSector) < 2
+       || walkdir(cluster, dotsonly, NULL) == -1)
+      return -1;
+
+   /* The cluster may come back as another directory. */
+   aggdirty(cluster);
+   lfndrop(cluster);
+   dirmapdrop(cluster);
+
+   eraseentry(g_cwdHead, direntry, block, bindex);
+   g_dirs--;
+   return freeChain(cluster);
+}
+
+
+/* Rename or move the file or directory oldPath to newPath.  Either may
+ * be a path, as for fd_copy(), and if newPath names a directory, the
+ * entry is moved there with its current name.  The entry's long file
+ * name, if any, is kept in that case.
+ *
+ * Only directory entries are rewritten: the entry keeps its attributes,
+ * times, first cluster and size, and no data is read or written, so the
+ * cost doesn't depend on the file's size.  A directory that changes
+ * parent has its ".." entry pointed at the new one.  The new entry is
+ * written before the old one is freed.
+ *
+ * Returns -1 if oldPath doesn't exist or is "." or "..", if newPath
+ * already exists, or if a directory would be moved below itself.
+ * Otherwise, returns 0.
+ */
+int fd_rename(const char *oldPath, const char *newPath)
+{
+   char oldName[FD_NAME_MAX + 1];
+   char newName[FD_NAME_MAX + 1];
+   char name[FD_NAME_MAX + 1];
+   char shortName[NAME_LEN];
+   unsigned int srcDir;
+   unsigned int dstDir;
+   unsigned int bi;
+   unsigned int cluster;
+   unsigned int parent;
+   unsigned int depth;
+   int same;
+   block_t block;
+   direntry_t record;
+   direntry_t *direntry;
+
+   if (splitpath(oldPath, &srcDir, oldName) == -1
+       || upcase(name, oldName) == NULL || name[0] == '\0'
+       || strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+       || (direntry = searchDir(srcDir, name, block, &bi)) == NULL)
+      return -1;
+
+   record = *direntry;
+   getfilename(&record, shortName);
+   if (longname(srcDir, direntry, block, bi, oldName) == NULL)
+      strcpy(oldName, shortName);
+   cluster = subdirectory(&record) ? record.firstSector : 0;
+
+   if (resolveDir(newPath, &dstDir) == 0)
+      strcpy(newName, oldName);
+   else if (splitpath(newPath, &dstDir, newName) == -1)
+      return -1;
+
+   /* A directory can't be moved below itself. */
+   for (parent = dstDir, depth = 0; cluster != 0 && depth <= MAX_DEPTH;
+        parent = parentdir(parent), depth++)
+      if (parent == cluster)
+         return -1;
+      else if (parent == 0)
+         break;
+
+   /* The new name may differ from the old only in case. */
+   if (upcase(name, newName) == NULL)
+      return -1;
+   direntry = searchDir(dstDir, name, block, &bi);
+   same = direntry != NULL && dstDir == srcDir
+      && memcmp(direntry->filename, record.filename, 11) == 0;
+   if (direntry != NULL && !same)
+      return -1;
+
+   if (same)
+      eraseentry(srcDir, direntry, block, bi);
+
+   if (placeentry(dstDir, newName, &record) == -1)
+   {
+      if (same)
+         placeentry(srcDir, oldName, &record);
+      return -1;
+   }
+
+   if (!same && (direntry = searchDir(srcDir, shortName, block, &bi)) != NULL)
+      eraseentry(srcDir, direntry, block, bi);
+
+   if (cluster != 0 && dstDir != srcDir)
+   {
+      direntry = entryat(cluster, 1, block, &bi);
+      if (memcmp(direntry->filename, "..", 2) == 0)
+      {
+         direntry->firstSector = dstDir;
+         writedirentry(cluster, direntry, block, bi);
+      }
+   }
+
+   return 0;
+}
+
+
+/* Copy the file src to dst.  Either may be a path, as for fd_iterdir(),
+ * and if dst names a directory, or ends in a separator, the copy is
+ * made there with src's name.  The copy gets the current time, like a
+ * new file.
+ *
+ * The data is copied cluster by cluster inside the image, without
+ * going through the host.  The copy's clusters are allocated in one
+ * step, in as few runs of consecutive clusters as possible, and each run
+ * is read and written with one call per XFER_CHUNK bytes.  The
+ * directory entry is written once, after the data.
+ *
+ * Returns -1 if src isn't a file, if dst already exists, or if there
+ * isn't room for the copy.  Otherwise, returns the number of bytes
+ * copied.
+ */
+int fd_copy(const char *src, const char *dst)
+{
+   char srcName[FD_NAME_MAX + 1];
+   char dstName[FD_NAME_MAX + 1];
+   char name[FD_NAME_MAX + 1];
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int maxRun = XFER_CHUNK / clusterBytes;
+   unsigned int srcDir;
+   unsigned int dstDir;
+   unsigned int bi;
+   unsigned int size;
+   unsigned int count;
+   unsigned int left;
+   unsigned int n = 0;
+   unsigned int from;
+   unsigned int to;
+   unsigned int head = 0;
+   uint8_t *buf = NULL;
+   block_t block;
+   direntry_t *direntry;
+
+   if (splitpath(src, &srcDir, srcName) == -1 || srcName[0] == '\0'
+       || upcase(name, srcName) == NULL
+       || (direntry = searchDir(srcDir, name, block, &bi)) == NULL
+       || subdirectory(direntry))
+      return -1;
+
+   from = direntry->firstSector;
+   size = direntry->fileSize;
+
+   if (resolveDir(dst, &dstDir) == 0)
+      strcpy(dstName, srcName);
+   else if (splitpath(dst, &dstDir, dstName) == -1 || dstName[0] == '\0')
+      return -1;
+
+   if (upcase(name, dstName) == NULL
+       || searchDir(dstDir, name, block, &bi) != NULL)
+      return -1;
+
+   count = (size + clusterBytes - 1) / clusterBytes;
+   if (count > 0)
+   {
+      if ((buf = malloc((count < maxRun ? count : maxRun) * clusterBytes))
+          == NULL)
+         return -1;
+
+      if ((n = allocClusters(0, count, &head)) < count)
+      {
+         free(buf);
+         if (n > 0)
+            freeChain(head);
+         return -1;
+      }
+   }
+
+   for (to = head, left = count; left > 0; left -= n)
+   {
+      n = left < maxRun ? left : maxRun;
+      if (clusterio(&from, buf, n, 0) == -1
+          || clusterio(&to, buf, n, 1) == -1)
+         break;
+   }
+   free(buf);
+
+   if (left > 0 || newentry(dstDir, dstName, 0, head, size) == -1)
+   {
+      freeChain(head);
+      return -1;
+   }
+
+   return size;
+}
+
+
+/* Append len characters of data to file in the current working directory.
  *
  * Because file might contain lower case characters, toupper() should be used
  * to convert all characters to upper case.  Do _not_ modify the string
@@ -338,491 +1566,4856 @@ int fd_creat(const char *file)
  * If the first character of file is 0xe5, return -1.  If the file
  * corresponds to a sub directory, return -1.
  *
+ * Clusters are allocated as the file grows, once any reserved with
+ * fd_fallocate() are used up.  If the volume fills up, the data that fit
+ * is kept.
+ *
  * Returns the number of characters appended to the file.
  */
 int fd_append(const char *file, const char *data, unsigned int len)
 {
-   return -1;
+   char name[FD_NAME_MAX + 1];
+   block_t dirblock;
+   unsigned int dirindex;
+   unsigned int done;
+   direntry_t *direntry;
+
+   if (upcase(name, file) == NULL)
+      return -1;
+
+   if ((direntry = searchCwd(name, dirblock, &dirindex)) == NULL
+       || subdirectory(direntry))
+      return -1;
+
+   if (len == 0)
+      return 0;
+
+   done = appendbytes(direntry, data, len);
+
+   touchdirentry(direntry, getTime());
+   writedirentry(g_cwdHead, direntry, dirblock, dirindex);
+
+   return done;
 }
 
 
-/* Private helper functions follow.
+/* Cut the file file in the current working directory to size bytes.
+ * The clusters beyond the new end of the file, including any reserved
+ * with fd_fallocate(), are freed in one pass along the chain, and the
+ * entry's size and write time are updated with one write.
+ *
+ * Returns -1 if file doesn't exist, is a sub-directory, or is shorter
+ * than size.  Otherwise, returns the number of clusters freed.
  */
+int fd_truncate(const char *file, unsigned int size)
+{
+   char name[FD_NAME_MAX + 1];
+   block_t dirblock;
+   unsigned int dirindex;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int freed;
+   direntry_t *direntry;
+
+   if (upcase(name, file) == NULL
+       || (direntry = searchCwd(name, dirblock, &dirindex)) == NULL
+       || subdirectory(direntry) || size > direntry->fileSize)
+      return -1;
+
+   freed = cutChain(direntry, size / clusterBytes
+                    + (size % clusterBytes != 0));
+   direntry->fileSize = size;
+
+   touchdirentry(direntry, getTime());
+   writedirentry(g_cwdHead, direntry, dirblock, dirindex);
+
+   return freed;
+}
 
 
-/* List the entries in the root directory.  Called by fd_dir().
+/* Reserve the clusters the file file in the current working directory
+ * needs to grow to size bytes, without changing its size.  The missing
+ * clusters are allocated in one step, as a single run of consecutive
+ * clusters if there is one, and linked to the end of the file's chain.
+ * fd_append() and fd_import() fill reserved clusters without going back
+ * to the allocator, and fd_truncate() gives them back.
  *
- * Returns the number of entries listed.
+ * Reserved clusters lie beyond the size recorded in the file's entry, so
+ * they are only kept while the volume is mounted.  Those the file hasn't
+ * grown into are freed when the volume is unmounted or its changes are
+ * committed, leaving every chain on the image as long as its file needs.
+ *
+ * Returns -1 if file doesn't exist, is a sub-directory, or there aren't
+ * enough free clusters.  Otherwise, returns the number of clusters
+ * allocated.
+ */
+int fd_fallocate(const char *file, unsigned int size)
+{
+   char name[FD_NAME_MAX + 1];
+   block_t dirblock;
+   unsigned int dirindex;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int need = size / clusterBytes + (size % clusterBytes != 0);
+   unsigned int have = 0;
+   unsigned int tail = 0;
+   unsigned int head = 0;
+   unsigned int cluster;
+   unsigned int got;
+   direntry_t *direntry;
+
+   if (upcase(name, file) == NULL
+       || (direntry = searchCwd(name, dirblock, &dirindex)) == NULL
+       || subdirectory(direntry))
+      return -1;
+
+   for (cluster = direntry->firstSector; have < need && !lastBlk(cluster);
+        cluster = getfatentry(g_fat, cluster), have++)
+      tail = cluster;
+
+   if (have == need)
+      return 0;
+
+   if ((got = allocClusters(tail, need - have, &head)) < need - have)
+   {
+      /* Give back what was allocated. */
+      if (got > 0)
+      {
+         freeChain(head);
+         if (tail != 0)
+            putfatentry(g_fat, tail, g_codec->eoc);
+      }
+      return -1;
+   }
+
+   if (tail == 0)
+      direntry->firstSector = head;
+
+   /* A reservation that couldn't be recorded would never be freed. */
+   if (addspare(direntry->firstSector) == -1)
+   {
+      cutChain(direntry, have);
+      return -1;
+   }
+
+   if (tail == 0)
+      writedirentry(g_cwdHead, direntry, dirblock, dirindex);
+
+   return got;
+}
+
+
+/* Append the contents of the host file hostPath to file in the current
+ * working directory, creating file if it doesn't exist.
+ *
+ * The host file is streamed in XFER_CHUNK byte pieces, so there is no
+ * limit on its size other than the volume's free space.  The clusters
+ * for the whole file are allocated before any data is written, in runs
+ * of consecutive clusters where possible, and each run is written to the
+ * image directly rather than a block at a time.  Clusters reserved with
+ * fd_fallocate() are filled first.  If the volume fills up, the data
+ * that fit is kept.
+ *
+ * Returns -1 if the host file can't be read, if file corresponds to a
+ * sub-directory, or if file can't be created.  Otherwise, returns the
+ * number of bytes imported.
+ */
+int fd_import(const char *hostPath, const char *file)
+{
+   char name[FD_NAME_MAX + 1];
+   block_t dirblock;
+   unsigned int dirindex;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int done = 0;
+   unsigned int streamed = 0;
+   unsigned int want;
+   unsigned int count;
+   unsigned int head = 0;
+   unsigned int last;
+   unsigned int tail;
+   unsigned int spare;
+   unsigned int got;
+   unsigned int cluster;
+   unsigned int left;
+   unsigned int extent = 0;
+   unsigned int used;
+   unsigned int blk;
+   unsigned int blocks;
+   unsigned int chunk;
+   uint64_t runBytes;
+   uint64_t remaining;
+   ssize_t n;
+   uint8_t *buf;
+   int fd;
+   struct stat st;
+   direntry_t *direntry;
+
+   if (upcase(name, file) == NULL
+       || (fd = open(hostPath, O_RDONLY)) == -1)
+      return -1;
+
+   if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+       || (buf = malloc(XFER_CHUNK)) == NULL)
+   {
+      close(fd);
+      return -1;
+   }
+
+   if ((direntry = searchCwd(name, dirblock, &dirindex)) == NULL
+       && fd_creat(file) == 0)
+      direntry = searchCwd(name, dirblock, &dirindex);
+
+   if (direntry == NULL || subdirectory(direntry))
+   {
+      free(buf);
+      close(fd);
+      return -1;
+   }
+
+   /* A file's size must fit in its directory entry. */
+   remaining = st.st_size;
+   if (remaining > UINT32_MAX - direntry->fileSize)
+      remaining = UINT32_MAX - direntry->fileSize;
+
+   /* Fill out the file's last cluster first. */
+   if (direntry->fileSize % clusterBytes != 0 && remaining > 0)
+   {
+      count = clusterBytes - direntry->fileSize % clusterBytes;
+      if (count > remaining)
+         count = remaining;
+      n = readfull(fd, buf, count);
+      if (n > 0)
+         done = appendbytes(direntry, (const char *) buf, n);
+      remaining = n == (ssize_t) count && done == count
+         ? remaining - count : 0;
+   }
+
+   /* Fill clusters reserved by fd_fallocate() first, and allocate the
+    * rest of what the file needs up front, in as few runs as possible.
+    */
+   want = (remaining + clusterBytes - 1) / clusterBytes;
+   spare = spareClusters(direntry, &last);
+   head = last != 0 ? getfatentry(g_fat, last) : direntry->firstSector;
+   count = want < spare ? want : spare;
+   if (want > spare)
+   {
+      for (tail = last, cluster = head; !lastBlk(cluster);
+           cluster = getfatentry(g_fat, cluster))
+         tail = cluster;
+      if ((got = allocClusters(tail, want - spare, &cluster)) > 0
+          && spare == 0)
+         head = cluster;
+      count += got;
+   }
+   if (count == 0)
+      remaining = 0;
+   else if (remaining > (uint64_t) count * clusterBytes)
+      remaining = (uint64_t) count * clusterBytes;
+   if (last == 0 && count > 0)
+      direntry->firstSector = head;
+
+   /* Stream the data into the new clusters, one run of consecutive
+    * clusters at a time.  Each chunk is written with one call.
+    */
+   for (cluster = head, left = count; remaining > 0 && left > 0;
+        cluster = getfatentry(g_fat, cluster + extent - 1), left -= extent)
+   {
+      for (extent = 1; extent < left
+              && getfatentry(g_fat, cluster + extent - 1) == cluster + extent;
+           extent++)
+         ;
+
+      blk = ltop(cluster);
+      runBytes = (uint64_t) extent * clusterBytes;
+      while (remaining > 0 && runBytes > 0)
+      {
+         chunk = runBytes < XFER_CHUNK ? runBytes : XFER_CHUNK;
+         if (chunk > remaining)
+            chunk = remaining;
+         if ((n = readfull(fd, buf, chunk)) <= 0)
+            break;
+
+         /* Zero the rest of a final partial block. */
+         blocks = (n + BLOCKSIZE - 1) / BLOCKSIZE;
+         memset(buf + n, 0, blocks * BLOCKSIZE - n);
+         if (bc_writerun(buf, blk, blocks) == -1)
+            break;
+
+         blk += blocks;
+         runBytes -= n;
+         remaining -= n;
+         streamed += n;
+         if ((unsigned int) n != chunk)
+            break;
+      }
+
+      if (runBytes > 0)
+         break;
+   }
+
+   /* Give back clusters the data didn't reach, if the host file was
+    * shorter than expected or a write failed.  Reserved clusters stay.
+    */
+   used = (streamed + clusterBytes - 1) / clusterBytes;
+   if (used < spare)
+      used = spare;
+   if (used < count)
+   {
+      if (used == 0)
+      {
+         freeChain(head);
+         if (last != 0)
+            putfatentry(g_fat, last, g_codec->eoc);
+         else
+            direntry->firstSector = 0;
+      }
+      else
+      {
+         for (cluster = head; --used > 0; )
+            cluster = getfatentry(g_fat, cluster);
+         freeChain(getfatentry(g_fat, cluster));
+         putfatentry(g_fat, cluster, g_codec->eoc);
+      }
+   }
+
+   direntry->fileSize += streamed;
+   done += streamed;
+   touchdirentry(direntry, getTime());
+   writedirentry(g_cwdHead, direntry, dirblock, dirindex);
+
+   free(buf);
+   close(fd);
+   return done;
+}
+
+
+/* Recreate the directory imageDir, and everything below it, in the host
+ * directory hostDir, which is created if it doesn't exist.  imageDir is
+ * a path of directory names separated by '/' or '\', relative to the
+ * current working directory unless it begins with a separator.  Files
+ * and directories keep the names and the access and modification times
+ * they have on the image.
+ *
+ * The tree is walked first, creating the host directories and listing
+ * the files.  The files are then extracted in parallel by a pool of
+ * EXPORT_WORKERS threads, each of which reads a file a run of
+ * consecutive clusters at a time straight from the image.  The image is
+ * only read while the workers run, so the whole FAT is read into the
+ * cache before they start.
+ *
+ * Returns the number of files exported.  Returns -1 if imageDir isn't a
+ * directory, or if any file or directory couldn't be created.
+ */
+int fd_export(const char *imageDir, const char *hostDir)
+{
+   unsigned int dir;
+   unsigned int i;
+   unsigned int workers;
+   pthread_t threads[EXPORT_WORKERS];
+   exportctx_t ctx;
+   exportwalk_t ew;
+
+   if (resolveDir(imageDir, &dir) == -1
+       || (mkdir(hostDir, 0777) == -1 && errno != EEXIST))
+      return -1;
+
+   memset(&ctx, 0, sizeof ctx);
+   ew.ctx = &ctx;
+   ew.hostDir = hostDir;
+   if (walktree(dir, FD_DIR_HIDDEN, exportentry, NULL, &ew) == -1)
+      ctx.failed++;
+
+   fatfault(2, g_geom.numClusters + 2);
+   workers = ctx.files < EXPORT_WORKERS ? ctx.files : EXPORT_WORKERS;
+   for (i = 0; i < workers; i++)
+      if (pthread_create(&threads[i], NULL, exportworker, &ctx) != 0)
+         break;
+
+   /* If no thread could be started, do the work here. */
+   if ((workers = i) == 0)
+      exportworker(&ctx);
+
+   for (i = 0; i < workers; i++)
+      pthread_join(threads[i], NULL);
+
+   for (i = 0; i < ctx.count; i++)
+   {
+      if (ctx.jobs[i].isDir
+          && utimensat(AT_FDCWD, ctx.jobs[i].path, ctx.jobs[i].times, 0) == -1)
+         ctx.failed++;
+      free(ctx.jobs[i].path);
+   }
+   free(ctx.jobs);
+
+   return ctx.failed > 0 ? -1 : (int) ctx.files;
+}
+
+
+/* Call fn for each entry of the directory dir, a path as for
+ * fd_export(), or the current working directory if dir is NULL.  Each
+ * entry is decoded into a struct fd_dirent, which is passed to fn along
+ * with arg.  flags selects the entries visited and their order; see
+ * fsops.h.  Unsorted entries are passed to fn as the directory's blocks
+ * are scanned.  fn must not modify the directory.
+ *
+ * Returns the number of entries passed to fn, including one for which
+ * fn returned non-zero.  Returns -1 if dir isn't a directory or memory
+ * runs out.
+ */
+int fd_iterdir(const char *dir, unsigned int flags, fd_dirfn fn, void *arg)
+{
+   unsigned int cluster = g_cwdHead;
+   int count;
+   int i;
+   struct fd_dirent *entries;
+   iterctx_t ctx;
+
+   if (dir != NULL && resolveDir(dir, &cluster) == -1)
+      return -1;
+
+   if ((flags & FD_SORT_MASK) != 0)
+   {
+      if ((count = readentries(cluster, flags, &entries)) == -1)
+         return -1;
+
+      for (i = 0; i < count; )
+         if (fn(&entries[i++], arg) != 0)
+            break;
+
+      free(entries);
+      return i;
+   }
+
+   memset(&ctx, 0, sizeof ctx);
+   ctx.flags = flags;
+   ctx.fn = fn;
+   ctx.arg = arg;
+
+   if (walkdir(cluster, iterentry, &ctx) == -1 && !ctx.stopped)
+      return -1;
+
+   return ctx.count;
+}
+
+
+/* Walk the tree below the directory dir, a path as for fd_export(), or
+ * below the current working directory if dir is NULL.  fn is called
+ * for each file and sub-directory, depth first, with the entry's path
+ * relative to dir, the entry, the entry's depth below dir (starting at
+ * 0), and arg.  A directory is visited before the entries in it.
+ * flags selects and orders the entries of each directory as for
+ * fd_iterdir(); the "." and ".." entries and the volume label are
+ * always skipped.  fn returns FD_WALK_CONTINUE, FD_WALK_SKIP to skip
+ * the entries below a directory, or FD_WALK_STOP to end the walk.  fn
+ * must not modify the tree.
+ *
+ * The walk is iterative, so its depth isn't limited by the C stack, but
+ * directories nested more than MAX_DEPTH deep aren't entered.
+ *
+ * Returns the number of entries visited.  Returns -1 if dir isn't a
+ * directory, or if a directory below it couldn't be read or was nested
+ * too deeply; the rest of the tree is still walked.
+ */
+int fd_walk(const char *dir, unsigned int flags, fd_walkfn fn, void *arg)
+{
+   unsigned int cluster = g_cwdHead;
+
+   if (dir != NULL && resolveDir(dir, &cluster) == -1)
+      return -1;
+
+   return walktree(cluster, flags, fn, NULL, arg);
+}
+
+
+/* Total the files, sub-directories and file bytes in the tree below the
+ * directory dir, a path as for fd_export(), or below the current
+ * working directory if dir is NULL.  Hidden entries are counted.
+ *
+ * Totals are cached per directory, and only the directories whose
+ * totals have been made stale by changes since they were cached are
+ * walked again.
+ *
+ * Returns 0 on success, with the totals in the structure pointed to by
+ * usage.  Returns -1 if dir isn't a directory or the tree couldn't be
+ * read in full.
+ */
+int fd_du(const char *dir, struct fd_usage *usage)
+{
+   unsigned int cluster = g_cwdHead;
+   aggregate_t *agg;
+   aggctx_t ctx;
+
+   if (dir != NULL && resolveDir(dir, &cluster) == -1)
+      return -1;
+
+   if ((agg = aggfind(cluster)) != NULL && agg->state == AGG_VALID)
+   {
+      *usage = agg->usage;
+      return 0;
+   }
+
+   memset(&ctx, 0, sizeof ctx);
+   ctx.clusters[0] = cluster;
+   if (walktree(cluster, FD_DIR_HIDDEN, aggvisit, aggleave, &ctx) == -1)
+      return -1;
+
+   aggstore(cluster, parentdir(cluster), &ctx.totals[0]);
+   *usage = ctx.totals[0];
+   return 0;
+}
+
+
+/* Fill in the structure pointed to by st with the mounted volume's
+ * statistics.  The cluster counts and the longest free extent are kept
+ * up to date as the FAT changes, so they cost nothing to report.  The
+ * file and directory counts are taken from a walk of the whole tree the
+ * first time, as fd_du() would, and kept up to date from then on.
+ *
+ * Returns 0 on success, or -1 if the tree couldn't be read in full.
+ */
+int fd_statfs(struct fd_statfs *st)
+{
+   struct fd_usage usage;
+
+   if (!g_countsValid)
+   {
+      if (fd_du("/", &usage) == -1)
+         return -1;
+      g_files = usage.files;
+      g_dirs = usage.dirs;
+      g_countsValid = 1;
+   }
+
+   if (!g_freeValid)
+      freebuild();
+
+   st->clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   st->clusters = g_geom.numClusters;
+   st->freeClusters = g_freeClusters;
+   st->badClusters = g_badClusters;
+   st->largestFree = g_freeTree[1].longest;
+   st->files = g_files;
+   st->dirs = g_dirs;
+   return 0;
+}
+
+
+/* Private helper functions follow.
+ */
+
+
+/* Call visit for each entry of the directory whose first cluster is
+ * dir, or of the root directory if dir is 0.  Free entries are skipped,
+ * and long file name entries are assembled into the long name passed
+ * to visit with the entry they belong to; longName is NULL if the entry
+ * has no valid long name.  visit may call walkdir() itself.
+ *
+ * Returns 0, or -1 as soon as visit returns -1 or a block of the root
+ * directory can't be read.
+ */
+static int walkdir(unsigned int dir,
+                   int (*visit)(const direntry_t *direntry,
+                                const char *longName, void *arg),
+                   void *arg)
+{
+   unsigned int b = 0;
+   unsigned int index = 0;
+   unsigned int live;
+   unsigned int lfns;
+   unsigned int i;
+   const direntry_t *direntry;
+   chainpos_t pos;
+   dirmasks_t masks;
+   lfnstate_t lfn;
+   block_t block;
+   char longName[FD_NAME_MAX + 1];
+
+   lfn.seq = 0;
+
+   if (dir != 0)
+      chainStart(&pos, dir, RA_BLOCKS);
+
+   while (dir == 0 ? b < g_geom.rootBlocks : !lastBlk(pos.cluster))
+   {
+      if (dir == 0)
+      {
+         if ((direntry = (const direntry_t *) rootblock(b++)) == NULL)
+            return -1;
+      }
+      else
+      {
+         bc_read(block, chainBlk(&pos));
+         direntry = (const direntry_t *) block;
+         chainNext(&pos);
+      }
+
+      live = scanblock((const uint8_t *) direntry, NULL, &masks);
+      lfns = lfnentries(&masks);
+
+      for (live |= lfns; live != 0; live &= live - 1)
+      {
+         i = __builtin_ctz(live);
+
+         if (lfns & 1u << i)
+            lfnfeed(&lfn, (const uint8_t *) &direntry[i], index + i);
+         else if (visit(&direntry[i],
+                        lfnname(&lfn, &direntry[i], index + i, longName),
+                        arg) == -1)
+            return -1;
+      }
+
+      if (masks.end)
+         break;
+      index += DIR_ENTRIES;
+   }
+
+   return 0;
+}
+
+
+/* Find the directory named by path, a list of directory names separated
+ * by '/' or '\'.  The path is relative to the current working directory
+ * unless it begins with a separator.
+ *
+ * Returns 0 on success, with the directory's first cluster, or 0 for
+ * the root, in the variable pointed to by cluster.  Otherwise, returns
+ * -1.
+ */
+static int resolveDir(const char *path, unsigned int *cluster)
+{
+   char buf[PATH_LEN];
+   char name[FD_NAME_MAX + 1];
+   char *comp;
+   char *save;
+   unsigned int dir = g_cwdHead;
+   unsigned int bi;
+   block_t block;
+   direntry_t *direntry;
+
+   if (path == NULL || strlen(path) >= PATH_LEN)
+      return -1;
+
+   strcpy(buf, path);
+   if (buf[0] == '/' || buf[0] == '\\')
+      dir = 0;
+
+   for (comp = strtok_r(buf, "/\\", &save); comp != NULL;
+        comp = strtok_r(NULL, "/\\", &save))
+   {
+      /* The root is its own parent. */
+      if (strcmp(comp, ".") == 0 || (dir == 0 && strcmp(comp, "..") == 0))
+         continue;
+
+      if (upcase(name, comp) == NULL
+          || (direntry = searchDir(dir, name, block, &bi)) == NULL
+          || !subdirectory(direntry))
+         return -1;
+
+      dir = direntry->firstSector;
+   }
+
+   *cluster = dir;
+   return 0;
+}
+
+
+/* Read the entries of the directory whose first cluster is dir, or of
+ * the root if dir is 0, into a newly allocated array, selected and
+ * sorted according to flags as for fd_iterdir().  The caller frees
+ * *entries.
+ *
+ * Returns the number of entries, or -1 if memory runs out.
+ */
+static int readentries(unsigned int dir, unsigned int flags,
+                       struct fd_dirent **entries)
+{
+   iterctx_t ctx;
+
+   memset(&ctx, 0, sizeof ctx);
+   ctx.flags = flags;
+
+   if (walkdir(dir, iterentry, &ctx) == -1)
+   {
+      free(ctx.entries);
+      return -1;
+   }
+
+   sortentries(ctx.entries, ctx.count, flags);
+   *entries = ctx.entries;
+   return ctx.count;
+}
+
+
+/* Sort count entries by the key in flags, if any.
+ */
+static void sortentries(struct fd_dirent *entries, int count,
+                        unsigned int flags)
+{
+   struct fd_dirent tmp;
+   int i;
+
+   if ((flags & FD_SORT_MASK) == 0)
+      return;
+
+   if ((flags & FD_SORT_MASK) == FD_SORT_NAME)
+      qsort(entries, count, sizeof(struct fd_dirent), cmpname);
+   else if ((flags & FD_SORT_MASK) == FD_SORT_SIZE)
+      qsort(entries, count, sizeof(struct fd_dirent), cmpsize);
+   else
+      qsort(entries, count, sizeof(struct fd_dirent), cmptime);
+
+   if (flags & FD_SORT_REVERSE)
+      for (i = 0; i < count / 2; i++)
+      {
+         tmp = entries[i];
+         entries[i] = entries[count - 1 - i];
+         entries[count - 1 - i] = tmp;
+      }
+}
+
+
+/* Walk the tree below the directory whose first cluster is dir, or the
+ * root if dir is 0.  See fd_walk(); in addition, if leave isn't NULL,
+ * it's called for each directory visit continued into, once the
+ * entries below it have been walked or found unreadable.
+ *
+ * The walk keeps a stack of the directories on the current path, each
+ * with its entries read into memory.
+ */
+static int walktree(unsigned int dir, unsigned int flags, fd_walkfn visit,
+                    walkleave_t leave, void *arg)
+{
+   walkframe_t stack[MAX_DEPTH];
+   char path[WALK_PATH_LEN];
+   const char *name;
+   int top = 0;
+   int visited = 0;
+   int failed = 0;
+   int action;
+   size_t len;
+   walkframe_t *frame;
+   const struct fd_dirent *entry;
+
+   flags |= FD_DIR_NODOTS | FD_DIR_NOLABEL;
+
+   if ((stack[0].count = readentries(dir, flags, &stack[0].entries)) == -1)
+      return -1;
+   stack[0].next = 0;
+   stack[0].pathLen = 0;
+
+   while (top >= 0)
+   {
+      frame = &stack[top];
+
+      /* Done with this directory; go back up to its parent. */
+      if (frame->next == frame->count)
+      {
+         free(frame->entries);
+         if (--top >= 0 && leave != NULL)
+            leave(&stack[top].entries[stack[top].next - 1], top, 1, arg);
+         continue;
+      }
+
+      entry = &frame->entries[frame->next++];
+      name = entryname(entry);
+      len = frame->pathLen;
+      if (len + strlen(name) + 2 > WALK_PATH_LEN)
+      {
+         failed = 1;
+         continue;
+      }
+      if (len > 0)
+         path[len++] = '/';
+      strcpy(path + len, name);
+      visited++;
+
+      if ((action = visit(path, entry, top, arg)) == FD_WALK_STOP)
+      {
+         for (; top >= 0; top--)
+            free(stack[top].entries);
+         break;
+      }
+
+      if (!(entry->attributes & SUBDIRECTORY) || action == FD_WALK_SKIP)
+         continue;
+
+      /* Descend into the sub-directory, if it can be read. */
+      if (entry->cluster < 2 || top + 1 == MAX_DEPTH
+          || (stack[top + 1].count = readentries(entry->cluster, flags,
+                                                 &stack[top + 1].entries))
+          == -1)
+      {
+         failed = 1;
+         if (leave != NULL)
+            leave(entry, top, 0, arg);
+         continue;
+      }
+
+      top++;
+      stack[top].next = 0;
+      stack[top].pathLen = len + strlen(name);
+   }
+
+   return failed ? -1 : visited;
+}
+
+
+/* walktree() visitor for fd_du().  Files are added to the totals of the
+ * directory they're in.  A sub-directory whose aggregate is valid is
+ * added in whole and not entered; otherwise its totals start from zero.
+ */
+static int aggvisit(const char *path, const struct fd_dirent *entry,
+                    unsigned int depth, void *arg)
+{
+   aggctx_t *ctx = arg;
+   struct fd_usage *sum = &ctx->totals[depth];
+   aggregate_t *agg;
+
+   (void) path;
+
+   if (!(entry->attributes & SUBDIRECTORY))
+   {
+      sum->files++;
+      sum->bytes += entry->size;
+      return FD_WALK_CONTINUE;
+   }
+
+   sum->dirs++;
+
+   if ((agg = aggfind(entry->cluster)) != NULL && agg->state == AGG_VALID)
+   {
+      addusage(sum, &agg->usage);
+      return FD_WALK_SKIP;
+   }
+
+   memset(&ctx->totals[depth + 1], 0, sizeof(struct fd_usage));
+   ctx->clusters[depth + 1] = entry->cluster;
+   return FD_WALK_CONTINUE;
+}
+
+
+/* walktree() leave callback for fd_du().  Cache the totals of the
+ * sub-directory just finished, and add them to its parent's.  Once any
+ * directory couldn't be read, nothing more is cached, since the totals
+ * of the directories above it are incomplete.
+ */
+static void aggleave(const struct fd_dirent *entry, unsigned int depth,
+                     int complete, void *arg)
+{
+   aggctx_t *ctx = arg;
+
+   if (!complete)
+      ctx->error = 1;
+   else if (!ctx->error)
+      aggstore(entry->cluster, ctx->clusters[depth], &ctx->totals[depth + 1]);
+
+   addusage(&ctx->totals[depth], &ctx->totals[depth + 1]);
+}
+
+
+/* Add usage to sum.
+ */
+static void addusage(struct fd_usage *sum, const struct fd_usage *usage)
+{
+   sum->files += usage->files;
+   sum->dirs += usage->dirs;
+   sum->bytes += usage->bytes;
+}
+
+
+/* Returns the aggregate of the directory whose first cluster is
+ * cluster, or NULL if there is none.
+ */
+static aggregate_t *aggfind(unsigned int cluster)
+{
+   unsigned int i;
+
+   if (g_aggSize == 0)
+      return NULL;
+
+   for (i = (cluster * 2654435761u) & (g_aggSize - 1);
+        g_agg[i].state != AGG_EMPTY; i = (i + 1) & (g_aggSize - 1))
+      if (g_agg[i].cluster == cluster)
+         return &g_agg[i];
+
+   return NULL;
+}
+
+
+/* Cache usage as the valid aggregate of the directory whose first
+ * cluster is cluster, and whose parent's first cluster is parent.  The
+ * table is doubled when it becomes half full.
+ *
+ * Returns the aggregate, or NULL if memory runs out.
+ */
+static aggregate_t *aggstore(unsigned int cluster, unsigned int parent,
+                             const struct fd_usage *usage)
+{
+   aggregate_t *agg;
+   aggregate_t *old = g_agg;
+   unsigned int oldSize = g_aggSize;
+   unsigned int i;
+
+   if ((agg = aggfind(cluster)) == NULL)
+   {
+      if (2 * (g_aggUsed + 1) > g_aggSize)
+      {
+         g_aggSize = g_aggSize == 0 ? 64 : 2 * g_aggSize;
+         if ((g_agg = calloc(g_aggSize, sizeof(aggregate_t))) == NULL)
+         {
+            g_agg = old;
+            g_aggSize = oldSize;
+            return NULL;
+         }
+
+         g_aggUsed = 0;
+         for (i = 0; i < oldSize; i++)
+            if (old[i].state != AGG_EMPTY)
+               *aggstore(old[i].cluster, old[i].parent, &old[i].usage)
+                  = old[i];
+         free(old);
+      }
+
+      for (i = (cluster * 2654435761u) & (g_aggSize - 1);
+           g_agg[i].state != AGG_EMPTY; i = (i + 1) & (g_aggSize - 1))
+         ;
+      agg = &g_agg[i];
+      g_aggUsed++;
+   }
+
+   agg->cluster = cluster;
+   agg->parent = parent;
+   agg->state = AGG_VALID;
+   agg->usage = *usage;
+   return agg;
+}
+
+
+/* Mark the aggregates of the directory whose first cluster is dir, and
+ * of the directories above it, stale.
+ */
+static void aggdirty(unsigned int dir)
+{
+   aggregate_t *agg;
+   unsigned int depth;
+
+   for (depth = 0; depth <= MAX_DEPTH && (agg = aggfind(dir)) != NULL;
+        depth++)
+   {
+      agg->state = AGG_STALE;
+      if (dir == 0)
+         break;
+      dir = agg->parent;
+   }
+}
+
+
+/* Returns the first cluster of the parent of the directory whose first
+ * cluster is dir, or 0 for the root or if it can't be found.
+ */
+static unsigned int parentdir(unsigned int dir)
+{
+   block_t block;
+   unsigned int bi;
+   direntry_t *direntry;
+
+   if (dir == 0 || (direntry = searchDir(dir, "..", block, &bi)) == NULL)
+      return 0;
+
+   return direntry->firstSector;
+}
+
+
+/* walktree() visitor for fd_export().  Each entry becomes a job, and
+ * each sub-directory is created on the host before it is entered.  An
+ * entry whose name is "." or "..", or holds a '/', would be written
+ * outside its host directory, so it counts as a failed job instead, and
+ * a sub-directory so named isn't entered.
+ */
+static int exportentry(const char *path, const struct fd_dirent *entry,
+                       unsigned int depth, void *arg)
+{
+   exportwalk_t *ew = arg;
+   exportjob_t *job;
+   const char *name = entryname(entry);
+
+   (void) depth;
+
+   if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0
+       || strchr(name, '/') != NULL)
+   {
+      ew->ctx->failed++;
+      return FD_WALK_SKIP;
+   }
+
+   if ((job = addjob(ew->ctx, ew->hostDir, path, entry)) == NULL)
+   {
+      ew->ctx->failed++;
+      return FD_WALK_STOP;
+   }
+
+   if (job->isDir && mkdir(job->path, 0777) == -1 && errno != EEXIST)
+   {
+      ew->ctx->failed++;
+      return FD_WALK_SKIP;
+   }
+
+   return FD_WALK_CONTINUE;
+}
+
+
+/* Add a job to ctx for entry, whose path relative to the exported
+ * directory is path.  The job's host path is path below hostDir.
+ *
+ * Returns the job, or NULL if memory runs out.  The pointer is only
+ * valid until the next call.
+ */
+static exportjob_t *addjob(exportctx_t *ctx, const char *hostDir,
+                           const char *path, const struct fd_dirent *entry)
+{
+   exportjob_t *jobs;
+   exportjob_t *job;
+
+   if (ctx->count == ctx->alloc)
+   {
+      ctx->alloc = ctx->alloc == 0 ? 64 : 2 * ctx->alloc;
+      if ((jobs = realloc(ctx->jobs, ctx->alloc * sizeof(exportjob_t)))
+          == NULL)
+         return NULL;
+      ctx->jobs = jobs;
+   }
+
+   job = &ctx->jobs[ctx->count];
+   if ((job->path = malloc(strlen(hostDir) + strlen(path) + 2)) == NULL)
+      return NULL;
+   sprintf(job->path, "%s/%s", hostDir, path);
+
+   job->isDir = (entry->attributes & SUBDIRECTORY) != 0;
+   job->cluster = entry->cluster;
+   job->size = entry->size;
+   fattime(&entry->accessed, &job->times[0]);
+   fattime(&entry->written, &job->times[1]);
+
+   ctx->count++;
+   if (!job->isDir)
+      ctx->files++;
+   return job;
+}
+
+
+/* Body of an fd_export() worker thread.  Workers take files from ctx's
+ * jobs until there are none left.  The cached FAT isn't modified while
+ * they run, and the block cache writes through to the image, so the
+ * workers read the FAT and the image directly.
+ */
+static void *exportworker(void *arg)
+{
+   exportctx_t *ctx = arg;
+   unsigned int i;
+   uint8_t *buf;
+
+   if ((buf = malloc(XFER_CHUNK)) == NULL)
+   {
+      __atomic_fetch_add(&ctx->failed, 1, __ATOMIC_RELAXED);
+      return NULL;
+   }
+
+   while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED))
+          < ctx->count)
+      if (!ctx->jobs[i].isDir && exportfile(&ctx->jobs[i], buf) == -1)
+         __atomic_fetch_add(&ctx->failed, 1, __ATOMIC_RELAXED);
+
+   free(buf);
+   return NULL;
+}
+
+
+/* Extract the file described by job to the host, using buf, XFER_CHUNK
+ * bytes long, as the transfer buffer.  The file is read a run of
+ * consecutive clusters at a time.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int exportfile(const exportjob_t *job, uint8_t *buf)
+{
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int cluster = job->cluster;
+   unsigned int left = job->size;
+   unsigned int extent;
+   unsigned int len;
+   unsigned int n;
+   off_t offset;
+   int fd;
+   int status = 0;
+
+   if ((fd = open(job->path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+      return -1;
+
+   while (status == 0 && left > 0 && !lastBlk(cluster))
+   {
+      for (extent = 1; extent * clusterBytes < left
+              && getfatentry(g_fat, cluster + extent - 1) == cluster + extent;
+           extent++)
+         ;
+
+      offset = (off_t) ltop(cluster) * BLOCKSIZE;
+      len = extent * clusterBytes < left ? extent * clusterBytes : left;
+      left -= len;
+
+      for (; status == 0 && len > 0; len -= n, offset += n)
+      {
+         n = len < XFER_CHUNK ? len : XFER_CHUNK;
+         if (bc_readrun(buf, offset / BLOCKSIZE, n) == -1
+             || writefull(fd, buf, n) == -1)
+            status = -1;
+      }
+
+      cluster = getfatentry(g_fat, cluster + extent - 1);
+   }
+
+   /* A chain shorter than the file's size is an error. */
+   if (left > 0 || futimens(fd, job->times) == -1)
+      status = -1;
+   if (close(fd) == -1)
+      status = -1;
+
+   return status;
+}
+
+
+/* Write len bytes, starting at the beginning of physical block blk, to
+ * outFd for fd_sendfile().  If *zeroCopy is set and none of the blocks
+ * is in the overlay, they are sent with sendfile(); if outFd turns out
+ * not to take sendfile(), *zeroCopy is cleared.  Otherwise they are read
+ * into *buf, which is allocated, XFER_CHUNK bytes long, if it is NULL,
+ * and written.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int sendrun(int outFd, unsigned int blk, unsigned int len,
+                   int *zeroCopy, uint8_t **buf)
+{
+   off_t offset = (off_t) blk * BLOCKSIZE;
+   unsigned int chunk;
+   ssize_t n;
+
+   if (*zeroCopy && bc_held(blk, (len + BLOCKSIZE - 1) / BLOCKSIZE) == 0)
+   {
+      while (len > 0)
+      {
+         if ((n = sendfile(outFd, g_bdev.fd, &offset, len)) == -1
+             && errno == EINTR)
+            continue;
+
+         /* Only the first transfer can be refused for the kind of
+          * descriptor outFd is, so nothing has been sent yet.
+          */
+         if (n == -1 && (errno == EINVAL || errno == ENOSYS)
+             && offset == (off_t) blk * BLOCKSIZE)
+         {
+            *zeroCopy = 0;
+            break;
+         }
+
+         if (n <= 0)
+            return -1;
+         len -= n;
+      }
+
+      if (len == 0)
+         return 0;
+   }
+
+   if (*buf == NULL && (*buf = malloc(XFER_CHUNK)) == NULL)
+      return -1;
+
+   for (; len > 0; len -= chunk, blk += chunk / BLOCKSIZE)
+   {
+      chunk = len < XFER_CHUNK ? len : XFER_CHUNK;
+      if (bc_readrun(*buf, blk, chunk) == -1
+          || writefull(outFd, *buf, chunk) == -1)
+         return -1;
+   }
+
+   return 0;
+}
+
+
+/* Look up the file of request req of ctx, set its result to the number
+ * of bytes it will read, and add the segments it needs to ctx.  A block
+ * the read starts in the middle of is read here, through the block
+ * cache.  The result is -1 if the file doesn't exist, is a
+ * sub-directory, or its chain is shorter than its size.
+ *
+ * Returns 0, or -1 if memory runs out.
+ */
+static int planread(readctx_t *ctx, unsigned int req)
+{
+   struct fd_readreq *r = &ctx->reqs[req];
+   char name[FD_NAME_MAX + 1];
+   char upper[FD_NAME_MAX + 1];
+   block_t block;
+   unsigned int bi;
+   unsigned int dir;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int offset = r->offset;
+   unsigned int len = r->len;
+   unsigned int cluster;
+   unsigned int extent;
+   unsigned int blk;
+   unsigned int n;
+   unsigned int part;
+   uint8_t *out = r->buf;
+   direntry_t *direntry;
+
+   r->result = -1;
+   if (splitpath(r->path, &dir, name) == -1
+       || upcase(upper, name) == NULL
+       || (direntry = searchDir(dir, upper, block, &bi)) == NULL
+       || subdirectory(direntry))
+      return 0;
+
+   if (offset >= direntry->fileSize)
+      len = 0;
+   else if (len > direntry->fileSize - offset)
+      len = direntry->fileSize - offset;
+   r->result = len;
+
+   for (cluster = direntry->firstSector;
+        offset >= clusterBytes && !lastBlk(cluster); offset -= clusterBytes)
+      cluster = getfatentry(g_fat, cluster);
+
+   while (len > 0 && !lastBlk(cluster))
+   {
+      for (extent = 1; extent * clusterBytes - offset < len
+              && getfatentry(g_fat, cluster + extent - 1) == cluster + extent;
+           extent++)
+         ;
+
+      blk = ltop(cluster) + offset / BLOCKSIZE;
+      n = extent * clusterBytes - offset;
+      if (n > len)
+         n = len;
+
+      if (offset % BLOCKSIZE != 0)
+      {
+         part = BLOCKSIZE - offset % BLOCKSIZE;
+         if (part > n)
+            part = n;
+         if (bc_read(block, blk++) == -1)
+         {
+            r->result = -1;
+            return 0;
+         }
+         memcpy(out, block + offset % BLOCKSIZE, part);
+         out += part;
+         len -= part;
+         n -= part;
+      }
+
+      while (n > 0)
+      {
+         part = n < XFER_CHUNK ? n : XFER_CHUNK;
+         if (addseg(ctx, blk, part, out, req) == -1)
+            return -1;
+         blk += part / BLOCKSIZE;
+         out += part;
+         len -= part;
+         n -= part;
+      }
+
+      offset = 0;
+      cluster = getfatentry(g_fat, cluster + extent - 1);
+   }
+
+   if (len > 0)
+      r->result = -1;
+   return 0;
+}
+
+
+/* Add a segment to ctx.
+ *
+ * Returns 0 on success, or -1 if memory runs out.
+ */
+static int addseg(readctx_t *ctx, unsigned int blk, unsigned int len,
+                  uint8_t *out, unsigned int req)
+{
+   readseg_t *segs;
+
+   if (ctx->count == ctx->alloc)
+   {
+      ctx->alloc = ctx->alloc == 0 ? 64 : 2 * ctx->alloc;
+      if ((segs = realloc(ctx->segs, ctx->alloc * sizeof(readseg_t))) == NULL)
+         return -1;
+      ctx->segs = segs;
+   }
+
+   ctx->segs[ctx->count].blk = blk;
+   ctx->segs[ctx->count].len = len;
+   ctx->segs[ctx->count].out = out;
+   ctx->segs[ctx->count].req = req;
+   ctx->count++;
+   return 0;
+}
+
+
+/* qsort() comparison of two readseg_t's, by block number. */
+static int cmpseg(const void *a, const void *b)
+{
+   const readseg_t *x = a;
+   const readseg_t *y = b;
+
+   return (x->blk > y->blk) - (x->blk < y->blk);
+}
+
+
+/* Body of an fd_read_many() worker thread.  Workers take segments from
+ * ctx's schedule, in block order, until there are none left.  The
+ * segments were planned before the workers started, so the workers
+ * don't read the FAT; they read the image through bc_readrun(), which
+ * only looks at the overlay.  A failed read sets its request's result
+ * to -1.
+ */
+static void *readworker(void *arg)
+{
+   readctx_t *ctx = arg;
+   readseg_t *seg;
+   unsigned int i;
+
+   while ((i = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED))
+          < ctx->count)
+   {
+      seg = &ctx->segs[i];
+      if (bc_readrun(seg->out, seg->blk, seg->len) == -1)
+         __atomic_store_n(&ctx->reqs[seg->req].result, -1, __ATOMIC_RELAXED);
+   }
+
+   return NULL;
+}
+
+
+/* Convert a decoded directory entry time to a timespec for
+ * utimensat().  A zero month means the time wasn't recorded, and
+ * converts to UTIME_OMIT.
+ */
+static void fattime(const struct fd_time *t, struct timespec *ts)
+{
+   struct tm tm;
+
+   if (t->month == 0)
+   {
+      ts->tv_sec = 0;
+      ts->tv_nsec = UTIME_OMIT;
+      return;
+   }
+
+   memset(&tm, 0, sizeof tm);
+   tm.tm_year = t->year - 1900;
+   tm.tm_mon = t->month - 1;
+   tm.tm_mday = t->day;
+   tm.tm_hour = t->hour;
+   tm.tm_min = t->minute;
+   tm.tm_sec = t->second;
+   tm.tm_isdst = -1;
+
+   ts->tv_sec = mktime(&tm);
+   ts->tv_nsec = 0;
+}
+
+
+/* Returns 1 if the directory entry pointed to by direntry is free.
+ * Otherwise, returns 0.
+ */
+static int direntryFree(const direntry_t *direntry)
+{
+   if (direntry->filename[0] == (unsigned char) 0xe5
+       || direntry->filename[0] == 0x00)
+      return 1;
+   else
+      return 0;
+}
+
+
+/* Returns 1 if the directory entry pointed to by direntry is hidden.
+ * Otherwise, returns 0.
+ */
+static int hidden(const direntry_t *direntry)
+{
+
+   return direntry->attributes & HIDDEN;
+}
+
+
+/* Returns 1 if the directory entry pointed to by direntry is a
+ * sub-directory.  Otherwise, returns 0.
+ */
+static int subdirectory(const direntry_t *direntry)
+{
+   return direntry->attributes & SUBDIRECTORY;
+}
+
+
+/* Returns 1 if the directory entry pointed to by direntry contains
+ * a long filename.  Otherwise, returns 0.
+ */
+static int longFN(const direntry_t *direntry)
+{
+   return (direntry->attributes & 0XF) == 0XF;
+}
+
+
+/* fd_iterdir() callback for fd_dir().  List entry and add its size to
+ * the byte count pointed to by arg.
+ */
+static int list(const struct fd_dirent *entry, void *arg)
+{
+   *(unsigned int *) arg += entry->size;
+
+   printf("%12s  %8u   %8u   %8x %4u-%02u-%02u  %2u:%02u:%02u\n",
+          entry->name, entry->cluster, entry->size, entry->attributes,
+          entry->written.year, entry->written.month, entry->written.day,
+          entry->written.hour, entry->written.minute, entry->written.second);
+   return 0;
+}
+
+
+/* walkdir() visitor for fd_iterdir() and readentries().  Entries that
+ * pass the flags' filters are decoded, then passed to the callback or,
+ * if there is none, collected.
+ */
+static int iterentry(const direntry_t *direntry, const char *longName,
+                     void *arg)
+{
+   iterctx_t *ctx = arg;
+   struct fd_dirent entry;
+   struct fd_dirent *entries;
+
+   if ((hidden(direntry) && !(ctx->flags & FD_DIR_HIDDEN))
+       || (direntry->filename[0] == '.' && (ctx->flags & FD_DIR_NODOTS)))
+      return 0;
+
+   if (direntry->attributes & VOLUME_LABEL)
+   {
+      if (ctx->flags & FD_DIR_NOLABEL)
+         return 0;
+   }
+   else if (ctx->flags & (subdirectory(direntry) ? FD_DIR_NODIRS
+                          : FD_DIR_NOFILES))
+      return 0;
+
+   decodeentry(direntry, longName, &entry);
+
+   if (ctx->fn != NULL)
+   {
+      ctx->count++;
+      if (ctx->fn(&entry, ctx->arg) == 0)
+         return 0;
+      ctx->stopped = 1;
+      return -1;
+   }
+
+   if ((unsigned int) ctx->count == ctx->alloc)
+   {
+      ctx->alloc = ctx->alloc == 0 ? 64 : 2 * ctx->alloc;
+      entries = realloc(ctx->entries, ctx->alloc * sizeof(struct fd_dirent));
+      if (entries == NULL)
+         return -1;
+      ctx->entries = entries;
+   }
+
+   ctx->entries[ctx->count++] = entry;
+   return 0;
+}
+
+
+/* Decode the directory entry pointed to by direntry, whose long file
+ * name is longName, or NULL if it has none, into entry.
+ */
+static void decodeentry(const direntry_t *direntry, const char *longName,
+                        struct fd_dirent *entry)
+{
+   getfilename(direntry, entry->name);
+   strcpy(entry->longName, longName != NULL ? longName : "");
+   entry->attributes = direntry->attributes;
+   entry->size = direntry->fileSize;
+   entry->cluster = direntry->firstSector;
+   decodetime(direntry->creationDate, direntry->creationTime,
+              &entry->created);
+   decodetime(direntry->lastWriteDate, direntry->lastWriteTime,
+              &entry->written);
+   decodetime(direntry->lastAccess, 0, &entry->accessed);
+}
+
+
+/* Decode a FAT date and time into t.
+ */
+static void decodetime(unsigned int date, unsigned int time,
+                       struct fd_time *t)
+{
+   /* Years field, bits 9--15, is years since 1980. */
+   t->year = ((date >> 9) & 0x7f) + 1980;
+   /* Months field is bits 5--8. */
+   t->month = (date >> 5) & 0xf;
+   /* Day of month field is bits 0--4. */
+   t->day = date & 0x1f;
+   /* Hours field, in 24 hour format, is bits 11--15. */
+   t->hour = (time >> 11) & 0x1f;
+   /* Minutes field is bits 5--10. */
+   t->minute = (time >> 5) & 0x3f;
+   /* Seconds field is bits 0--4.  Granularity is 2 seconds because
+    * we're one bit short of the number of bits needed to represent a
+    * number in the range [0--59].
+    */
+   t->second = (time & 0x1f) << 1;
+}
+
+
+/* qsort() comparison functions for fd_iterdir().  Ties are broken by
+ * name.
+ */
+static int cmpname(const void *a, const void *b)
+{
+   return strcmp(entryname(a), entryname(b));
+}
+
+
+/* Returns the name entry is known by: its long file name if it has one,
+ * and otherwise its short name.
+ */
+static const char *entryname(const struct fd_dirent *entry)
+{
+   return entry->longName[0] != '\0' ? entry->longName : entry->name;
+}
+
+
+static int cmpsize(const void *a, const void *b)
+{
+   const struct fd_dirent *x = a;
+   const struct fd_dirent *y = b;
+
+   if (x->size != y->size)
+      return x->size < y->size ? -1 : 1;
+   return cmpname(a, b);
+}
+
+
+static int cmptime(const void *a, const void *b)
+{
+   const struct fd_time *x = &((const struct fd_dirent *) a)->written;
+   const struct fd_time *y = &((const struct fd_dirent *) b)->written;
+   unsigned long tx = ((((x->year * 16UL + x->month) * 32 + x->day) * 32
+                        + x->hour) * 64 + x->minute) * 64 + x->second;
+   unsigned long ty = ((((y->year * 16UL + y->month) * 32 + y->day) * 32
+                        + y->hour) * 64 + y->minute) * 64 + y->second;
+
+   if (tx != ty)
+      return tx < ty ? -1 : 1;
+   return cmpname(a, b);
+}
+
+
+/* Get the filename from the directory entry pointed to by direntry.
+ * The filename will be stored in fn, which should point to sufficient
+ * storage to store the filename in 8.3 format as a null-terminated string.
+ *
+ * Returns fn.
+ */
+static char *getfilename(const direntry_t *direntry, char *fn)
+{
+   int i;
+   char *ptr = fn;
+
+   i = 0;
+
+   while (i < 8 && (*ptr = direntry->filename[i++]) != ' ')
+      ptr++;
+
+   if (direntry->extension[0] == ' ')
+   {
+      *ptr = '\0';
+      return fn;
+   }
+
+   *ptr++ = '.';
+   i = 0;
+
+   while (i < 3 && (*ptr = direntry->extension[i++]) != ' ')
+      ptr++;
+
+   *ptr = '\0';
+
+   return fn;
+}
+
+
+/* Copy the file name name into buf, converting it to upper case.  buf
+ * should point to at least FD_NAME_MAX + 1 characters of storage.
+ *
+ * Returns buf.  Returns NULL if name is NULL, begins with 0xe5, or is
+ * too long to be a long file name.
+ */
+static char *upcase(char *buf, const char *name)
+{
+   int i;
+
+   if (name == NULL || (unsigned char) name[0] == (unsigned char) 0xe5)
+      return NULL;
+
+   for (i = 0; name[i] != '\0'; i++)
+   {
+      if (i == FD_NAME_MAX)
+         return NULL;
+      buf[i] = toupper((unsigned char) name[i]);
+   }
+
+   buf[i] = '\0';
+   return buf;
+}
+
+
+/* Convert the 8.3 format file name name to the 11 character,
+ * space-padded form stored in directory entries, converting characters
+ * to upper case.  "." and ".." are converted to the names of the
+ * corresponding directory entries.
+ *
+ * Returns 0 on success, or -1 if name isn't a valid 8.3 file name.
+ */
+static int packname(const char *name, uint8_t *packed)
+{
+   int i;
+   int j;
+
+   memset(packed, ' ', 11);
+
+   if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+   {
+      memcpy(packed, name, strlen(name));
+      return 0;
+   }
+
+   for (i = 0; name[i] != '.' && name[i] != '\0'; i++)
+   {
+      if (i == 8)
+         return -1;
+      packed[i] = toupper((unsigned char) name[i]);
+   }
+
+   if (i == 0)
+      return -1;
+
+   if (name[i] == '.')
+      for (i++, j = 0; name[i] != '\0'; i++, j++)
+      {
+         if (j == 3 || name[i] == '.')
+            return -1;
+         packed[8 + j] = toupper((unsigned char) name[i]);
+      }
+
+   return 0;
+}
+
+
+/* Convert the DOS wildcard pattern pattern to the 11 character form
+ * used by matchname(), like packname().  A ? matches any one character,
+ * including the padding, and a * matches the rest of the name or the
+ * extension; characters after a * up to the end of its field are
+ * ignored, as in DOS.  A pattern with no extension only matches names
+ * with no extension, so *.* matches every file.
+ *
+ * Returns 0 on success, or -1 if pattern isn't a valid pattern.
+ */
+static int packpattern(const char *pattern, uint8_t *packed)
+{
+   const char *p = pattern;
+   int j;
+
+   memset(packed, ' ', 11);
+
+   for (j = 0; *p != '.' && *p != '\0'; p++)
+   {
+      if (*p == '*')
+      {
+         memset(packed + j, '?', 8 - j);
+         for (j = 8; p[1] != '.' && p[1] != '\0'; p++)
+            ;
+      }
+      else if (j == 8)
+         return -1;
+      else
+         packed[j++] = toupper((unsigned char) *p);
+   }
+
+   if (p == pattern)
+      return -1;
+
+   if (*p == '.')
+      for (p++, j = 8; *p != '\0'; p++)
+      {
+         if (*p == '.')
+            return -1;
+         if (*p == '*')
+         {
+            memset(packed + j, '?', 11 - j);
+            for (j = 11; p[1] != '\0'; p++)
+               ;
+         }
+         else if (j == 11)
+            return -1;
+         else
+            packed[j++] = toupper((unsigned char) *p);
+      }
+
+   return 0;
+}
+
+
+/* Returns true if name contains a wildcard character.
+ */
+static int wildcard(const char *name)
+{
+   return strpbrk(name, "*?") != NULL;
+}
+
+
+/* Returns true if the name of the directory entry pointed to by
+ * direntry matches pattern, as produced by packpattern().
+ */
+static int matchname(const uint8_t *pattern, const direntry_t *direntry)
+{
+   const uint8_t *name = direntry->filename;
+   int i;
+
+   /* filename and extension are adjacent in the entry. */
+   for (i = 0; i < 11; i++)
+      if (pattern[i] != '?' && pattern[i] != name[i])
+         return 0;
+
+   return 1;
+}
+
+
+/* Call fn for each file in the current working directory whose short
+ * name matches pattern, as produced by packpattern(), in one pass over
+ * the directory.  As in DOS, hidden and system files never match, and
+ * neither do sub-directories or the volume label.  fn returns true if
+ * it deleted the entry, in which case the entry's long file name
+ * entries are deleted too.  A block holding deleted entries is written
+ * back once, after all its entries have been seen; only a long name
+ * that starts in an earlier block costs another write of that block.
+ *
+ * Returns the number of files matched.
+ */
+static int matchcwd(const uint8_t *pattern,
+                    int (*fn)(direntry_t *direntry, void *arg), void *arg)
+{
+   unsigned int b = 0;
+   unsigned int blk = 0;
+   unsigned int index = 0;
+   unsigned int live;
+   unsigned int lfns;
+   unsigned int i;
+   unsigned int j;
+   int matched = 0;
+   int dirty;
+   int erased = 0;
+   chainpos_t pos;
+   dirmasks_t masks;
+   lfnstate_t lfn;
+   block_t block;
+   uint8_t *entries;
+   direntry_t *direntry;
+   const char *longName;
+   char buf[FD_NAME_MAX + 1];
+
+   lfn.seq = 0;
+   if (!cwdIsRoot())
+      chainStart(&pos, g_cwdHead, RA_BLOCKS);
+
+   while (cwdIsRoot() ? b < g_geom.rootBlocks : !lastBlk(pos.cluster))
+   {
+      if (cwdIsRoot())
+      {
+         if ((entries = rootblock(b++)) == NULL)
+            break;
+      }
+      else
+      {
+         blk = chainBlk(&pos);
+         bc_read(block, blk);
+         entries = block;
+         chainNext(&pos);
+      }
+
+      dirty = 0;
+      live = scanblock(entries, NULL, &masks);
+      lfns = lfnentries(&masks);
+
+      for (live |= lfns; live != 0; live &= live - 1)
+      {
+         i = __builtin_ctz(live);
+         direntry = (direntry_t *) entries + i;
+
+         if (lfns & 1u << i)
+         {
+            lfnfeed(&lfn, entries + i * sizeof(direntry_t), index + i);
+            continue;
+         }
+
+         longName = lfnname(&lfn, direntry, index + i, buf);
+
+         if ((direntry->attributes
+              & (HIDDEN | SYSTEM | SUBDIRECTORY | VOLUME_LABEL))
+             || !matchname(pattern, direntry))
+            continue;
+
+         matched++;
+         if (!fn(direntry, arg))
+            continue;
+
+         dirty = 1;
+         if (longName != NULL)
+         {
+            erased = 1;
+            for (j = lfn.first; j < index + i; j++)
+               if (j >= index)
+                  ((direntry_t *) entries)[j - index].filename[0] = 0xe5;
+            if (lfn.first < index)
+               eraserange(g_cwdHead, lfn.first, index);
+         }
+      }
+
+      if (dirty)
+      {
+         writedirentry(g_cwdHead, (direntry_t *) entries, block, blk);
+         dirmapscan(g_cwdHead, index, (direntry_t *) entries);
+      }
+
+      if (masks.end)
+         break;
+      index += DIR_ENTRIES;
+   }
+
+   if (erased)
+      lfndrop(g_cwdHead);
+
+   return matched;
+}
+
+
+/* matchcwd() callback for fd_del().  arg points to the unsigned int
+ * count of clusters freed.
+ */
+static int delentry(direntry_t *direntry, void *arg)
+{
+   *(unsigned int *) arg += freeChain(direntry->firstSector);
+   direntry->filename[0] = 0xe5;
+   g_files--;
+   return 1;
+}
+
+
+/* matchcwd() callback for fd_type().  arg points to the unsigned int
+ * count of characters typed.
+ */
+static int typeentry(direntry_t *direntry, void *arg)
+{
+   *(unsigned int *) arg += typefile(direntry);
+   return 0;
+}
+
+
+/* Write the contents of the file whose directory entry is pointed to by
+ * direntry to stdout.
+ *
+ * Returns the number of characters written.
+ */
+static unsigned int typefile(const direntry_t *direntry)
+{
+   unsigned int i;
+   unsigned int fsize = direntry->fileSize;
+   unsigned int nchar = 0;
+   chainpos_t pos;
+   block_t block;
+
+   /* Walk the file's chain block by block, stopping at the end of the
+    * chain or the end of the file, whichever comes first.
+    */
+   for (chainStart(&pos, direntry->firstSector, RA_BLOCKS);
+        nchar < fsize && !lastBlk(pos.cluster); chainNext(&pos))
+   {
+      bc_read(block, chainBlk(&pos));
+
+      for (i = 0; i < BLOCKSIZE && nchar < fsize; i++, nchar++)
+         putchar(block[i]);
+   }
+
+   return nchar;
+}
+
+
+/* Offsets of the characters of a long file name entry. */
+static const unsigned char lfnOffsets[LFN_CHARS] =
+   { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+
+
+/* Returns the checksum of the 11 character short name name, which each
+ * of its entry's long file name entries records.
+ */
+static uint8_t lfnchecksum(const uint8_t *name)
+{
+   uint8_t sum = 0;
+   int i;
+
+   for (i = 0; i < 11; i++)
+      sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+
+   return sum;
+}
+
+
+/* Add the long file name entry at ent, at position index of its
+ * directory, to the name being assembled in lfn.  An entry that doesn't
+ * continue the name discards it; an entry flagged LFN_LAST starts a new
+ * one.
+ */
+static void lfnfeed(lfnstate_t *lfn, const uint8_t *ent, unsigned int index)
+{
+   unsigned int seq = ent[0] & ~LFN_LAST;
+   unsigned int i;
+
+   if (ent[0] & LFN_LAST)
+   {
+      lfn->seq = seq + 1;
+      lfn->next = lfn->first = index;
+      lfn->checksum = ent[13];
+   }
+
+   if (seq == 0 || seq > LFN_ENTRIES || seq + 1 != lfn->seq
+       || index != lfn->next || ent[13] != lfn->checksum)
+   {
+      lfn->seq = 0;
+      return;
+   }
+
+   /* A name that fills its last entry isn't terminated. */
+   if (ent[0] & LFN_LAST)
+      lfn->chars[seq * LFN_CHARS] = 0;
+
+   for (i = 0; i < LFN_CHARS; i++)
+      lfn->chars[(seq - 1) * LFN_CHARS + i] =
+         ent[lfnOffsets[i]] | ent[lfnOffsets[i] + 1] << 8;
+
+   lfn->seq = seq;
+   lfn->next = index + 1;
+}
+
+
+/* Finish the long file name being assembled in lfn, if the short entry
+ * direntry, at position index, completes it: all the name's entries
+ * must have been seen, immediately before the short entry, and carry
+ * its checksum.  The name is stored in buf, in UTF-8; buf should point
+ * to at least FD_NAME_MAX + 1 characters of storage.  A name that
+ * couldn't have been created, such as one holding a '/' or one that is
+ * "..", is ignored, so the entry is known by its short name.
+ *
+ * Returns buf, or NULL if the entry has no valid long name.
+ */
+static char *lfnname(lfnstate_t *lfn, const direntry_t *direntry,
+                     unsigned int index, char *buf)
+{
+   unsigned int seq = lfn->seq;
+
+   lfn->seq = 0;
+
+   if (seq != 1 || index != lfn->next
+       || lfnchecksum(direntry->filename) != lfn->checksum)
+      return NULL;
+
+   return utf16to8(lfn->chars, buf) != NULL && longvalid(buf) ? buf : NULL;
+}
+
+
+/* Returns a mask of the long file name entries in a block scanned by
+ * scanblock(), like the mask scanblock() returns.
+ */
+static unsigned int lfnentries(const dirmasks_t *masks)
+{
+   unsigned int live = 0xffff;
+
+   if (masks->end)
+      live = (masks->end & (~masks->end + 1)) - 1;
+
+   return live & masks->lfn & ~masks->free;
+}
+
+
+/* Fill the long file name entry at ent with part seq of the name in
+ * chars, for the short name with checksum checksum.  chars holds the
+ * name as stored: terminated by a null character unless it fills its
+ * last entry, then padded with 0xffff.  last is true for the entry
+ * holding the end of the name.
+ */
+static void putlfnentry(uint8_t *ent, unsigned int seq, int last,
+                        const uint16_t *chars, uint8_t checksum)
+{
+   unsigned int i;
+   unsigned int c;
+
+   memset(ent, 0, sizeof(direntry_t));
+   ent[0] = seq | (last ? LFN_LAST : 0);
+   ent[11] = READ_ONLY | HIDDEN | SYSTEM | VOLUME_LABEL;
+   ent[13] = checksum;
+
+   for (i = 0; i < LFN_CHARS; i++)
+   {
+      c = chars[(seq - 1) * LFN_CHARS + i];
+      ent[lfnOffsets[i]] = c & 0xff;
+      ent[lfnOffsets[i] + 1] = c >> 8;
+   }
+}
+
+
+/* Convert the null-terminated UTF-16 string src to UTF-8 in dst, which
+ * should point to at least FD_NAME_MAX + 1 characters of storage.
+ *
+ * Returns dst, or NULL if src is empty, isn't valid UTF-16, or is too
+ * long.
+ */
+static char *utf16to8(const uint16_t *src, char *dst)
+{
+   static const unsigned char lead[] = { 0, 0, 0xc0, 0xe0, 0xf0 };
+   size_t len = 0;
+   unsigned int c;
+   unsigned int n;
+   unsigned int i;
+
+   for (; *src != 0; src++)
+   {
+      c = *src;
+
+      if (c >= 0xd800 && c < 0xdc00 && src[1] >= 0xdc00 && src[1] < 0xe000)
+         c = 0x10000 + ((c - 0xd800) << 10) + (*++src - 0xdc00);
+      else if (c >= 0xd800 && c < 0xe000)
+         return NULL;
+
+      n = c < 0x80 ? 1 : c < 0x800 ? 2 : c < 0x10000 ? 3 : 4;
+      if (len + n > FD_NAME_MAX)
+         return NULL;
+
+      if (n == 1)
+         dst[len] = c;
+      else
+      {
+         for (i = n - 1; i > 0; i--, c >>= 6)
+            dst[len + i] = 0x80 | (c & 0x3f);
+         dst[len] = lead[n] | c;
+      }
+      len += n;
+   }
+
+   if (len == 0)
+      return NULL;
+
+   dst[len] = '\0';
+   return dst;
+}
+
+
+/* Returns true if name, in UTF-8, may be a long file name: it isn't "."
+ * or "..", and holds no control characters and none of the characters
+ * FAT reserves.
+ */
+static int longvalid(const char *name)
+{
+   const char *p;
+
+   if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      return 0;
+
+   for (p = name; *p != '\0'; p++)
+      if ((unsigned char) *p < 0x20 || strchr("\"*/:<>?\\|", *p) != NULL)
+         return 0;
+
+   return 1;
+}
+
+
+/* Convert the UTF-8 string src to UTF-16 in dst, which should have room
+ * for FD_NAME_MAX characters.  No terminating null character is
+ * stored.
+ *
+ * Returns the number of characters stored, or -1 if src isn't valid
+ * UTF-8 or is too long.
+ */
+static int utf8to16(const char *src, uint16_t *dst)
+{
+   const unsigned char *p = (const unsigned char *) src;
+   unsigned int c;
+   unsigned int n;
+   int len = 0;
+
+   while (*p != '\0')
+   {
+      if (*p < 0x80)
+         c = *p, n = 0;
+      else if ((*p & 0xe0) == 0xc0)
+         c = *p & 0x1f, n = 1;
+      else if ((*p & 0xf0) == 0xe0)
+         c = *p & 0x0f, n = 2;
+      else if ((*p & 0xf8) == 0xf0)
+         c = *p & 0x07, n = 3;
+      else
+         return -1;
+
+      for (p++; n > 0; n--, p++)
+      {
+         if ((*p & 0xc0) != 0x80)
+            return -1;
+         c = c << 6 | (*p & 0x3f);
+      }
+
+      if ((c >= 0xd800 && c < 0xe000) || c > 0x10ffff
+          || len + (c >= 0x10000 ? 2 : 1) > FD_NAME_MAX)
+         return -1;
+
+      if (c >= 0x10000)
+      {
+         c -= 0x10000;
+         dst[len++] = 0xd800 + (c >> 10);
+         dst[len++] = 0xdc00 + (c & 0x3ff);
+      }
+      else
+         dst[len++] = c;
+   }
+
+   return len;
+}
+
+
+/* Returns true if name, in upper case, is a valid 8.3 format file name
+ * made of the characters DOS allows in short names, so that it needs no
+ * long file name entries.
+ */
+static int shortname(const char *name)
+{
+   uint8_t packed[11];
+
+   if (packname(name, packed) == -1)
+      return 0;
+
+   for (; *name != '\0'; name++)
+      if (!isalnum((unsigned char) *name)
+          && strchr("!#$%&'()-@^_`{}~.", *name) == NULL)
+         return 0;
+
+   return 1;
+}
+
+
+/* Generate a short alias for the long file name name in the directory
+ * whose first cluster is dir, as VFAT does: up to the first six
+ * characters of the name, up to the first three of its last extension,
+ * and a numeric tail ~N that makes the alias unique.  Spaces and periods
+ * are dropped and characters short names can't hold become _.  alias
+ * should point to at least NAME_LEN characters of storage.
+ *
+ * Returns 0 on success, or -1 if no unique alias is left.
+ */
+static int makealias(unsigned int dir, const char *name, char *alias)
+{
+   char base[9];
+   char ext[4];
+   char tail[9];
+   const char *dot;
+   int nbase = 0;
+   int next = 0;
+   int len;
+   unsigned int n;
+   unsigned int bi;
+   block_t block;
+
+   while (*name == '.')
+      name++;
+   dot = strrchr(name, '.');
+
+   for (; *name != '\0' && name != dot && nbase < 8; name++)
+      if (*name != ' ' && *name != '.')
+         base[nbase++] = aliaschar(*name);
+
+   for (name = dot; dot != NULL && *++name != '\0' && next < 3; )
+      if (*name != ' ')
+         ext[next++] = aliaschar(*name);
+
+   if (nbase == 0)
+      base[nbase++] = '_';
+
+   for (n = 1; n < 1000000; n++)
+   {
+      len = sprintf(tail, "~%u", n);
+      sprintf(alias, "%.*s%s%s%.*s", nbase < 8 - len ? nbase : 8 - len,
+              base, tail, next > 0 ? "." : "", next, ext);
+
+      if (searchDir(dir, alias, block, &bi) == NULL)
+         return 0;
+   }
+
+   return -1;
+}
+
+
+/* Returns c as it appears in a short alias: in upper case, or _ if
+ * short names can't hold it.
+ */
+static int aliaschar(int c)
+{
+   if ((unsigned char) c >= 0x80 || strchr("+,;=[]", c) != NULL)
+      return '_';
+
+   return toupper((unsigned char) c);
+}
+
+
+/* Returns the long file name index of the directory whose first cluster
+ * is dir, or of the root if dir is 0.  The index is built by a walk of
+ * the directory the first time, then kept until the directory's names
+ * change; only the LFN_INDEXES most recently used are kept.
+ *
+ * Returns NULL if memory runs out.
+ */
+static lfnindex_t *lfnindex(unsigned int dir)
+{
+   lfnindex_t **link;
+   lfnindex_t *idx;
+   unsigned int count = 0;
+
+   for (link = &g_lfnIndexes; (idx = *link) != NULL;
+        link = &idx->next, count++)
+      if (idx->dir == dir)
+      {
+         *link = idx->next;
+         idx->next = g_lfnIndexes;
+         g_lfnIndexes = idx;
+         return idx;
+      }
+
+   /* Make room by dropping the least recently used index. */
+   if (count >= LFN_INDEXES)
+   {
+      for (link = &g_lfnIndexes; (*link)->next != NULL;
+           link = &(*link)->next)
+         ;
+      lfnfree(*link);
+      *link = NULL;
+   }
+
+   if ((idx = calloc(1, sizeof(lfnindex_t))) == NULL)
+      return NULL;
+
+   idx->dir = dir;
+   if (walkdir(dir, lfnadd, idx) == -1)
+   {
+      lfnfree(idx);
+      return NULL;
+   }
+
+   idx->next = g_lfnIndexes;
+   g_lfnIndexes = idx;
+   return idx;
+}
+
+
+/* walkdir() visitor for lfnindex().  Entries with long names are added
+ * to the index.
+ */
+static int lfnadd(const direntry_t *direntry, const char *longName,
+                  void *arg)
+{
+   lfnindex_t *idx = arg;
+   size_t len;
+   char *names;
+
+   if (longName == NULL)
+      return 0;
+
+   len = strlen(longName) + 1;
+   if (idx->namesLen + len > idx->namesAlloc)
+   {
+      idx->namesAlloc = idx->namesAlloc == 0 ? 1024 : 2 * idx->namesAlloc;
+      if ((names = realloc(idx->names, idx->namesAlloc)) == NULL)
+         return -1;
+      idx->names = names;
+   }
+
+   memcpy(idx->names + idx->namesLen, longName, len);
+   if (lfninsert(idx, lfnhash(longName), idx->namesLen + 1,
+                 direntry->filename) == -1)
+      return -1;
+
+   idx->namesLen += len;
+   return 0;
+}
+
+
+/* Add a slot for the name at offset name - 1 in idx's names, whose hash
+ * is hash, to idx.  The table is doubled when it becomes half full.
+ *
+ * Returns 0 on success, or -1 if memory runs out.
+ */
+static int lfninsert(lfnindex_t *idx, uint32_t hash, unsigned int name,
+                     const uint8_t *shortName)
+{
+   lfnslot_t *old = idx->slots;
+   unsigned int oldSize = idx->size;
+   unsigned int i;
+
+   if (2 * (idx->used + 1) > idx->size)
+   {
+      idx->size = idx->size == 0 ? 64 : 2 * idx->size;
+      if ((idx->slots = calloc(idx->size, sizeof(lfnslot_t))) == NULL)
+      {
+         idx->slots = old;
+         idx->size = oldSize;
+         return -1;
+      }
+
+      idx->used = 0;
+      for (i = 0; i < oldSize; i++)
+         if (old[i].name != 0)
+            lfninsert(idx, old[i].hash, old[i].name, old[i].shortName);
+      free(old);
+   }
+
+   for (i = hash & (idx->size - 1); idx->slots[i].name != 0;
+        i = (i + 1) & (idx->size - 1))
+      ;
+
+   idx->slots[i].hash = hash;
+   idx->slots[i].name = name;
+   memcpy(idx->slots[i].shortName, shortName, 11);
+   idx->used++;
+   return 0;
+}
+
+
+/* Look up the long file name name, ignoring case, in the directory
+ * whose first cluster is dir, or in the root if dir is 0.
+ *
+ * Returns 0 on success, with the short name of the name's entry in
+ * packed.  Otherwise, returns -1.
+ */
+static int lfnlookup(unsigned int dir, const char *name, uint8_t *packed)
+{
+   uint32_t hash = lfnhash(name);
+   unsigned int i;
+   lfnindex_t *idx;
+
+   if ((idx = lfnindex(dir)) == NULL || idx->size == 0)
+      return -1;
+
+   for (i = hash & (idx->size - 1); idx->slots[i].name != 0;
+        i = (i + 1) & (idx->size - 1))
+      if (idx->slots[i].hash == hash
+          && lfnequal(idx->names + idx->slots[i].name - 1, name))
+      {
+         memcpy(packed, idx->slots[i].shortName, 11);
+         return 0;
+      }
+
+   return -1;
+}
+
+
+/* Discard the long file name index of the directory whose first cluster
+ * is dir, if there is one, after the directory's names have changed.
+ */
+static void lfndrop(unsigned int dir)
+{
+   lfnindex_t **link;
+   lfnindex_t *idx;
+
+   for (link = &g_lfnIndexes; (idx = *link) != NULL; link = &idx->next)
+      if (idx->dir == dir)
+      {
+         *link = idx->next;
+         idx->next = NULL;
+         lfnfree(idx);
+         return;
+      }
+}
+
+
+/* Free the index idx and every index after it in its list.
+ */
+static void lfnfree(lfnindex_t *idx)
+{
+   lfnindex_t *next;
+
+   for (; idx != NULL; idx = next)
+   {
+      next = idx->next;
+      free(idx->slots);
+      free(idx->names);
+      free(idx);
+   }
+}
+
+
+/* Returns the hash of the long file name name, ignoring case.
+ */
+static uint32_t lfnhash(const char *name)
+{
+   uint32_t hash = 2166136261u;
+
+   for (; *name != '\0'; name++)
+      hash = (hash ^ fold(*name)) * 16777619u;
+
+   return hash;
+}
+
+
+/* Returns true if the long file names a and b are equal, ignoring case.
+ */
+static int lfnequal(const char *a, const char *b)
+{
+   for (; *a != '\0' && fold(*a) == fold(*b); a++, b++)
+      ;
+
+   return *a == '\0' && *b == '\0';
+}
+
+
+/* Returns the character c with case folded, for comparing long file
+ * names.  Only ASCII letters are folded.
+ */
+static int fold(int c)
+{
+   return (unsigned char) c < 0x80 ? toupper((unsigned char) c)
+      : (unsigned char) c;
+}
+
+
+/* Returns the entry map of the directory whose first cluster is dir, or
+ * of the root if dir is 0.  The map is built by reading every block of
+ * the directory the first time, then kept up to date as entries are
+ * written; only the DIR_MAPS most recently used are kept.
+ *
+ * Returns NULL if memory runs out or a block of the root directory
+ * can't be read.
+ */
+static dirmap_t *dirmap(unsigned int dir)
+{
+   dirmap_t **link;
+   dirmap_t *map;
+   unsigned int count = 0;
+   unsigned int blocks = 0;
+   unsigned int cluster;
+   unsigned int b;
+   const uint8_t *entries;
+   block_t block;
+
+   if ((map = dirmapfind(dir)) != NULL)
+      return map;
+
+   for (link = &g_dirMaps; *link != NULL; link = &(*link)->next)
+      count++;
+
+   /* Make room by dropping the least recently used map. */
+   if (count >= DIR_MAPS)
+   {
+      for (link = &g_dirMaps; (*link)->next != NULL; link = &(*link)->next)
+         ;
+      dirmapfree(*link);
+      *link = NULL;
+   }
+
+   if ((map = calloc(1, sizeof(dirmap_t))) == NULL)
+      return NULL;
+   map->dir = dir;
+
+   if (dir == 0)
+      blocks = g_geom.rootBlocks;
+   else
+      for (cluster = dir; !lastBlk(cluster);
+           cluster = getfatentry(g_fat, cluster))
+      {
+         blocks += g_geom.blocksPerCluster;
+         map->last = cluster;
+      }
+
+   if (blocks == 0 || dirmapsize(map, blocks) == -1)
+   {
+      dirmapfree(map);
+      return NULL;
+   }
+
+   map->end = blocks;
+   for (cluster = dir, b = 0; b < blocks; b++)
+   {
+      if (dir != 0)
+      {
+         if (b > 0 && b % g_geom.blocksPerCluster == 0)
+            cluster = getfatentry(g_fat, cluster);
+         map->blks[b] = ltop(cluster) + b % g_geom.blocksPerCluster;
+      }
+      map->blocks = b + 1;
+      if ((entries = dirmapread(map, b, block)) == NULL)
+      {
+         dirmapfree(map);
+         return NULL;
+      }
+      dirmapblock(map, b, entries);
+   }
+
+   map->next = g_dirMaps;
+   g_dirMaps = map;
+   return map;
+}
+
+
+/* Returns the entry map of the directory whose first cluster is dir, or
+ * of the root if dir is 0, if it is kept, moving it to the front of the
+ * list.  Otherwise, returns NULL.
+ */
+static dirmap_t *dirmapfind(unsigned int dir)
+{
+   dirmap_t **link;
+   dirmap_t *map;
+
+   for (link = &g_dirMaps; (map = *link) != NULL; link = &map->next)
+      if (map->dir == dir)
+      {
+         *link = map->next;
+         map->next = g_dirMaps;
+         g_dirMaps = map;
+         return map;
+      }
+
+   return NULL;
+}
+
+
+/* Make room in map for blocks blocks.  Room is doubled as need be, and
+ * the hash table is rebuilt for the new number of entries.
+ *
+ * Returns 0 on success, or -1 if memory runs out.
+ */
+static int dirmapsize(dirmap_t *map, unsigned int blocks)
+{
+   unsigned int alloc = map->alloc == 0 ? 1 : map->alloc;
+   unsigned int entries;
+   unsigned int pos;
+   void *p;
+
+   if (blocks <= map->alloc)
+      return 0;
+
+   while (alloc < blocks)
+      alloc *= 2;
+   entries = alloc * DIR_ENTRIES;
+
+   if ((p = realloc(map->free, alloc * sizeof(uint16_t))) == NULL)
+      return -1;
+   map->free = p;
+   if ((p = realloc(map->live, alloc * sizeof(uint16_t))) == NULL)
+      return -1;
+   map->live = p;
+   if ((p = realloc(map->blks, alloc * sizeof(unsigned int))) == NULL)
+      return -1;
+   map->blks = p;
+   if ((p = realloc(map->names, entries * 11)) == NULL)
+      return -1;
+   map->names = p;
+   if ((p = realloc(map->links, entries * sizeof(unsigned int))) == NULL)
+      return -1;
+   map->links = p;
+   if ((p = calloc(entries, sizeof(unsigned int))) == NULL)
+      return -1;
+
+   memset(map->live + map->alloc, 0, (alloc - map->alloc) * sizeof(uint16_t));
+   free(map->buckets);
+   map->buckets = p;
+   map->nbuckets = entries;
+   map->alloc = alloc;
+
+   for (pos = 0; pos < map->blocks * DIR_ENTRIES; pos++)
+      if (map->live[pos / DIR_ENTRIES] & 1u << pos % DIR_ENTRIES)
+         dirmaplink(map, pos);
+
+   return 0;
+}
+
+
+/* Record the entries of block b of map, entries, in the map: the block's
+ * free entries, and if the block is one a search sees, the names of its
+ * live entries.  A block with an end marker hides the blocks after it
+ * from searches.
+ *
+ * Returns true if the block has an end marker.
+ */
+static int dirmapblock(dirmap_t *map, unsigned int b, const uint8_t *entries)
+{
+   dirmasks_t masks;
+   unsigned int live = scanblock(entries, NULL, &masks);
+   unsigned int old;
+   unsigned int i;
+
+   map->free[b] = masks.free;
+   if (masks.free && b < map->hint)
+      map->hint = b;
+   while (map->hint < map->blocks && map->free[map->hint] == 0)
+      map->hint++;
+
+   if (b > map->end)
+      return masks.end != 0;
+
+   for (old = map->live[b]; old != 0; old &= old - 1)
+      dirmapunlink(map, b * DIR_ENTRIES + __builtin_ctz(old));
+
+   map->live[b] = live;
+   for (; live != 0; live &= live - 1)
+   {
+      i = __builtin_ctz(live);
+      memcpy(map->names[b * DIR_ENTRIES + i], entries + i * sizeof(direntry_t),
+             11);
+      dirmaplink(map, b * DIR_ENTRIES + i);
+   }
+
+   if (masks.end && b < map->end)
+   {
+      for (i = b + 1; i <= map->end && i < map->blocks; i++)
+         for (old = map->live[i]; old != 0; old &= old - 1)
+            dirmapunlink(map, i * DIR_ENTRIES + __builtin_ctz(old));
+      for (i = b + 1; i <= map->end && i < map->blocks; i++)
+         map->live[i] = 0;
+      map->end = b;
+   }
+
+   return masks.end != 0;
+}
+
+
+/* Returns the entries of block b of map, read into block for a
+ * sub-directory, or in the cached root directory.  Returns NULL if a
+ * root directory block can't be read.
+ */
+static const uint8_t *dirmapread(const dirmap_t *map, unsigned int b,
+                                 block_t block)
+{
+   if (map->dir == 0)
+      return rootblock(b);
+
+   bc_read(block, map->blks[b]);
+   return block;
+}
+
+
+/* Bring the map of the directory whose first cluster is dir, if there
+ * is one, up to date after the block holding direntry, the entry at
+ * position index, has been written.  If the block had the directory's
+ * first end marker and no longer does, the blocks after it are read
+ * until the next one.
+ */
+static void dirmapscan(unsigned int dir, unsigned int index,
+                       const direntry_t *direntry)
+{
+   unsigned int b = index / DIR_ENTRIES;
+   dirmap_t *map;
+   const uint8_t *entries;
+   block_t block;
+
+   if ((map = dirmapfind(dir)) == NULL || b >= map->blocks)
+      return;
+
+   if (dirmapblock(map, b, (const uint8_t *) (direntry - index % DIR_ENTRIES))
+       || b != map->end)
+      return;
+
+   map->end = map->blocks;
+   for (b++; b < map->blocks; b++)
+      if ((entries = dirmapread(map, b, block)) == NULL)
+      {
+         dirmapdrop(dir);
+         return;
+      }
+      else if (dirmapblock(map, b, entries))
+         break;
+}
+
+
+/* Add the blocks of cluster, which has just been added to the end of
+ * map's sub-directory and zeroed, to map.
+ *
+ * Returns 0 on success, or -1 if memory runs out.
+ */
+static int dirmapgrow(dirmap_t *map, unsigned int cluster)
+{
+   unsigned int i;
+
+   if (dirmapsize(map, map->blocks + g_geom.blocksPerCluster) == -1)
+      return -1;
+
+   /* end needs no change: if no block had an end marker, it is now the
+    * first new block, which has one.
+    */
+   for (i = 0; i < g_geom.blocksPerCluster; i++, map->blocks++)
+   {
+      map->free[map->blocks] = 0xffff;
+      map->live[map->blocks] = 0;
+      map->blks[map->blocks] = ltop(cluster) + i;
+   }
+
+   map->last = cluster;
+   return 0;
+}
+
+
+/* Returns the position of the first live entry named packed, in the 11
+ * character form produced by packname(), that a search of map's
+ * directory sees, or -1 if there is none.
+ */
+static int dirmaplookup(const dirmap_t *map, const uint8_t *packed)
+{
+   unsigned int pos = map->buckets[namehash(packed) & (map->nbuckets - 1)];
+   int found = -1;
+
+   for (; pos != 0; pos = map->links[pos - 1])
+      if (memcmp(map->names[pos - 1], packed, 11) == 0
+          && (found == -1 || pos - 1 < (unsigned int) found))
+         found = pos - 1;
+
+   return found;
+}
+
+
+/* Add the entry at position pos of map, whose name is in map's names,
+ * to the hash table.
+ */
+static void dirmaplink(dirmap_t *map, unsigned int pos)
+{
+   unsigned int *head =
+      &map->buckets[namehash(map->names[pos]) & (map->nbuckets - 1)];
+
+   map->links[pos] = *head;
+   *head = pos + 1;
+}
+
+
+/* Remove the entry at position pos of map from the hash table.
+ */
+static void dirmapunlink(dirmap_t *map, unsigned int pos)
+{
+   unsigned int *link =
+      &map->buckets[namehash(map->names[pos]) & (map->nbuckets - 1)];
+
+   while (*link != pos + 1)
+      link = &map->links[*link - 1];
+   *link = map->links[pos];
+}
+
+
+/* Discard the entry map of the directory whose first cluster is dir, if
+ * there is one.
+ */
+static void dirmapdrop(unsigned int dir)
+{
+   dirmap_t **link;
+   dirmap_t *map;
+
+   for (link = &g_dirMaps; (map = *link) != NULL; link = &map->next)
+      if (map->dir == dir)
+      {
+         *link = map->next;
+         map->next = NULL;
+         dirmapfree(map);
+         return;
+      }
+}
+
+
+/* Free the map map and every map after it in its list.
+ */
+static void dirmapfree(dirmap_t *map)
+{
+   dirmap_t *next;
+
+   for (; map != NULL; map = next)
+   {
+      next = map->next;
+      free(map->free);
+      free(map->live);
+      free(map->blks);
+      free(map->names);
+      free(map->links);
+      free(map->buckets);
+      free(map);
+   }
+}
+
+
+/* Returns the hash of the 11 character short name packed.
+ */
+static unsigned int namehash(const uint8_t *packed)
+{
+   uint32_t hash = 2166136261u;
+   int i;
+
+   for (i = 0; i < 11; i++)
+      hash = (hash ^ packed[i]) * 16777619u;
+
+   return hash;
+}
+
+
+/* Scan the directory block at block, which holds DIR_ENTRIES entries.
+ * name and masks are as for vec_scandir().
+ *
+ * Returns a mask of the entries in the block that are in use and aren't
+ * long file name entries.  Entries following the end of the directory
+ * are never in use.
+ */
+static unsigned int scanblock(const uint8_t *block, const uint8_t *name,
+                              dirmasks_t *masks)
+{
+   unsigned int live = 0xffff;
+
+   vec_scandir(block, name, masks);
+
+   /* Keep only the entries below the lowest end marker. */
+   if (masks->end)
+      live = (masks->end & (~masks->end + 1)) - 1;
+
+   return live & ~masks->free & ~masks->lfn;
+}
+
+
+/* Set the directory entry pointed to by direntry to the name fn, with
+ * attributes attrib.  entryTime will be used to set the creation, access,
+ * and write dates/times.  The entry's starting block will be set to
+ * strtBlk and the entry's size will be set to size.
+ *
+ * fn should be in 8.3 format.  Characters will be converted to upper case.
+ */
+static void putdirentry(direntry_t *direntry, const char *fn,
+                        unsigned int attrib, struct tm *entryTime,
+                        unsigned int strtBlk, unsigned int size)
+{
+   unsigned int packedTime;
+   unsigned int packedDate;
+
+   packname(fn, direntry->filename);
+
+   direntry->attributes = 0xff & attrib;
+
+   packedTime = ((0x1f & entryTime->tm_hour) << 11) |
+      ((0x3f & entryTime->tm_min) << 5) |
+      (0x1f & (entryTime->tm_sec >> 1));
+   direntry->creationTime = packedTime;
+   direntry->lastWriteTime = packedTime;
+
+   packedDate = ((0x7f & (entryTime->tm_year - 80)) << 9) |
+      ((0xf & (entryTime->tm_mon + 1)) << 5) |
+      (0x1f & entryTime->tm_mday);
+   direntry->creationDate = packedDate;
+   direntry->lastAccess = packedDate;
+   direntry->lastWriteDate = packedDate;
+
+   direntry->firstSector = 0xffff & strtBlk;
+   direntry->fileSize = 0xffffffff & size;
+}
+
+
+/* Set the write date and time of the directory entry pointed to by
+ * direntry to entryTime.
+ */
+static void touchdirentry(direntry_t *direntry, struct tm *entryTime)
+{
+   direntry->lastWriteTime = ((0x1f & entryTime->tm_hour) << 11) |
+      ((0x3f & entryTime->tm_min) << 5) |
+      (0x1f & (entryTime->tm_sec >> 1));
+   direntry->lastWriteDate = ((0x7f & (entryTime->tm_year - 80)) << 9) |
+      ((0xf & (entryTime->tm_mon + 1)) << 5) |
+      (0x1f & entryTime->tm_mday);
+   direntry->lastAccess = direntry->lastWriteDate;
+}
+
+
+/* Append len characters of data to the file whose directory entry is
+ * pointed to by direntry, allocating clusters as the file grows, and
+ * update the entry's size.  The caller writes the entry back.
+ *
+ * Returns the number of characters appended, which is less than len if
+ * the volume fills up.
+ */
+static unsigned int appendbytes(direntry_t *direntry, const char *data,
+                                unsigned int len)
+{
+   block_t block;
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int offset;
+   unsigned int count;
+   unsigned int done = 0;
+   unsigned int next;
+   unsigned int i;
+   chainpos_t pos;
+
+   /* Give an empty file its first cluster. */
+   if (direntry->firstSector == 0)
+   {
+      if ((next = allocCluster(0)) == 0)
+         return 0;
+      direntry->firstSector = next;
+   }
+
+   /* Find the cluster holding the end of the file.  A file whose size
+    * is a multiple of the cluster size ends on a cluster boundary, so
+    * its data continues in a cluster that may still need allocating.
+    */
+   chainStart(&pos, direntry->firstSector, 0);
+   for (i = direntry->fileSize / clusterBytes; i > 0; i--)
+   {
+      next = getfatentry(g_fat, pos.cluster);
+      if (lastBlk(next) && (next = allocCluster(pos.cluster)) == 0)
+         break;
+      pos.cluster = next;
+   }
+
+   offset = direntry->fileSize % clusterBytes;
+   pos.offset = offset / BLOCKSIZE;
+   offset %= BLOCKSIZE;
+
+   /* Copy the data a block at a time.  Only the first block can
+    * contain existing data that must be preserved.
+    */
+   while (i == 0 && done < len)
+   {
+      count = BLOCKSIZE - offset;
+      if (count > len - done)
+         count = len - done;
+
+      if (offset != 0 || count < BLOCKSIZE)
+         bc_read(block, chainBlk(&pos));
+      memcpy(block + offset, data + done, count);
+      bc_write(block, chainBlk(&pos));
+
+      done += count;
+      offset = 0;
+
+      if (done < len && pos.offset + 1 == g_geom.blocksPerCluster
+          && lastBlk(getfatentry(g_fat, pos.cluster))
+          && allocCluster(pos.cluster) == 0)
+         break;
+      chainNext(&pos);
+   }
+
+   direntry->fileSize += done;
+   return done;
+}
+
+
+/* Read up to len bytes from the file descriptor fd into buf, retrying
+ * short reads until len bytes have been read or the end of the file is
+ * reached.
+ *
+ * Returns the number of bytes read, or -1 if nothing could be read
+ * because of an error.
+ */
+static ssize_t readfull(int fd, uint8_t *buf, unsigned int len)
+{
+   ssize_t n;
+   unsigned int total = 0;
+
+   while (total < len && (n = read(fd, buf + total, len - total)) != 0)
+   {
+      if (n == -1)
+         return total > 0 ? (ssize_t) total : -1;
+      total += n;
+   }
+
+   return total;
+}
+
+
+/* Write the len bytes in buf to the file descriptor fd.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int writefull(int fd, const uint8_t *buf, unsigned int len)
+{
+   ssize_t n;
+   unsigned int total = 0;
+
+   while (total < len)
+   {
+      if ((n = write(fd, buf + total, len - total)) == -1 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      total += n;
+   }
+
+   return 0;
+}
+
+
+/* Get the current time and convert to current time in the local
+ * time zone.
+ *
+ * Returns a struct tm pointer which can be used as the entryTime parameter
+ * for putdirentry().  This pointer points to a statically allocated struct
+ * which could be overwritten by subsequent calls to any of the time and
+ * date functions.  Hence, this function is not thread-safe.
+ */
+static struct tm *getTime(void)
+{
+   time_t now;
+   time(&now);
+   return localtime(&now);
+}
+
+
+/* Search the root directory for an entry with the short name packed,
+ * in the 11 character form produced by packname().  If the root has an
+ * entry map, the name is looked up there instead.
+ *
+ * Ignore directory entries containing long file names.
+ *
+ * On success, returns a pointer to the directory entry.  Otherwise, return
+ * NULL.
+ */
+static direntry_t *searchRoot(const uint8_t *packed)
+{
+   unsigned int b;
+   unsigned int hits;
+   int pos;
+   dirmasks_t masks;
+   dirmap_t *map;
+   uint8_t *block;
+
+   if ((map = dirmapfind(0)) != NULL)
+      return (pos = dirmaplookup(map, packed)) == -1
+         || (block = rootblock(pos / DIR_ENTRIES)) == NULL ? NULL
+         : (direntry_t *) block + pos % DIR_ENTRIES;
+
+   for (b = 0; b < g_geom.rootBlocks; b++)
+   {
+      if ((block = rootblock(b)) == NULL)
+         return NULL;
+
+      if ((hits = scanblock(block, packed, &masks) & masks.match) != 0)
+         return (direntry_t *) block + __builtin_ctz(hits);
+
+      if (masks.end)
+         break;
+   }
+
+   return NULL;
+}
+
+
+/* Search a sub-directory for an entry with the short name packed, in
+ * the 11 character form produced by packname().  dir is the first
+ * cluster of the directory to be searched.  Block should point to a
+ * variable of type block_t.  blkindex should point to a variable of
+ * type unsigned int.  If the directory has an entry map, the name is
+ * looked up there instead.
+ *
+ * Ignore directory entries containing long file names.
+ *
+ * On success, returns a pointer to the directory entry.  The block
+ * pointed to by block will be written with the disk block containing the 
+ * directory entry and the unsigned int pointed to by blkindex will
+ * contain the physical block number of this block.  The directory
+ * entry pointer returned by this function will point into this block.
+ * On failure, return NULL.
+ */
+static direntry_t *searchSubdir(unsigned int dir, const uint8_t *packed,
+                                block_t block, unsigned int *blkindex)
+{
+   unsigned int hits;
+   int found;
+   chainpos_t pos;
+   dirmasks_t masks;
+   dirmap_t *map;
+
+   if ((map = dirmapfind(dir)) != NULL)
+   {
+      if ((found = dirmaplookup(map, packed)) == -1)
+         return NULL;
+      *blkindex = map->blks[found / DIR_ENTRIES];
+      bc_read(block, *blkindex);
+      return (direntry_t *) block + found % DIR_ENTRIES;
+   }
+
+   for (chainStart(&pos, dir, RA_BLOCKS); !lastBlk(pos.cluster);
+        chainNext(&pos))
+   {
+      bc_read(block, chainBlk(&pos));
+
+      if ((hits = scanblock(block, packed, &masks) & masks.match) != 0)
+      {
+         *blkindex = chainBlk(&pos);
+         return (direntry_t *) block + __builtin_ctz(hits);
+      }
+
+      if (masks.end)
+         break;
+   }
+
+   return NULL;
+}
+
+
+/* Search the directory whose first cluster is dir, or the root
+ * directory if dir is 0, for an entry with a file name of name: an 8.3
+ * format name, or a long file name, which is matched ignoring case.
+ * Arguments and return value are as for searchSubdir(); for the root,
+ * block and blkindex are not used and the entry returned points into
+ * the cached root directory.
+ *
+ * Short names are searched for directly.  Long names are looked up in
+ * the directory's long file name index, which gives the short name of
+ * the entry to search for.
+ */
+static direntry_t *searchDir(unsigned int dir, const char *name,
+                             block_t block, unsigned int *blkindex)
+{
+   uint8_t packed[11];
+   direntry_t *direntry;
+
+   if (packname(name, packed) == 0
+       && (direntry = dir == 0 ? searchRoot(packed)
+           : searchSubdir(dir, packed, block, blkindex)) != NULL)
+      return direntry;
+
+   if (lfnlookup(dir, name, packed) == -1)
+      return NULL;
+
+   return dir == 0 ? searchRoot(packed)
+      : searchSubdir(dir, packed, block, blkindex);
+}
+
+
+/* Search the current working directory for an entry with a file name of
+ * name.  See searchDir().
+ */
+static direntry_t *searchCwd(const char *name, block_t block,
+                             unsigned int *blkindex)
+{
+   return searchDir(g_cwdHead, name, block, blkindex);
+}
+
+
+/* Record a change to the directory entry pointed to by direntry, in the
+ * directory whose first cluster is dir (0 for the root).  If it points
+ * into the cached root directory, the containing root block is marked
+ * dirty.  Otherwise direntry points into block, which is written back
+ * to physical block blkindex immediately.  Either way, the usage
+ * aggregates of dir and the directories above it become stale.
+ */
+static void writedirentry(unsigned int dir, const direntry_t *direntry,
+                          block_t block, unsigned int blkindex)
+{
+   const uint8_t *ptr = (const uint8_t *) direntry;
+
+   aggdirty(dir);
+
+   if (ptr >= g_root && ptr < g_root + g_geom.rootBlocks * BLOCKSIZE)
+   {
+      /* A block that couldn't be read is never written back. */
+      if (g_rootResident[(ptr - g_root) / BLOCKSIZE])
+         g_rootDirty[(ptr - g_root) / BLOCKSIZE] = 1;
+   }
+   else
+      bc_write(block, blkindex);
+}
+
+
+/* Returns a pointer to the entry at position index of the directory
+ * whose first cluster is dir, or of the root if dir is 0, which must be
+ * within the directory.  As for searchDir(), an entry of a
+ * sub-directory is read into block, and its physical block number is
+ * stored in the variable pointed to by blkindex.  Returns NULL if the
+ * entry is in a block of the root directory that can't be read.
+ */
+static direntry_t *entryat(unsigned int dir, unsigned int index,
+                           block_t block, unsigned int *blkindex)
+{
+   unsigned int lblock = index / DIR_ENTRIES;
+   unsigned int cluster = dir;
+   unsigned int i;
+   dirmap_t *map;
+   uint8_t *entries;
+
+   if (dir == 0)
+      return (entries = rootblock(lblock)) == NULL ? NULL
+         : (direntry_t *) entries + index % DIR_ENTRIES;
+
+   if ((map = dirmapfind(dir)) != NULL && lblock < map->blocks)
+      *blkindex = map->blks[lblock];
+   else
+   {
+      for (i = lblock / g_geom.blocksPerCluster; i > 0; i--)
+         cluster = getfatentry(g_fat, cluster);
+      *blkindex = ltop(cluster) + lblock % g_geom.blocksPerCluster;
+   }
+
+   bc_read(block, *blkindex);
+   return (direntry_t *) block + index % DIR_ENTRIES;
+}
+
+
+/* Returns the position in the directory whose first cluster is dir of
+ * the entry direntry, as returned by searchDir() with block and
+ * blkindex.
+ */
+static unsigned int entryindex(unsigned int dir, const direntry_t *direntry,
+                               block_t block, unsigned int blkindex)
+{
+   unsigned int lblock = 0;
+   unsigned int cluster;
+
+   if (dir == 0)
+      return direntry - (const direntry_t *) g_root;
+
+   for (cluster = dir; !lastBlk(cluster)
+           && (blkindex < ltop(cluster)
+               || blkindex >= ltop(cluster) + g_geom.blocksPerCluster);
+        cluster = getfatentry(g_fat, cluster))
+      lblock += g_geom.blocksPerCluster;
+
+   return (lblock + blkindex - ltop(cluster)) * DIR_ENTRIES
+      + (direntry - (const direntry_t *) block);
+}
+
+
+/* Returns the position of the first long file name entry of the short
+ * entry direntry, at position index of the directory whose first
+ * cluster is dir.  The long name's entries are checked backwards from
+ * the short entry.  Returns index if the entry has no long name.
+ */
+static unsigned int lfnfirst(unsigned int dir, unsigned int index,
+                             const direntry_t *direntry)
+{
+   uint8_t sum = lfnchecksum(direntry->filename);
+   unsigned int seq;
+   unsigned int bi;
+   const uint8_t *ent;
+   block_t block;
+
+   for (seq = 1; seq <= LFN_ENTRIES && seq <= index; seq++)
+   {
+      ent = (const uint8_t *) entryat(dir, index - seq, block, &bi);
+
+      if (ent == NULL || !longFN((const direntry_t *) ent)
+          || (ent[0] & ~LFN_LAST) != seq || ent[13] != sum)
+         break;
+
+      if (ent[0] & LFN_LAST)
+         return index - seq;
+   }
+
+   return index;
+}
+
+
+/* Find count consecutive free entries in the directory whose first
+ * cluster is dir, or in the root if dir is 0, in the directory's entry
+ * map, starting with the first block that has a free entry.  If a
+ * sub-directory has no such run, it is extended with zeroed clusters.
+ *
+ * Returns 0 on success, with the position of the first entry in the
+ * variable pointed to by first.  Otherwise, returns -1.
+ */
+static int allocslots(unsigned int dir, unsigned int count,
+                      unsigned int *first)
+{
+   unsigned int run = 0;
+   unsigned int cluster;
+   unsigned int b;
+   unsigned int i;
+   dirmap_t *map;
+   block_t block;
+
+   if ((map = dirmap(dir)) == NULL)
+      return -1;
+
+   for (b = map->hint; b < map->blocks; b++)
+      for (i = 0; i < DIR_ENTRIES; i++)
+         if (!(map->free[b] & 1u << i))
+            run = 0;
+         else if (++run == count)
+         {
+            *first = b * DIR_ENTRIES + i + 1 - count;
+            return 0;
+         }
+
+   if (dir == 0)
+      return -1;
+
+   /* The run continues into the new clusters. */
+   *first = map->blocks * DIR_ENTRIES - run;
+   memset(block, 0, BLOCKSIZE);
+
+   for (; run < count; run += g_geom.blocksPerCluster * DIR_ENTRIES)
+   {
+      if ((cluster = allocCluster(map->last)) == 0)
+         return -1;
+
+      for (i = 0; i < g_geom.blocksPerCluster; i++)
+         bc_write(block, ltop(cluster) + i);
+
+      if (dirmapgrow(map, cluster) == -1)
+      {
+         dirmapdrop(dir);
+         return -1;
+      }
+   }
+
+   return 0;
+}
+
+
+/* Mark the entries at positions from through to - 1 of the directory
+ * whose first cluster is dir free.  Each block changed is written once.
+ */
+static void eraserange(unsigned int dir, unsigned int from, unsigned int to)
+{
+   unsigned int i;
+   unsigned int bi = 0;
+   direntry_t *direntry = NULL;
+   block_t block;
+
+   for (i = from; i < to; i++)
+   {
+      if (i == from || i % DIR_ENTRIES == 0)
+      {
+         if ((direntry = entryat(dir, i, block, &bi)) == NULL)
+            return;
+      }
+      else
+         direntry++;
+
+      direntry->filename[0] = 0xe5;
+
+      if (i + 1 == to || (i + 1) % DIR_ENTRIES == 0)
+      {
+         writedirentry(dir, direntry, block, bi);
+         dirmapscan(dir, i, direntry);
+      }
+   }
+}
+
+
+/* Mark the entry direntry, as returned by searchDir() for the directory
+ * whose first cluster is dir, free, along with its long file name
+ * entries.
+ */
+static void eraseentry(unsigned int dir, const direntry_t *direntry,
+                       block_t block, unsigned int blkindex)
+{
+   unsigned int index = entryindex(dir, direntry, block, blkindex);
+   unsigned int first = lfnfirst(dir, index, direntry);
+
+   eraserange(dir, first, index + 1);
+   if (first != index)
+      lfndrop(dir);
+}
+
+
+/* Create an entry named file, with attributes attrib, first cluster
+ * cluster and size size, in the directory whose first cluster is dir,
+ * or in the root if dir is 0, for fd_creat(), fd_mkdir() and
+ * fd_copy().  The entry's times are set to the current time.
+ *
+ * Returns 0 on success, or -1 as for placeentry().
+ */
+static int newentry(unsigned int dir, const char *file, unsigned int attrib,
+                    unsigned int cluster, unsigned int size)
+{
+   direntry_t record;
+
+   /* placeentry() fills in the name. */
+   memset(&record, 0, sizeof(direntry_t));
+   putdirentry(&record, "", attrib, getTime(), cluster, size);
+
+   if (placeentry(dir, file, &record) == -1)
+      return -1;
+
+   if (attrib & SUBDIRECTORY)
+      g_dirs++;
+   else
+      g_files++;
+   return 0;
+}
+
+
+/* Create an entry named file in the directory whose first cluster is
+ * dir, or in the root if dir is 0, with everything but the name copied
+ * from record.  A name that is already a valid 8.3 name in upper case
+ * gets just a short entry; any other name, such as "Projects" or
+ * ".profile", is kept in its own case as a long file name.
+ *
+ * Returns -1 if the first character of file is 0xe5, if file is "." or
+ * "..", if the directory already contains an entry with the same name,
+ * or if the entry can't be created.  Otherwise, returns 0.
+ */
+static int placeentry(unsigned int dir, const char *file,
+                      const direntry_t *record)
+{
+   char name[FD_NAME_MAX + 1];
+   block_t block;
+   unsigned int blkindex = 0;
+   unsigned int index;
+   direntry_t *direntry;
+
+   if (upcase(name, file) == NULL || name[0] == '\0'
+       || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+      return -1;
+
+   /* Make sure there's no other file or sub-directory with this name. */
+   if (searchDir(dir, name, block, &blkindex) != NULL)
+      return -1;
+
+   if (!shortname(name) || strcmp(name, file) != 0)
+      return creatlong(dir, file, record);
+
+   if (allocslots(dir, 1, &index) == -1
+       || (direntry = entryat(dir, index, block, &blkindex)) == NULL)
+      return -1;
+
+   *direntry = *record;
+   packname(name, direntry->filename);
+   writedirentry(dir, direntry, block, blkindex);
+   dirmapscan(dir, index, direntry);
+
+   return 0;
+}
+
+
+/* Create the entries for name in the directory whose first cluster is
+ * dir, for placeentry(), when name isn't a valid short name: long file
+ * name entries holding name, in its original case, followed by a copy
+ * of record with a generated short alias.
+ *
+ * Returns 0 on success.  Returns -1 if name isn't a valid long file
+ * name or the entries can't be created.
+ */
+static int creatlong(unsigned int dir, const char *name,
+                     const direntry_t *record)
+{
+   uint16_t chars[LFN_ENTRIES * LFN_CHARS];
+   char alias[NAME_LEN];
+   uint8_t packed[11];
+   uint8_t sum;
+   int len;
+   unsigned int count;
+   unsigned int first;
+   unsigned int i;
+   unsigned int bi = 0;
+   direntry_t *direntry = NULL;
+   lfnindex_t *idx;
+   block_t block;
+
+   if (!longvalid(name) || (len = utf8to16(name, chars)) <= 0
+       || chars[len - 1] == ' ' || chars[len - 1] == '.'
+       || makealias(dir, name, alias) == -1)
+      return -1;
+
+   /* Terminate the name and pad its last entry. */
+   count = (len + LFN_CHARS - 1) / LFN_CHARS;
+   for (i = len; i < count * LFN_CHARS; i++)
+      chars[i] = i == (unsigned int) len ? 0 : 0xffff;
+
+   if (allocslots(dir, count + 1, &first) == -1)
+      return -1;
+
+   packname(alias, packed);
+   sum = lfnchecksum(packed);
+
+   for (i = 0; i <= count; i++)
+   {
+      if (i == 0 || (first + i) % DIR_ENTRIES == 0)
+      {
+         if ((direntry = entryat(dir, first + i, block, &bi)) == NULL)
+            return -1;
+      }
+      else
+         direntry++;
+
+      if (i < count)
+         putlfnentry((uint8_t *) direntry, count - i, i == 0, chars, sum);
+      else
+      {
+         *direntry = *record;
+         memcpy(direntry->filename, packed, 11);
+      }
+
+      if (i == count || (first + i + 1) % DIR_ENTRIES == 0)
+      {
+         writedirentry(dir, direntry, block, bi);
+         dirmapscan(dir, first + i, direntry);
+      }
+   }
+
+   /* Add the name to the directory's long file name index, if it has
+    * one, rather than have the whole index built again.
+    */
+   for (idx = g_lfnIndexes; idx != NULL && idx->dir != dir; idx = idx->next)
+      ;
+   if (idx != NULL && lfnadd(direntry, name, idx) == -1)
+      lfndrop(dir);
+
+   return 0;
+}
+
+
+/* Get the long file name of the entry direntry, as returned by
+ * searchDir() for the directory whose first cluster is dir, by reading
+ * back the long name entries before it.  The name is stored in buf,
+ * which should point to at least FD_NAME_MAX + 1 characters of storage.
+ *
+ * Returns buf, or NULL if the entry has no valid long name.
+ */
+static char *longname(unsigned int dir, const direntry_t *direntry,
+                      block_t block, unsigned int blkindex, char *buf)
+{
+   unsigned int index = entryindex(dir, direntry, block, blkindex);
+   unsigned int first = lfnfirst(dir, index, direntry);
+   unsigned int i;
+   unsigned int bi;
+   const uint8_t *ent;
+   lfnstate_t lfn;
+   block_t lfnblock;
+
+   if (first == index)
+      return NULL;
+
+   lfn.seq = 0;
+   for (i = first; i < index; i++)
+      if ((ent = (const uint8_t *) entryat(dir, i, lfnblock, &bi)) == NULL)
+         return NULL;
+      else
+         lfnfeed(&lfn, ent, i);
+
+   return lfnname(&lfn, direntry, index, buf);
+}
+
+
+/* Write the clusters of the new directory whose chain starts at head:
+ * "." and ".." entries, with parent as the first cluster of the parent
+ * directory, or 0 for the root, and zeros after them.  Each run of
+ * consecutive clusters is written with one write, up to XFER_CHUNK
+ * bytes.
+ *
+ * Returns 0 on success, or -1 if a write fails.
+ */
+static int initdir(unsigned int head, unsigned int parent)
+{
+   unsigned int clusterBlocks = g_geom.blocksPerCluster;
+   unsigned int maxRun = XFER_CHUNK / (clusterBlocks * BLOCKSIZE);
+   unsigned int cluster = head;
+   unsigned int first;
+   unsigned int count;
+   int rv = 0;
+   uint8_t *buf;
+   struct tm *now = getTime();
+
+   if ((buf = calloc(maxRun * clusterBlocks, BLOCKSIZE)) == NULL)
+      return -1;
+
+   putdirentry((direntry_t *) buf, ".", SUBDIRECTORY, now, head, 0);
+   putdirentry((direntry_t *) buf + 1, "..", SUBDIRECTORY, now, parent, 0);
+
+   while (rv == 0 && !lastBlk(cluster))
+   {
+      first = cluster;
+      count = 0;
+      do
+      {
+         count++;
+         cluster = getfatentry(g_fat, cluster);
+      }
+      while (count < maxRun && cluster == first + count);
+
+      rv = bc_writerun(buf, ltop(first), count * clusterBlocks);
+
+      /* Only the first cluster has the dot entries. */
+      memset(buf, 0, 2 * sizeof(direntry_t));
+   }
+
+   free(buf);
+   return rv;
+}
+
+
+/* walkdir() visitor for fd_rmdir().  Returns -1 for any entry but "."
+ * and "..".
+ */
+static int dotsonly(const direntry_t *direntry, const char *longName,
+                    void *arg)
+{
+   (void) longName;
+   (void) arg;
+
+   return direntry->filename[0] == '.' ? 0 : -1;
+}
+
+
+/* Split path into the directory holding its last component, resolved
+ * as by resolveDir(), and the last component, which is copied to name
+ * and is empty if path ends in a separator.  name must have room for
+ * FD_NAME_MAX characters and the null.
+ *
+ * Returns 0 on success, with the directory's first cluster, or 0 for
+ * the root, in the variable pointed to by dir.  Otherwise, returns -1.
+ */
+static int splitpath(const char *path, unsigned int *dir, char *name)
+{
+   char buf[PATH_LEN];
+   const char *last = path + strlen(path);
+
+   while (last > path && last[-1] != '/' && last[-1] != '\\')
+      last--;
+
+   if (strlen(last) > FD_NAME_MAX || last - path >= PATH_LEN)
+      return -1;
+
+   strcpy(name, last);
+   if (last == path)
+   {
+      *dir = g_cwdHead;
+      return 0;
+   }
+
+   memcpy(buf, path, last - path);
+   buf[last - path] = '\0';
+   return resolveDir(buf, dir);
+}
+
+
+/* Transfer count clusters of the chain starting at *cluster: read them
+ * into buf, or write them from buf if write is true.  Each run of
+ * consecutive clusters is transferred with one call.  Writes go through
+ * the block cache.  *cluster is advanced past the clusters transferred.
+ *
+ * Returns 0 on success, or -1 if the chain ends early or a transfer
+ * fails.
+ */
+static int clusterio(unsigned int *cluster, uint8_t *buf, unsigned int count,
+                     int write)
+{
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int first;
+   unsigned int extent;
+   int rv;
+
+   while (count > 0)
+   {
+      if (lastBlk(first = *cluster))
+         return -1;
+
+      for (extent = 1; extent < count
+              && getfatentry(g_fat, first + extent - 1) == first + extent;
+           extent++)
+         ;
+
+      if (write)
+         rv = bc_writerun(buf, ltop(first), extent * g_geom.blocksPerCluster);
+      else
+         rv = bc_readrun(buf, ltop(first), extent * clusterBytes);
+      if (rv == -1)
+         return -1;
+
+      buf += extent * clusterBytes;
+      count -= extent;
+      *cluster = getfatentry(g_fat, first + extent - 1);
+   }
+
+   return 0;
+}
+
+
+/* Convert a cluster number to the physical block number of the
+ * cluster's first block.
+ */
+static unsigned int ltop(unsigned int lblock)
+{
+   return g_geom.dataStart + (lblock - 2) * g_geom.blocksPerCluster;
+}
+
+
+/* Start pos at the first block of the chain beginning with cluster,
+ * reading up to window blocks of the chain ahead into the block cache.
+ * Pass a window of 0 for walks that don't read the chain's blocks.
+ */
+static void chainStart(chainpos_t *pos, unsigned int cluster,
+                       unsigned int window)
+{
+   pos->cluster = cluster;
+   pos->offset = 0;
+   pos->window = window;
+   pos->raCluster = cluster;
+   pos->raBlocks = 0;
+   readahead(pos);
+}
+
+
+/* Return the physical block number of the chain position pos.
+ */
+static unsigned int chainBlk(const chainpos_t *pos)
+{
+   return ltop(pos->cluster) + pos->offset;
+}
+
+
+/* Advance pos to the next block of its cluster chain.  After the last
+ * block of the chain, pos->cluster holds the end-of-chain marker, which
+ * lastBlk() recognizes.
+ */
+static void chainNext(chainpos_t *pos)
+{
+   if (pos->raBlocks > 0)
+      pos->raBlocks--;
+
+   if (++pos->offset == g_geom.blocksPerCluster)
+   {
+      pos->offset = 0;
+      pos->cluster = getfatentry(g_fat, pos->cluster);
+      readahead(pos);
+   }
+}
+
+
+/* Once less than half of pos's read-ahead window remains queued, queue
+ * reads of the following clusters of the chain, taken from the cached
+ * FAT, to fill the window again.  The reads complete in the background
+ * in any order, so a fragmented chain has many reads in flight at once
+ * rather than one at a time.
+ */
+static void readahead(chainpos_t *pos)
+{
+   static unsigned int blks[RA_BLOCKS + MAX_BLOCKS_PER_CLUSTER];
+   unsigned int n = 0;
+   unsigned int i;
+
+   if (pos->raBlocks >= pos->window / 2)
+      return;
+
+   while (pos->raBlocks < pos->window && !lastBlk(pos->raCluster))
+   {
+      for (i = 0; i < g_geom.blocksPerCluster; i++)
+         blks[n++] = ltop(pos->raCluster) + i;
+      pos->raBlocks += g_geom.blocksPerCluster;
+      pos->raCluster = getfatentry(g_fat, pos->raCluster);
+   }
+
+   if (n > 0)
+      bc_prefetch(blks, n);
+}
+
+
+/* Search for a free FAT entry in fat.  The search starts where the
+ * previous one left off, so allocating n clusters costs O(n) FAT
+ * lookups in total rather than O(n^2).
+ *
+ * Returns the index of the first free FAT entry.  If no free entry can be
+ * found, or the FAT can't be read, returns 0.  (FAT entry 0 is
+ * reserved.  Hence, 0 amounts to an invalid FAT index.
+ */
+static unsigned int getFreeFatEntry(const uint16_t *fat)
+{
+   unsigned int i;
+   unsigned int end = g_geom.numClusters + 2;
+
+   if (g_nextFree < 2 || g_nextFree >= end)
+      g_nextFree = 2;
+   if (fatfault(2, end) == -1)
+      return 0;
+
+   if ((i = vec_findfree(fat, g_nextFree, end, 1)) == end
+       && (i = vec_findfree(fat, 2, g_nextFree, 1)) == g_nextFree)
+      return 0;
+
+   g_nextFree = i + 1;
+   return i;
+}
+
+
+/* Allocate a free cluster and mark it as the end of a chain.  If prev
+ * is non-zero, the new cluster is linked after cluster prev.
+ *
+ * Returns the new cluster's number, or 0 if the volume is full or the
+ * FAT can't be read.
+ */
+static unsigned int allocCluster(unsigned int prev)
+{
+   unsigned int free;
+
+   if ((free = getFreeFatEntry(g_fat)) == 0
+       || putfatentry(g_fat, free, g_codec->eoc) == -1)
+      return 0;
+
+   if (prev != 0 && putfatentry(g_fat, prev, free) == -1)
+   {
+      putfatentry(g_fat, free, 0);
+      return 0;
+   }
+
+   return free;
+}
+
+
+/* Mark every cluster in the chain starting at cluster first as free.
+ *
+ * Returns the number of clusters freed.
+ */
+static unsigned int freeChain(unsigned int first)
+{
+   unsigned int next;
+   unsigned int count = 0;
+
+   while (!lastBlk(first))
+   {
+      next = getfatentry(g_fat, first);
+      putfatentry(g_fat, first, 0);
+      first = next;
+      count++;
+   }
+
+   return count;
+}
+
+
+/* Allocate up to count free clusters and link them into a chain after
+ * cluster prev, or into a new chain if prev is zero.  Runs of
+ * consecutive free clusters are preferred: the longest run that is
+ * wanted is searched for first, and the run length is halved whenever
+ * no such run is left.  *head receives the first cluster allocated.
+ *
+ * Returns the number of clusters allocated, which is less than count if
+ * the volume fills up, and 0 if the FAT can't be read.
+ */
+static unsigned int allocClusters(unsigned int prev, unsigned int count,
+                                  unsigned int *head)
+{
+   unsigned int end = g_geom.numClusters + 2;
+   unsigned int start = 2;
+   unsigned int run = count;
+   unsigned int got = 0;
+   unsigned int first;
+   unsigned int i;
+
+   if (fatfault(2, end) == -1)
+      return 0;
+
+   while (got < count && run > 0)
+   {
+      if (run > count - got)
+         run = count - got;
+
+      if ((first = vec_findfree(g_fat, start, end, run)) == end)
+      {
+         run /= 2;
+         start = 2;
+         continue;
+      }
+
+      if (got == 0)
+         *head = first;
+      for (i = first; i < first + run; i++)
+      {
+         putfatentry(g_fat, i, g_codec->eoc);
+         if (prev != 0)
+            putfatentry(g_fat, prev, i);
+         prev = i;
+      }
+
+      got += run;
+      start = first + run;
+   }
+
+   return got;
+}
+
+
+/* Cut the chain of the file whose directory entry is pointed to by
+ * direntry to its first keep clusters, freeing the rest, in one pass
+ * along the chain.  A file cut to no clusters is left with a first
+ * cluster of 0.
+ *
+ * Returns the number of clusters freed.
+ */
+static unsigned int cutChain(direntry_t *direntry, unsigned int keep)
+{
+   unsigned int cluster = direntry->firstSector;
+   unsigned int next;
+
+   if (keep == 0 || lastBlk(cluster))
+   {
+      direntry->firstSector = 0;
+      return freeChain(cluster);
+   }
+
+   while (--keep > 0 && !lastBlk(next = getfatentry(g_fat, cluster)))
+      cluster = next;
+
+   if (lastBlk(next = getfatentry(g_fat, cluster)))
+      return 0;
+
+   putfatentry(g_fat, cluster, g_codec->eoc);
+   return freeChain(next);
+}
+
+
+/* Count the clusters of the chain of the file whose directory entry is
+ * pointed to by direntry that lie beyond its data: clusters reserved by
+ * fd_fallocate().  The variable pointed to by last receives the last
+ * cluster holding data, or 0 if there is none.
+ *
+ * Returns the number of reserved clusters.
+ */
+static unsigned int spareClusters(const direntry_t *direntry,
+                                  unsigned int *last)
+{
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int cluster = direntry->firstSector;
+   unsigned int i = direntry->fileSize / clusterBytes
+      + (direntry->fileSize % clusterBytes != 0);
+   unsigned int count = 0;
+
+   for (*last = 0; i > 0 && !lastBlk(cluster); i--)
+   {
+      *last = cluster;
+      cluster = getfatentry(g_fat, cluster);
+   }
+
+   for (; !lastBlk(cluster); cluster = getfatentry(g_fat, cluster))
+      count++;
+
+   return count;
+}
+
+
+/* Record that the file whose chain starts at cluster has clusters
+ * reserved, for releasespare().
+ *
+ * Returns 0 on success, or -1 if memory runs out.
+ */
+static int addspare(unsigned int cluster)
+{
+   unsigned int *spare;
+   unsigned int i;
+
+   for (i = 0; i < g_spareUsed; i++)
+      if (g_spare[i] == cluster)
+         return 0;
+
+   if (g_spareUsed == g_spareAlloc)
+   {
+      g_spareAlloc = g_spareAlloc == 0 ? 16 : 2 * g_spareAlloc;
+      if ((spare = realloc(g_spare, g_spareAlloc * sizeof(unsigned int)))
+          == NULL)
+         return -1;
+      g_spare = spare;
+   }
+
+   g_spare[g_spareUsed++] = cluster;
+   return 0;
+}
+
+
+/* Free the clusters reserved with fd_fallocate() that their files haven't
+ * grown into, by cutting the chain of each file recorded by addspare()
+ * to the clusters its size needs.  The files are found by walking the
+ * tree, as they may have been renamed or moved since.  A recorded
+ * cluster that now starts another file is harmless: that file's chain
+ * is already as long as it needs.
+ */
+static void releasespare(void)
+{
+   if (g_spareUsed == 0)
+      return;
+
+   walktree(0, FD_DIR_HIDDEN, releasevisit, NULL, NULL);
+
+   free(g_spare);
+   g_spare = NULL;
+   g_spareUsed = g_spareAlloc = 0;
+}
+
+
+/* walktree() visitor for releasespare().  Cuts the chain of each file
+ * recorded by addspare() to the file's size.
+ */
+static int releasevisit(const char *path, const struct fd_dirent *entry,
+                        unsigned int depth, void *arg)
+{
+   char full[WALK_PATH_LEN + 1];
+   char name[FD_NAME_MAX + 1];
+   char upper[FD_NAME_MAX + 1];
+   unsigned int clusterBytes = g_geom.blocksPerCluster * BLOCKSIZE;
+   unsigned int dir;
+   unsigned int bi;
+   unsigned int i;
+   direntry_t *direntry;
+   block_t block;
+
+   (void) depth;
+   (void) arg;
+
+   if (entry->attributes & SUBDIRECTORY)
+      return FD_WALK_CONTINUE;
+
+   for (i = 0; i < g_spareUsed && g_spare[i] != entry->cluster; i++)
+      ;
+   if (i == g_spareUsed)
+      return FD_WALK_CONTINUE;
+
+   full[0] = '/';
+   strcpy(full + 1, path);
+
+   if (splitpath(full, &dir, name) == 0 && upcase(upper, name) != NULL
+       && (direntry = searchDir(dir, upper, block, &bi)) != NULL
+       && cutChain(direntry, direntry->fileSize / clusterBytes
+                   + (direntry->fileSize % clusterBytes != 0)) > 0)
+      writedirentry(dir, direntry, block, bi);
+
+   return FD_WALK_CONTINUE;
+}
+
+
+/* Return the FAT entry at the given index within fat.
+ */
+static unsigned int getfatentry(const uint16_t *fat, unsigned int index)
+{
+   if (!g_fatResident[index / g_codec->regionEntries])
+      fatfault(index, index + 1);
+
+   return fat[index];
+}
+
+
+/* Write val to the FAT entry at the given index within fat and mark the
+ * FAT region holding the entry dirty.  A region that can't be read isn't
+ * changed.
+ *
+ * Returns 0 on success, or -1 if the entry's region can't be read.
+ */
+static int putfatentry(uint16_t *fat, unsigned int index, unsigned int val)
+{
+   unsigned int r = index / g_codec->regionEntries;
+   unsigned int old;
+
+   if (!g_fatResident[r] && fatfault(index, index + 1) == -1)
+      return -1;
+
+   old = fat[index];
+   fat[index] = (uint16_t) val;
+   g_fatDirty[r] = 1;
+
+   if (!g_freeValid)
+      return 0;
+
+   if (old == g_codec->bad)
+      g_badClusters--;
+   if (val == g_codec->bad)
+      g_badClusters++;
+
+   if ((old == 0) != (val == 0))
+   {
+      if (val == 0)
+         g_freeClusters++;
+      else
+         g_freeClusters--;
+      freeupdate(index);
+   }
+
+   return 0;
+}
+
+
+/* Count the free and bad clusters in the cached FAT and build the free
+ * space tree from scratch, reading the rest of the FAT first.  From then
+ * on putfatentry() keeps them up to date, until the FAT is dropped.
+ */
+static void freebuild(void)
+{
+   unsigned int end = g_geom.numClusters + 2;
+   unsigned int span = FREE_GROUP;
+   unsigned int i;
+   unsigned int n;
+
+   fatfault(2, end);
+   g_freeValid = 1;
+
+   g_freeClusters = g_badClusters = 0;
+   for (i = 2; i < end; i++)
+      if (g_fat[i] == 0)
+         g_freeClusters++;
+      else if (g_fat[i] == g_codec->bad)
+         g_badClusters++;
+
+   for (i = 0; i < g_freeLeaves; i++)
+      freeleaf(i, &g_freeTree[g_freeLeaves + i]);
+
+   for (n = g_freeLeaves / 2; n > 0; n /= 2, span *= 2)
+      for (i = n; i < 2 * n; i++)
+         freemerge(&g_freeTree[i], &g_freeTree[2 * i],
+                   &g_freeTree[2 * i + 1], span);
+}
+
+
+/* Update the free space tree after FAT entry index changed between free
+ * and in use: the summary of the leaf covering it is computed again from
+ * the FAT, then those of the nodes above it from their children's.  Each
+ * node's summary covers the clusters below it, and the root's longest
+ * run is the longest free extent of the volume, so keeping it costs
+ * FREE_GROUP entries and a walk up the tree per change.
+ */
+static void freeupdate(unsigned int index)
+{
+   unsigned int n;
+   unsigned int span = FREE_GROUP;
+
+   if (index < 2 || index >= g_geom.numClusters + 2)
+      return;
+
+   n = g_freeLeaves + (index - 2) / FREE_GROUP;
+   freeleaf(n - g_freeLeaves, &g_freeTree[n]);
+
+   for (n /= 2; n > 0; n /= 2, span *= 2)
+      freemerge(&g_freeTree[n], &g_freeTree[2 * n], &g_freeTree[2 * n + 1],
+                span);
+}
+
+
+/* Summarize the free clusters covered by leaf leaf of the free space
+ * tree into run.  Clusters past the end of the volume count as in use.
+ */
+static void freeleaf(unsigned int leaf, freerun_t *run)
+{
+   unsigned int first = 2 + leaf * FREE_GROUP;
+   unsigned int end = g_geom.numClusters + 2;
+   unsigned int length = 0;
+   unsigned int i;
+
+   run->head = run->tail = run->longest = 0;
+
+   for (i = first; i < first + FREE_GROUP; i++)
+   {
+      if (i < end && g_fat[i] == 0)
+      {
+         if (++length > run->longest)
+            run->longest = length;
+      }
+      else
+      {
+         if (length == i - first)
+            run->head = length;
+         length = 0;
+      }
+   }
+
+   if (length == FREE_GROUP)
+      run->head = FREE_GROUP;
+   run->tail = length;
+}
+
+
+/* Combine the summaries of two adjacent ranges of span clusters each,
+ * left and right, into that of the whole range, in run.
+ */
+static void freemerge(freerun_t *run, const freerun_t *left,
+                      const freerun_t *right, unsigned int span)
+{
+   run->head = left->head == span ? span + right->head : left->head;
+   run->tail = right->tail == span ? span + left->tail : right->tail;
+   run->longest = left->tail + right->head;
+   if (left->longest > run->longest)
+      run->longest = left->longest;
+   if (right->longest > run->longest)
+      run->longest = right->longest;
+}
+
+
+/* FAT16 codec: unpack n little-endian 16-bit FAT entries.
  */
-static int fd_dir_root(int showAll)
+static void unpack16(uint16_t *dst, const uint8_t *src, unsigned int n)
 {
- int i;
-   direntry_t *direntry = (direntry_t *) g_root;
-   char name2[16];
-   int count;
-   int fsize;
+   unsigned int i;
 
-   for (i = 0; i < ROOT_BLOCKS * DIR_ENTRIES; i++, direntry++)
-     if (!longFN(direntry)  && (!hidden(direntry) || showAll) && !direntryFree(direntry)){
-      list(direntry);
-      fsize += direntry ->fileSize;
-      count++;
-    }
-   printf("# of Entries: %d\n# Bytes: %d\n", count, fsize);
-   return count;
+   for (i = 0; i < n; i++, src += 2)
+      dst[i] = src[0] | (src[1] << 8);
 }
 
 
-/* List the entries in a sub-directory.  Called by fd_dir().
- *
- * Returns the number of entries listed.
+/* FAT16 codec: pack n 16-bit FAT entries, little-endian.
  */
-static int fd_dir_subdir(int showAll)
+static void pack16(uint8_t *dst, const uint16_t *src, unsigned int n)
 {
-     int i;
-     int count = 0;
-     int size = 0;
-   unsigned int blk = g_cwdHead;
-   direntry_t *direntry;
-   block_t block;
-
+   unsigned int i;
 
-   while (!lastBlk(blk))
+   for (i = 0; i < n; i++, dst += 2)
    {
-      readblock(g_dev, block, ltop(blk));
-      direntry = (direntry_t *) block;
-
-      for (i = 0; i < DIR_ENTRIES; i++, direntry++)
-	{
-	if ((showAll || !hidden(direntry  )) && !longFN(direntry  ) && !direntryFree(direntry  ))
-         {
-	   list(direntry  );
-	   size += direntry ->fileSize;
-	   count++;
-         }
-	}
-      blk = getfatentry(g_fat, blk);
+      dst[0] = (uint8_t) (src[i] & 0xff);
+      dst[1] = (uint8_t) (src[i] >> 8);
    }
-   printf("# Entries: %d\n# Bytes: %d\n", count, size);
-   return count;
 }
 
 
-/* Returns 1 if the directory entry pointed to by direntry is free.
-/ * Otherwise, returns 0.
+/* Return 1 if the block number value blknum corresponds to the last block
+ * of a file.  Otherwise, return 0.
+ *
+ * Besides the width's end-of-chain markers, anything that isn't a valid
+ * data cluster (free, reserved, or bad) also ends a chain, so that a
+ * damaged FAT can't send a chain walk off the end of the volume.
  */
-static int direntryFree(const direntry_t *direntry)
+static int lastBlk(unsigned int blknum)
 {
-   if (direntry->filename[0] == (unsigned char) 0xe5
-       || direntry->filename[0] == 0x00)
+   if (blknum < 2 || blknum > g_geom.numClusters + 1
+       || blknum >= g_codec->eocMin)
       return 1;
    else
       return 0;
 }
 
 
-/* Returns 1 if the directory entry pointed to by direntry is hidden.
- * Otherwise, returns 0.
+/* Returns 1 if the current working directory is the root directory.
+ * Otherwise, returns 1.
  */
-static int hidden(const direntry_t *direntry)
+static int cwdIsRoot(void)
 {
-
-   return direntry->attributes & HIDDEN;
+   return g_cwdHead == 0;
 }
 
 
-/* Returns 1 if the directory entry pointed to by direntry is a
- * sub-directory.  Otherwise, returns 0.
+/* Compute a volume's geometry from its boot block.  The FAT width is
+ * determined by the number of data clusters.
+ *
+ * Returns 0 on success.  Returns -1 if the boot block doesn't describe a
+ * supported FAT12 or FAT16 volume.
  */
-static int subdirectory(const direntry_t *direntry)
+static int readgeom(const bootblock_t *boot, fsgeom_t *geom)
 {
-   return direntry->attributes & SUBDIRECTORY;
+   unsigned int spc = boot->sectorsPerCluster;
+   unsigned int maxClusters;
+
+   if (boot->bytesPerSector != BLOCKSIZE || spc == 0
+       || spc > MAX_BLOCKS_PER_CLUSTER || (spc & (spc - 1)) != 0
+       || boot->numFATs == 0 || boot->sectorsPerFAT == 0
+       || boot->numReservedSectors == 0
+       || boot->maxNumRootDirEntries == 0
+       || boot->maxNumRootDirEntries % DIR_ENTRIES != 0)
+      return -1;
+
+   geom->blocksPerCluster = spc;
+   geom->numFATs = boot->numFATs;
+   geom->fatStart = boot->numReservedSectors;
+   geom->fatBlocks = boot->sectorsPerFAT;
+   geom->rootStart = geom->fatStart + geom->numFATs * geom->fatBlocks;
+   geom->rootEntries = boot->maxNumRootDirEntries;
+   geom->rootBlocks = geom->rootEntries / DIR_ENTRIES;
+   geom->dataStart = geom->rootStart + geom->rootBlocks;
+   geom->totalBlocks = boot->totalSectors != 0
+      ? boot->totalSectors : boot->totalSectorCountFAT32;
+   geom->trackBlocks = boot->sectorsPerTrack;
+   geom->volumeId = boot->volumeId;
+
+   if (geom->totalBlocks <= geom->dataStart)
+      return -1;
+
+   geom->numClusters = (geom->totalBlocks - geom->dataStart) / spc;
+
+   if (geom->numClusters <= FAT12_MAX_CLUSTERS)
+      geom->fatBits = FAT12;
+   else if (geom->numClusters <= FAT16_MAX_CLUSTERS)
+      geom->fatBits = FAT16;
+   else
+      return -1;
+
+   /* Don't trust a FAT that is too small for the cluster count. */
+   maxClusters = geom->fatBlocks * BLOCKSIZE * 8 / geom->fatBits - 2;
+   if (geom->numClusters > maxClusters)
+      geom->numClusters = maxClusters;
+
+   return 0;
 }
 
 
-/* Returns 1 if the directory entry pointed to by direntry contains
- * a long filename.  Otherwise, returns 0.
+/* Pack the dirty regions of the cached FAT and write them to every FAT
+ * copy, one copy after another.  Inside a batch the writes are sorted
+ * and merged when the batch is flushed.
+ *
+ * Returns 0 on success, -1 if memory for the packed FAT can't be had.
  */
-static int longFN(const direntry_t *direntry)
+static int flushfat(void)
 {
-   return (direntry->attributes & 0XF) == 0XF;
+   unsigned int r;
+   unsigned int i;
+   unsigned int copy;
+   unsigned int blk;
+   uint8_t *packed;
+   block_t *blocks;
+
+   if ((packed = malloc(g_fatRegions * g_codec->regionBlocks * BLOCKSIZE))
+       == NULL)
+      return -1;
+
+   for (r = 0; r < g_fatRegions; r++)
+      if (g_fatDirty[r])
+         g_codec->pack(packed + r * g_codec->regionBlocks * BLOCKSIZE,
+                       g_fat + r * g_codec->regionEntries,
+                       g_codec->regionEntries);
+
+   blocks = (block_t *) packed;
+   for (copy = 0; copy < g_geom.numFATs; copy++)
+      for (r = 0; r < g_fatRegions; r++)
+         for (i = 0; g_fatDirty[r] && i < g_codec->regionBlocks; i++)
+            if ((blk = r * g_codec->regionBlocks + i) < g_geom.fatBlocks)
+               bc_write(blocks[blk],
+                        g_geom.fatStart + copy * g_geom.fatBlocks + blk);
+
+   memset(g_fatDirty, 0, g_fatRegions);
+   free(packed);
+   return 0;
 }
 
 
-/* List the directory entry pointed to by direntry.
+/* Write the dirty blocks of the cached root directory.
  */
-static void list(const direntry_t *direntry)
+static void flushroot(void)
 {
-   char filename[16];
+   unsigned int i;
+   /* The following blocks variable is used to treat the root cache as an
+    * array of blocks.
+    */
+   block_t *blocks = (block_t *) g_root;
 
-   printf("%12s  %8d   %8d   %8x %4d-%02d-%02d  %2d:%02d:%02d\n",
-          getfilename(direntry, filename),
-          direntry->firstSector,
-          direntry->fileSize,
-          direntry->attributes,
-          /* Years field, bits 9--15, is years since 1980. */
-          ((direntry->lastWriteDate >> 9) & 0X7F) + 1980,
-          /* Months field is bits 5--8. */
-          (direntry->lastWriteDate >> 5) & 0XF,
-          /* Day of month field is bits 0--4. */
-          direntry->lastWriteDate & 0X1F,
-          /* Hours field, in 24 hour format,  is bits 11--15. */
-          (direntry->lastWriteTime >> 11) & 0X1F,
-          /* Minutes field is bits 5--10. */
-          (direntry->lastWriteTime >> 5) & 0X3F,
-          /* Seconds field is bits 0--4.  Granularity is 2 seconds
-           * because we're one bit short of the number of bits needed to
-           * represent a number in the range [0--59].
-           */
-          (direntry->lastWriteTime & 0X1F) << 1);
+   for (i = 0; i < g_geom.rootBlocks; i++)
+      if (g_rootDirty[i])
+         bc_write(blocks[i], i + g_geom.rootStart);
+
+   memset(g_rootDirty, 0, g_geom.rootBlocks);
 }
 
 
-/* Get the filename from the directory entry pointed to by direntry.
- * The filename will be stored in fn, which should point to sufficient
- * storage to store the filename in 8.3 format as a null-terminated string.
+/* Mount the volume on the block device dev, for fd_mountdev() and, if
+ * lazy is true, fd_mountlazy().
  *
- * Returns fn.
+ * Returns the device number on success.  Otherwise, it returns -1 and
+ * dev is left open.
  */
-static char *getfilename(const direntry_t *direntry, char *fn)
+static int mountdev(const blockdev_t *dev, int lazy)
 {
-   int i;
-   char *ptr = fn;
+   block_t boot;
 
-   i = 0;
-
-   while ((*ptr = direntry->filename[i]) != ' ' && i++ < 8)
-      ptr++;
+   if (g_dev != -1 || bd_read(dev, boot, 0, 1) == -1
+       || readgeom((const bootblock_t *) boot, &g_geom) == -1)
+      return -1;
 
-   if (direntry->extension[0] == ' ')
+   g_codec = g_geom.fatBits == FAT16 ? &fat16codec : &fat12codec;
+   g_fatRegions = (g_geom.fatBlocks + g_codec->regionBlocks - 1)
+      / g_codec->regionBlocks;
+   g_fat = malloc(g_fatRegions * g_codec->regionEntries * sizeof(uint16_t));
+   g_fatDirty = calloc(g_fatRegions, 1);
+   g_fatResident = calloc(g_fatRegions, 1);
+   g_root = malloc(g_geom.rootBlocks * BLOCKSIZE);
+   g_rootDirty = calloc(g_geom.rootBlocks, 1);
+   g_rootResident = calloc(g_geom.rootBlocks, 1);
+   for (g_freeLeaves = 1; g_freeLeaves * FREE_GROUP < g_geom.numClusters;
+        g_freeLeaves *= 2)
+      ;
+   g_freeTree = malloc(2 * g_freeLeaves * sizeof(freerun_t));
+
+   if (g_fat == NULL || g_fatDirty == NULL || g_fatResident == NULL
+       || g_root == NULL || g_rootDirty == NULL || g_rootResident == NULL
+       || g_freeTree == NULL || bc_init(dev, CACHE_BLOCKS) == -1)
    {
-      *ptr = '\0';
-      return fn;
+      freecaches();
+      return -1;
    }
 
-   *ptr++ = '.';
-   i = 0;
-
-   while ((*ptr = direntry->extension[i]) != ' ' && i++ < 3)
-      ptr++;
-
-   *ptr = '\0';
+   bc_geometry(g_geom.trackBlocks);
+   dropmeta();
+   if (!lazy && loadmeta() == -1)
+   {
+      bc_exit();
+      freecaches();
+      return -1;
+   }
 
-   return fn;
+   g_bdev = *dev;
+   g_dev = dev->fd != -1 ? dev->fd : 0;
+   g_nextFree = 2;
+   g_cwdHead = 0;
+   return g_dev;
 }
 
 
-/* Set the directory entry pointed to by direntry to the name fn, with
- * attributes attrib.  entryTime will be used to set the creation, access,
- * and write dates/times.  The entry's starting block will be set to
- * strtBlk and the entry's size will be set to size.
+/* Read the whole of the first FAT, unpacked, and the root directory into
+ * their caches, with one read each.
  *
- * fn should be in 8.3 format.  Characters will be converted to upper case.
+ * Returns 0 on success, -1 on a read error.
  */
-static void putdirentry(direntry_t *direntry, const char *fn,
-                        unsigned int attrib, struct tm *entryTime,
-                        unsigned int strtBlk, unsigned int size)
+static int loadmeta(void)
 {
-   int i;
-   int j;
-   unsigned int packedTime;
-   unsigned int packedDate;
-
-   /* Initialize and then set the filename and extension fields. */
+   fatfault(0, g_fatRegions * g_codec->regionEntries);
+   if (g_fatMissing > 0 || rootfault(0, g_geom.rootBlocks) == -1)
+      return -1;
 
-   for (i = 0; i < 8; i++)
-      direntry->filename[i] = ' ';
+   return 0;
+}
 
-   for (i = 0; i < 3; i++)
-      direntry->extension[i] = ' ';
 
-   i = 0;
+/* Drop the cached FAT and root directory, which become clean and are
+ * read again as they are used, and the counts that depend on them.
+ */
+static void dropmeta(void)
+{
+   memset(g_fatDirty, 0, g_fatRegions);
+   memset(g_fatResident, 0, g_fatRegions);
+   g_fatMissing = g_fatRegions;
+   memset(g_rootDirty, 0, g_geom.rootBlocks);
+   memset(g_rootResident, 0, g_geom.rootBlocks);
+   g_freeValid = 0;
+   g_countsValid = 0;
+}
 
-   while (i < 8 && fn[i] != '.' && fn[i] != '\0')
-   {
-      direntry->filename[i] = toupper(fn[i]);
-      i++;
-   }
 
-   /* Search for the extension. */
+/* Read the FAT regions holding entries first up to end that aren't in
+ * the cache yet, each run of consecutive ones with one read, and unpack
+ * them.  If a run can't be read, its entries are set to the end of chain
+ * marker, so that nothing is allocated from them, and they are tried
+ * again the next time they are used.
+ *
+ * Returns 0 on success, or -1 if any of the regions couldn't be read.
+ */
+static int fatfault(unsigned int first, unsigned int end)
+{
+   unsigned int per = g_codec->regionEntries;
+   unsigned int r = first / per;
+   unsigned int last = (end + per - 1) / per;
+   unsigned int run;
+   unsigned int blocks;
+   unsigned int i;
+   int rv = 0;
+   uint8_t *packed;
 
-   while (fn[i] != '.' && fn[i] != '\0')
-      i++;
+   if (g_fatMissing == 0)
+      return 0;
+   if (last > g_fatRegions)
+      last = g_fatRegions;
 
-   if (fn[i] == '.')   // Found it.
+   while (r < last)
    {
-      i++;
-      j = 0;
-
-      while (j < 3 && fn[i] != '\0')
+      if (g_fatResident[r])
       {
-         direntry->extension[j] = toupper(fn[i]);
-         i++;
-         j++;
+         r++;
+         continue;
       }
-   }
 
-   direntry->attributes = 0xff & attrib;
+      for (run = 1; r + run < last && !g_fatResident[r + run]; run++)
+         ;
 
-   packedTime = ((0x1f & entryTime->tm_hour) << 11) |
-      ((0x3f & entryTime->tm_min) << 5) |
-      (0x1f & (entryTime->tm_sec >> 1));
-   direntry->creationTime = packedTime;
-   direntry->lastWriteTime = packedTime;
+      /* The last region may run past the end of the FAT. */
+      blocks = run * g_codec->regionBlocks;
+      if (blocks > g_geom.fatBlocks - r * g_codec->regionBlocks)
+         blocks = g_geom.fatBlocks - r * g_codec->regionBlocks;
 
-   packedDate = ((0x7f & (entryTime->tm_year - 80)) << 9) |
-      ((0xf & (entryTime->tm_mon + 1)) << 5) |
-      (0x1f & entryTime->tm_mday);
-   direntry->creationDate = packedDate;
-   direntry->lastAccess = packedDate;
-   direntry->lastWriteDate = packedDate;
+      packed = calloc(run * g_codec->regionBlocks, BLOCKSIZE);
+      if (packed == NULL
+          || bc_readrun(packed, g_geom.fatStart + r * g_codec->regionBlocks,
+                        blocks * BLOCKSIZE) == -1)
+      {
+         for (i = r * per; i < (r + run) * per; i++)
+            g_fat[i] = (uint16_t) g_codec->eoc;
+         rv = -1;
+      }
+      else
+      {
+         g_codec->unpack(g_fat + r * per, packed, run * per);
+         memset(g_fatResident + r, 1, run);
+         g_fatMissing -= run;
+      }
 
-   direntry->firstSector = 0xffff & strtBlk;
-   direntry->fileSize = 0xffffffff & size;
+      free(packed);
+      r += run;
+   }
+
+   return rv;
 }
 
 
-/* Get the current time and convert to current time in the local
- * time zone.
+/* Read the root directory blocks first up to end that aren't in the
+ * cache yet, each run of consecutive ones with one read.
  *
- * Returns a struct tm pointer which can be used as the entryTime parameter
- * for putdirentry().  This pointer points to a statically allocated struct
- * which could be overwritten by subsequent calls to any of the time and
- * date functions.  Hence, this function is not thread-safe.
+ * Returns 0 on success, -1 on a read error.
  */
-static struct tm *getTime(void)
+static int rootfault(unsigned int first, unsigned int end)
 {
-   time_t now;
-   time(&now);
-   return localtime(&now);
-}
+   unsigned int run;
 
+   while (first < end)
+   {
+      if (g_rootResident[first])
+      {
+         first++;
+         continue;
+      }
 
-/* Search the root directory for an entry with a file name of name.
- * name should point to a null-terminated string holding an 8.3 format
- * file name.
- *
- * Ignore directory entries containing long file names.
- *
- * On success, returns a pointer to the directory entry.  Otherwise, return
- * NULL.
- */
-static direntry_t *searchRoot(const char *name)
-{
-   int i;
-   direntry_t *direntry = (direntry_t *) g_root;
-   char name2[16];
+      for (run = 1; first + run < end && !g_rootResident[first + run]; run++)
+         ;
 
-   for (i = 0; i < ROOT_BLOCKS * DIR_ENTRIES; i++, direntry++)
-      if (!longFN(direntry)
-          && strcmp(name, getfilename(direntry, name2)) == 0)
-         return direntry;
+      if (bc_readrun(g_root + first * BLOCKSIZE, g_geom.rootStart + first,
+                     run * BLOCKSIZE) == -1)
+         return -1;
 
-   return NULL;
+      memset(g_rootResident + first, 1, run);
+      first += run;
+   }
+
+   return 0;
 }
 
 
-/* Search a sub-directory for an entry with a file name of name.
- * name should point to a null-terminated string holding an 8.3 format
- * file name.  The current working directory is the directory that will
- * be searched.  Block should point to a variable of type block_t.
- * blkindex should point to a variable of type  unsigned int.
- *
- * Ignore directory entries containing long file names.
- *
- * On success, returns a pointer to the directory entry.  The block
- * pointed to by block will be written with the disk block containing the 
- * directory entry and the unsigned int pointed to by blkindex will
- * contain the logical block number of this block.  The directory
- * entry pointer returned by this function will point into this block.
- * On failure, return NULL.
+/* Returns a pointer to block b of the cached root directory, which is
+ * read first if it isn't in the cache, or NULL if the block can't be
+ * read.  It is read again the next time it is used.
  */
-static direntry_t *searchSubdir(const char *name, block_t block,
-                                unsigned int *blkindex)
+static uint8_t *rootblock(unsigned int b)
 {
-   return NULL;
+   if (!g_rootResident[b] && rootfault(b, b + 1) == -1)
+      return NULL;
+
+   return g_root + b * BLOCKSIZE;
 }
 
 
-/* Search for a free entry in the root directory, stored in the global
- * variable root.
+/* Fill in the fields of hdr that identify the volume and image: the
+ * layout, volume ID, FAT checksum (a 64-bit FNV-1a hash of the entries),
+ * image size and modification time, and free space tree size.  The rest
+ * of hdr is cleared.
  *
- * Returns a pointer to the first free entry.  If there are not free
- * entries, returns NULL.
+ * Returns 0 on success, or -1 if the volume has no image file or the FAT
+ * can't be read.
  */
-static direntry_t *getFreeRootEntry(void)
+static int indexstat(indexhdr_t *hdr)
 {
-   return NULL;
+   struct stat st;
+   uint64_t sum = FNV_BASIS;
+   uint8_t entry[2];
+   unsigned int i;
+
+   fatfault(0, g_fatRegions * g_codec->regionEntries);
+   if (g_bdev.fd == -1 || g_fatMissing > 0 || fstat(g_bdev.fd, &st) == -1)
+      return -1;
+
+   for (i = 0; i < g_geom.numClusters + 2; i++)
+   {
+      entry[0] = (uint8_t) (g_fat[i] & 0xff);
+      entry[1] = (uint8_t) (g_fat[i] >> 8);
+      sum = fnv64(sum, entry, 2);
+   }
+
+   memset(hdr, 0, sizeof(indexhdr_t));
+   memcpy(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic));
+   hdr->layout = indexlayout();
+   hdr->volumeId = g_geom.volumeId;
+   hdr->fatSum = sum;
+   hdr->imageSize = st.st_size;
+   hdr->mtimeSec = st.st_mtim.tv_sec;
+   hdr->mtimeNsec = st.st_mtim.tv_nsec;
+   hdr->numClusters = g_geom.numClusters;
+   hdr->freeLeaves = g_freeLeaves;
+   return 0;
 }
 
 
-/* Search for a free entry in the sub-directory whose first block is
- * pointed to by cwdHead.  block should be a pointer to a variable of type
- * block_t and blkindex should be a pointer to a variable of type unsigned
- * int.
+/* Load the state held by the index file path, if it is valid for the
+ * mounted volume.  The file is mapped, checked in full, and then copied
+ * into the caches.
  *
- * If there is no free entry in the blocks currently allocated to the
- * sub-directory, this function will attempt to allocate a new block
- * for the sub-directory, initialize it, and return a pointer to the first
- * entry in the new block.
- *
- * Returns a pointer to the first free directory entry.  This pointer
- * will point into block, and the variable pointed to by blkindex will
- * contain the block's logical block number.  If no new entry can be found
- * or created, returns NULL.
+ * Returns 0 on success, or -1 if there is no valid index.
  */
-static direntry_t *getFreeSubDirEntry(block_t block,
-                                      unsigned int *blkindex)
+static int loadindex(const char *path)
 {
-   int i;
-   unsigned int free;
-   unsigned int blk = g_cwdHead;
-   unsigned int oldBlk;
-   direntry_t *direntry;
+   indexhdr_t want;
+   const indexhdr_t *hdr;
+   const indexlfn_t *lh;
+   const aggregate_t *aggs;
+   const uint8_t *p;
+   size_t treeLen = 2 * g_freeLeaves * sizeof(freerun_t);
+   uint8_t *map;
+   lfnindex_t *idx;
+   lfnindex_t **tail = &g_lfnIndexes;
+   struct stat st;
+   unsigned int i;
+   int fd;
 
-   /* Search the sub-directory's existing blocks. */
+   if (indexstat(&want) == -1 || (fd = open(path, O_RDONLY)) == -1)
+      return -1;
 
-   while (!lastBlk(blk))
+   if (fstat(fd, &st) == -1
+       || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+          == MAP_FAILED)
    {
-      readblock(g_dev, block, ltop(blk));
-      direntry = (direntry_t *) block;
-
-      for (i = 0; i < DIR_ENTRIES; i++, direntry++)
-         if (direntryFree(direntry))
-         {
-            *blkindex = blk;
-            return direntry;
-         }
-
-      oldBlk = blk;
-      blk = getfatentry(g_fat, blk);
+      close(fd);
+      return -1;
    }
+   close(fd);
 
-   /* If we've arrived here, there are no free entries in the
-    * sub-directory's existing blocks.  Attempt to allocate and
-    * initialize a new block for the sub-directory.
-    */
-
-   if ((free = getFreeFatEntry(g_fat)) == 0)   // Allocation failed.
-      return NULL;
+   if (indexvalid(map, st.st_size, &want) == -1)
+   {
+      munmap(map, st.st_size);
+      return -1;
+   }
 
-   /* Allocation succeeded.  Link the new block and set it as the
-    * sub-directory's last block.
+   hdr = (const indexhdr_t *) map;
+   p = map + sizeof(indexhdr_t);
+
+   memcpy(g_freeTree, p, treeLen);
+   g_freeClusters = hdr->freeClusters;
+   g_badClusters = hdr->badClusters;
+   g_freeValid = 1;
+   g_files = hdr->files;
+   g_dirs = hdr->dirs;
+   g_countsValid = hdr->countsValid;
+   p += treeLen;
+
+   aggs = (const aggregate_t *) p;
+   for (i = 0; i < hdr->aggCount; i++)
+      aggstore(aggs[i].cluster, aggs[i].parent, &aggs[i].usage);
+   p += hdr->aggCount * sizeof(aggregate_t);
+
+   /* The indexes are kept in the order they were written, most recently
+    * used first.
     */
+   lfnfree(g_lfnIndexes);
+   g_lfnIndexes = NULL;
+   for (i = 0; i < hdr->lfnCount; i++)
+   {
+      lh = (const indexlfn_t *) p;
+      p += sizeof(indexlfn_t);
+
+      if ((idx = calloc(1, sizeof(lfnindex_t))) == NULL
+          || (lh->size > 0
+              && (idx->slots = malloc(lh->size * sizeof(lfnslot_t))) == NULL)
+          || (lh->namesLen > 0
+              && (idx->names = malloc(lh->namesLen)) == NULL))
+      {
+         lfnfree(idx);
+         break;
+      }
 
-   putfatentry(g_fat, oldBlk, free);
-   putfatentry(g_fat, free, 0xfff);
-
-   direntry = (direntry_t *) block;
-
-   for (i = 0; i < DIR_ENTRIES; i++, direntry++)
-      direntry->filename[0] = 0x00;
+      idx->dir = lh->dir;
+      idx->size = lh->size;
+      idx->used = lh->used;
+      memcpy(idx->slots, p, lh->size * sizeof(lfnslot_t));
+      p += lh->size * sizeof(lfnslot_t);
+      idx->namesLen = idx->namesAlloc = lh->namesLen;
+      memcpy(idx->names, p, lh->namesLen);
+      p += INDEX_PAD(lh->namesLen);
+
+      *tail = idx;
+      tail = &idx->next;
+   }
 
-   writeblock(g_dev, block, ltop(free));
-   *blkindex = free;
-   return (direntry_t *) block;
+   munmap(map, st.st_size);
+   return 0;
 }
 
 
-/* Convert a logical block number to a physical block number.
+/* Check the len bytes of index file at map against want, as filled in by
+ * indexstat(), and check that the sections it lists fit in it.
+ *
+ * Returns 0 if the index is valid, -1 if not.
  */
-static unsigned int ltop(unsigned int lblock)
+static int indexvalid(const uint8_t *map, size_t len, const indexhdr_t *want)
 {
-   return lblock + 31;
+   const indexhdr_t *hdr = (const indexhdr_t *) map;
+   const uint8_t *end = map + len;
+   const uint8_t *p = map + sizeof(indexhdr_t);
+   const indexlfn_t *lh;
+   const lfnslot_t *slots;
+   const char *names;
+   size_t treeLen = 2 * g_freeLeaves * sizeof(freerun_t);
+   unsigned int i;
+   unsigned int j;
+
+   if (len < sizeof(indexhdr_t)
+       || memcmp(hdr, want, offsetof(indexhdr_t, bodySum)) != 0
+       || fnv64(FNV_BASIS, map + offsetof(indexhdr_t, freeClusters),
+                len - offsetof(indexhdr_t, freeClusters)) != hdr->bodySum
+       || (size_t) (end - p) < treeLen
+       || hdr->aggCount > (size_t) (end - p - treeLen) / sizeof(aggregate_t)
+       || hdr->lfnCount > LFN_INDEXES)
+      return -1;
+
+   p += treeLen + hdr->aggCount * sizeof(aggregate_t);
+   for (i = 0; i < hdr->lfnCount; i++)
+   {
+      lh = (const indexlfn_t *) p;
+      if ((size_t) (end - p) < sizeof(indexlfn_t)
+          || (lh->size & (lh->size - 1)) != 0 || lh->used > lh->size
+          || (size_t) (end - p - sizeof(indexlfn_t))
+             < lh->size * sizeof(lfnslot_t) + INDEX_PAD(lh->namesLen))
+         return -1;
+
+      /* Each name must lie within the names, which end with a null. */
+      slots = (const lfnslot_t *) (lh + 1);
+      names = (const char *) (slots + lh->size);
+      if (lh->namesLen > 0 && names[lh->namesLen - 1] != '\0')
+         return -1;
+      for (j = 0; j < lh->size; j++)
+         if (slots[j].name > lh->namesLen)
+            return -1;
+
+      p += sizeof(indexlfn_t) + lh->size * sizeof(lfnslot_t)
+         + INDEX_PAD(lh->namesLen);
+   }
+
+   return 0;
 }
 
 
-/* Search for a free FAT entry in fat.
+/* Write the index file path for the mounted volume, to a temporary file
+ * that is then renamed over it, so that an index is never seen half
+ * written.  The free space summary is built first if need be.
  *
- * Returns the index of the first free FAT entry.  If no free entry can be
- * found, returns 0.  (FAT entry 0 is reserved.  Hence, 0 amounts to an
- * invalid FAT index.
+ * Returns 0 on success, -1 on failure.
  */
-static unsigned int getFreeFatEntry(const fat_t fat)
+static int saveindex(const char *path)
 {
+   indexhdr_t hdr;
+   size_t treeLen = 2 * g_freeLeaves * sizeof(freerun_t);
+   size_t len = sizeof(indexhdr_t) + treeLen;
+   char tmp[PATH_LEN + 8];
+   uint8_t *buf;
+   uint8_t *p;
+   indexlfn_t lh;
+   lfnindex_t *idx;
    unsigned int i;
+   int fd;
+   int rv;
 
-   for (i = 2; i < (FAT_BLOCKS * BLOCKSIZE * 2) / 3; i++)
-      if (getfatentry(fat, i) == 0)
-         return i;
+   if (strlen(path) >= PATH_LEN || indexstat(&hdr) == -1)
+      return -1;
+   if (!g_freeValid)
+      freebuild();
 
-   return 0;
-}
+   for (i = 0; i < g_aggSize; i++)
+      if (g_agg[i].state == AGG_VALID)
+      {
+         hdr.aggCount++;
+         len += sizeof(aggregate_t);
+      }
+   for (idx = g_lfnIndexes; idx != NULL; idx = idx->next, hdr.lfnCount++)
+      len += sizeof(indexlfn_t) + idx->size * sizeof(lfnslot_t)
+         + INDEX_PAD(idx->namesLen);
 
+   hdr.freeClusters = g_freeClusters;
+   hdr.badClusters = g_badClusters;
+   hdr.countsValid = g_countsValid;
+   hdr.files = g_files;
+   hdr.dirs = g_dirs;
 
+   if ((buf = calloc(len, 1)) == NULL)
+      return -1;
 
-/* Return the FAT entry at the given index within fat.
- */
-static unsigned int getfatentry(const fat_t fat, unsigned int index)
-{
-   /* FAT entries straddle consecutive bytes in the FAT.  offset
-    * is the position of the first byte of the FAT entry of interest.
-    */
-   unsigned int offset = (3 * index) >> 1;
-   /* Treat the FAT as an array of bytes. */
-   const uint8_t *fatbase = (const uint8_t *) fat;
-   unsigned int ret;
-   unsigned int temp;
-   
-   if ((index & 0x1) == 0) // Index is even
-   {
-      ret = (unsigned int) fatbase[offset];
-      temp = (0xf & (unsigned int) fatbase[offset + 1]) << 8;
-      ret |= temp;
+   memcpy(buf + sizeof(indexhdr_t), g_freeTree, treeLen);
+   p = buf + sizeof(indexhdr_t) + treeLen;
+
+   for (i = 0; i < g_aggSize; i++)
+      if (g_agg[i].state == AGG_VALID)
+      {
+         memcpy(p, &g_agg[i], sizeof(aggregate_t));
+         p += sizeof(aggregate_t);
+      }
+
+   for (idx = g_lfnIndexes; idx != NULL; idx = idx->next)
+   {
+      lh.dir = idx->dir;
+      lh.size = idx->size;
+      lh.used = idx->used;
+      lh.namesLen = idx->namesLen;
+      memcpy(p, &lh, sizeof(indexlfn_t));
+      p += sizeof(indexlfn_t);
+      memcpy(p, idx->slots, idx->size * sizeof(lfnslot_t));
+      p += idx->size * sizeof(lfnslot_t);
+      memcpy(p, idx->names, idx->namesLen);
+      p += INDEX_PAD(idx->namesLen);
    }
-   else
+
+   memcpy(buf, &hdr, sizeof(indexhdr_t));
+   hdr.bodySum = fnv64(FNV_BASIS, buf + offsetof(indexhdr_t, freeClusters),
+                       len - offsetof(indexhdr_t, freeClusters));
+   memcpy(buf + offsetof(indexhdr_t, bodySum), &hdr.bodySum,
+          sizeof(hdr.bodySum));
+
+   sprintf(tmp, "%s.tmp", path);
+   if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+   {
+      free(buf);
+      return -1;
+   }
+
+   rv = writefull(fd, buf, len);
+   if (close(fd) == -1 || rv == -1 || rename(tmp, path) == -1)
    {
-      ret = ((unsigned int) fatbase[offset]) >> 4;
-      temp = ((unsigned int) fatbase[offset + 1]) << 4;
-      ret |= temp;
+      unlink(tmp);
+      rv = -1;
    }
 
-   return ret;
+   free(buf);
+   return rv;
 }
 
 
-/* Write val to the FAT entry at the given index within fat.
+/* Returns the 64-bit FNV-1a hash of the len bytes at buf, continuing
+ * from the hash sum.
  */
-static void putfatentry(fat_t fat, unsigned int index, unsigned int val)
+static uint64_t fnv64(uint64_t sum, const uint8_t *buf, size_t len)
 {
-   /* FAT entries straddle consecutive bytes in the FAT.  offset
-    * is the position of the first byte of the FAT entry of interest.
-    */
-   unsigned int offset = (3 * index) >> 1;
-   /* Treat the FAT as an array of bytes. */
-   uint8_t *fatbase = (uint8_t *) fat;
-   
-   if ((index & 0x1) == 0) // Index is even
-   {
-      fatbase[offset] = (uint8_t) (0xFF & val);
-      fatbase[offset + 1] &= (uint8_t) 0XF0;
-      fatbase[offset + 1] |= (uint8_t) (0X0F & (val >> 8));
-   }
-   else
-   {
-      fatbase[offset] &= (uint8_t) 0X0F;
-      fatbase[offset] |= (uint8_t) ((val << 4) & 0xF0);
-      fatbase[offset + 1] = (uint8_t) (0xFF & (val >> 4));
-   }
+   size_t i;
+
+   for (i = 0; i < len; i++)
+      sum = (sum ^ buf[i]) * 0x100000001b3ull;
+
+   return sum;
 }
 
 
-/* Return 1 if the block number value blknum corresponds to the last block
- * of a file.  Otherwise, return 0.
+/* Returns a word encoding the sizes of the structures written to index
+ * files.
  */
-static int lastBlk(unsigned int blknum)
+static uint32_t indexlayout(void)
 {
-   if (0XFF8 <= blknum && blknum <= 0XFFF)
-      return 1;
-   else
-      return 0;
+   return (uint32_t) (sizeof(indexhdr_t) << 24 ^ sizeof(freerun_t) << 16
+                      ^ sizeof(aggregate_t) << 8 ^ sizeof(lfnslot_t));
 }
 
 
-/* Returns 1 if the current working directory is the root directory.
- * Otherwise, returns 1.
+/* Free the FAT and root directory caches.
  */
-static int cwdIsRoot(void)
+static void freecaches(void)
 {
-   return g_cwdHead == 0;
+   free(g_fat);
+   free(g_fatDirty);
+   free(g_fatResident);
+   free(g_root);
+   free(g_rootDirty);
+   free(g_rootResident);
+   free(g_agg);
+   free(g_freeTree);
+   free(g_spare);
+   lfnfree(g_lfnIndexes);
+   dirmapfree(g_dirMaps);
+   g_lfnIndexes = NULL;
+   g_dirMaps = NULL;
+   g_freeTree = NULL;
+   g_spare = NULL;
+   g_spareUsed = g_spareAlloc = 0;
+   g_fat = NULL;
+   g_fatDirty = g_fatResident = g_root = g_rootDirty = g_rootResident = NULL;
+   g_agg = NULL;
+   g_aggSize = g_aggUsed = 0;
 }
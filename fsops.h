@@ -12,15 +12,137 @@
 #define __FSOPS_H
 
 
+#include "blockdev.h"
+
+
+/* A date and time from a directory entry.  Seconds have a granularity
+ * of two.
+ */
+struct fd_time
+{
+   unsigned int year;
+   unsigned int month;
+   unsigned int day;
+   unsigned int hour;
+   unsigned int minute;
+   unsigned int second;
+};
+
+
+/* Longest long file name, in bytes of UTF-8, not counting the
+ * terminating null character.
+ */
+#define FD_NAME_MAX 255
+
+
+/* A decoded directory entry, as passed to fd_iterdir() callbacks. */
+struct fd_dirent
+{
+   char name[13];              /* 8.3 format, e.g. "README.TXT" */
+   char longName[FD_NAME_MAX + 1];  /* VFAT long name in UTF-8, or "" */
+   unsigned int attributes;
+   unsigned int size;
+   unsigned int cluster;       /* First cluster */
+   struct fd_time created;
+   struct fd_time written;
+   struct fd_time accessed;    /* Date only */
+};
+
+
+/* fd_iterdir() callback.  Returning non-zero stops the iteration. */
+typedef int (*fd_dirfn)(const struct fd_dirent *entry, void *arg);
+
+
+/* fd_iterdir() flags.  By default every entry except hidden ones is
+ * visited, in directory order.  At most one FD_SORT_ key may be given.
+ */
+#define FD_DIR_HIDDEN 0x01      /* Include hidden entries */
+#define FD_DIR_NODOTS 0x02      /* Skip the "." and ".." entries */
+#define FD_DIR_NOLABEL 0x04     /* Skip the volume label */
+#define FD_DIR_NOFILES 0x08     /* Skip files */
+#define FD_DIR_NODIRS 0x10      /* Skip sub-directories */
+#define FD_SORT_NAME 0x100
+#define FD_SORT_SIZE 0x200
+#define FD_SORT_TIME 0x300      /* By last write time */
+#define FD_SORT_MASK 0x300
+#define FD_SORT_REVERSE 0x400
+
+
+/* fd_walk() callback.  Returns one of the FD_WALK_ values below. */
+typedef int (*fd_walkfn)(const char *path, const struct fd_dirent *entry,
+                         unsigned int depth, void *arg);
+
+#define FD_WALK_CONTINUE 0
+#define FD_WALK_SKIP 1          /* Don't enter this sub-directory */
+#define FD_WALK_STOP 2
+
+
+/* Totals for a directory tree, from fd_du(). */
+struct fd_usage
+{
+   unsigned int files;
+   unsigned int dirs;
+   unsigned long long bytes;
+};
+
+
+/* Volume statistics, as returned by fd_statfs(). */
+struct fd_statfs
+{
+   unsigned int clusterBytes;  /* Bytes per cluster */
+   unsigned int clusters;      /* Data clusters */
+   unsigned int freeClusters;
+   unsigned int badClusters;
+   unsigned int largestFree;   /* Longest run of consecutive free clusters */
+   unsigned int files;
+   unsigned int dirs;
+};
+
+
+/* A file for fd_read_many() to read. */
+struct fd_readreq
+{
+   const char *path;
+   void *buf;
+   unsigned int offset;
+   unsigned int len;
+   int result;                 /* Bytes read, or -1 */
+};
+
+
 /* Function prototypes */
 int fd_mount(const char *img);
+int fd_mountdev(const blockdev_t *dev);
+int fd_mountlazy(const blockdev_t *dev);
 int fd_unmount(int dev);
+int fd_overlay(const char *img);
+int fd_commit(int dev);
+int fd_discard(int dev);
+int fd_index(const char *path);
 int fd_dir(int showAll);
 int fd_cd(const char *dir);
+unsigned int fd_getcwd(void);
+int fd_setcwd(unsigned int cwd);
 int fd_type(const char *file);
+int fd_read(const char *file, unsigned int offset, void *buf,
+            unsigned int len);
+int fd_read_many(struct fd_readreq *reqs, unsigned int count);
+int fd_sendfile(const char *file, int outFd);
 int fd_del(const char *file);
 int fd_creat(const char *file);
+int fd_mkdir(const char *dir, unsigned int hint);
+int fd_rmdir(const char *dir);
+int fd_copy(const char *src, const char *dst);
+int fd_rename(const char *oldPath, const char *newPath);
 int fd_append(const char *file, const char *data, unsigned int len);
+int fd_truncate(const char *file, unsigned int size);
+int fd_fallocate(const char *file, unsigned int size);
+int fd_import(const char *hostPath, const char *file);
+int fd_export(const char *imageDir, const char *hostDir);
+int fd_iterdir(const char *dir, unsigned int flags, fd_dirfn fn, void *arg);
+int fd_walk(const char *dir, unsigned int flags, fd_walkfn fn, void *arg);
+int fd_du(const char *dir, struct fd_usage *usage);
+int fd_statfs(struct fd_statfs *st);
 
 
 #endif
@@ -14,33 +14,30 @@
 #include "driver.h"
 
 
-/* The number of blocks (sectors) in a floppy file system's FAT.  Note
- * that this number can be read from a field in the boot block.
+/* FAT entry widths supported by the file system layer.  The width is
+ * not stored anywhere on the volume; it is implied by the number of data
+ * clusters, per the Microsoft FAT specification.
  */
-#define FAT_BLOCKS 9
+#define FAT12 12
+#define FAT16 16
 
 
-/* The physical block number of the first block of the first and second 
- * FATs.
+/* Largest cluster counts for FAT12 and FAT16 volumes.  A volume with
+ * more than FAT16_MAX_CLUSTERS clusters is FAT32, which is not supported.
  */
-#define FAT1_START 1
-#define FAT2_START 10
+#define FAT12_MAX_CLUSTERS 4084
+#define FAT16_MAX_CLUSTERS 65524
 
 
-/* The number of blocks (sectors) in a floppy file system's root
- * directory.  Note that this number can be calculated from information
- * specified in the boot block.
+/* Largest supported cluster size, in blocks.  Together with
+ * FAT16_MAX_CLUSTERS this limits volumes to 2GB.
  */
-#define ROOT_BLOCKS 14
+#define MAX_BLOCKS_PER_CLUSTER 64
 
 
-/* The physical block number of the first block of the root directory. */
-#define ROOT_START 19
-
-
-/* Boot block entries relevant to the file system.  This is not needed
- * for the project; it's for reference purposes.  Note the use of the
- * packed attribute to keep the compiler from word-aligning the
+/* Boot block entries relevant to the file system.  The volume's
+ * geometry is computed from these fields at mount time.  Note the use of
+ * the packed attribute to keep the compiler from word-aligning the
  * structure's members.
  */
 typedef struct __attribute__ ((__packed__)) bootblock_t
@@ -67,19 +64,26 @@ typedef struct __attribute__ ((__packed__)) bootblock_t
 } bootblock_t;
 
 
-/* Data type to use for caching the FAT in memory while the file system
- * is mounted.  The cached FAT should be flushed to disk before
- * unmounting the file system.  Note that this is an array type.
- */
-typedef uint8_t fat_t[FAT_BLOCKS * BLOCKSIZE];
-
-
-/* Data type to use for caching the root directory in memory while
- * the file system is mounted.  The cached root directory should be
- * flushed to disk before unmounting the file system.  Note that this is
- * an array type.
+/* Volume geometry, computed from the boot block when a volume is
+ * mounted.  All block numbers are physical block numbers on the device.
+ * Data clusters are numbered from 2 through numClusters + 1.
  */
-typedef uint8_t root_t[ROOT_BLOCKS * BLOCKSIZE];
+typedef struct fsgeom_t
+{
+   unsigned int fatBits;           /* FAT12 or FAT16 */
+   unsigned int blocksPerCluster;
+   unsigned int numFATs;
+   unsigned int fatStart;          /* First block of the first FAT */
+   unsigned int fatBlocks;         /* Blocks per FAT copy */
+   unsigned int rootStart;         /* First block of the root directory */
+   unsigned int rootBlocks;
+   unsigned int rootEntries;
+   unsigned int dataStart;         /* First block of cluster 2 */
+   unsigned int numClusters;
+   unsigned int totalBlocks;
+   unsigned int trackBlocks;       /* Blocks per track, or 0 if unknown */
+   uint32_t volumeId;              /* Volume serial number */
+} fsgeom_t;
 
 
 /* Number of directory entries per block. */
@@ -93,7 +97,7 @@ typedef uint8_t root_t[ROOT_BLOCKS * BLOCKSIZE];
  * entry from the root directory, or from a block holding a portion of a
  * sub-directory:
  *
- *    root_t root;
+ *    uint8_t *root;   // Root directory cache, rootBlocks * BLOCKSIZE
  *    block_t block;
  *    // Access directory entries in root via dirArray as array or pointer
  *    direntry_t *dirArray = (direntry_t *) root;
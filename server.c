@@ -0,0 +1,683 @@
+/***********************************************************************
+ * server.c
+ *
+ * An image server.  Keeps an image mounted, with its caches warm, and
+ * serves the file system operations to local clients over a Unix
+ * domain socket, using the protocol in fdproto.h.
+ *
+ * Usage: server [-o | -r] [-t threads] socket image
+ *
+ * The main thread accepts connections and polls the idle ones.  A
+ * connection with a request waiting is queued for the worker threads;
+ * a worker reads the request, runs it, sends the reply, and hands the
+ * connection back to the main thread.  The file system keeps one
+ * volume's state, so the operations themselves run one at a time, each
+ * with its connection's working directory swapped in; the workers
+ * overlap the transfer and encoding of requests and replies.
+ *
+ * -o mounts the image with an overlay, so changes reach the image only
+ * through FDP_COMMIT requests, and -r loads it into a RAM disk.
+ * SIGINT or SIGTERM stops the server and unmounts the image.
+ ***********************************************************************/
+
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "fsops.h"
+#include "fdproto.h"
+
+
+#define DEFAULT_THREADS 4
+#define MAX_THREADS 64
+#define MAX_CONNS 1024
+
+/* Seconds a worker waits for the rest of a request, or for the client to
+ * take more of a reply, before closing the connection, so a client that
+ * stalls can't hold a worker.
+ */
+#define IO_TIMEOUT 5
+
+
+/* A client connection and its working directory. */
+typedef struct conn_t {
+   int sock;
+   unsigned int cwd;
+   struct conn_t *next;
+} conn_t;
+
+
+/* A reply payload, grown as it is built.  failed is set if it couldn't
+ * be grown.
+ */
+typedef struct reply_t {
+   uint8_t *data;
+   size_t len;
+   size_t size;
+   int failed;
+} reply_t;
+
+
+/* Device number of the mounted image. */
+static int dev = -1;
+
+/* Held while a file system operation runs. */
+static pthread_mutex_t fsLock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Connections with a request waiting, for the workers, and connections
+ * whose request has been answered, for the main thread.
+ */
+static pthread_mutex_t queueLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queueCond = PTHREAD_COND_INITIALIZER;
+static conn_t *waiting = NULL;
+static conn_t *waitingTail = NULL;
+static conn_t *answered = NULL;
+static int stopping = 0;
+
+/* Pipe through which workers and signals wake the main thread. */
+static int wakeFds[2] = { -1, -1 };
+static volatile sig_atomic_t signalled = 0;
+
+
+void usage(void);
+int mountImage(const char *img, int overlay, int ram);
+int serve(int listenSock, unsigned int threads);
+void onSignal(int sig);
+void wake(void);
+void *worker(void *arg);
+int serveRequest(conn_t *conn);
+int runRequest(conn_t *conn, const fdp_req_t *req, char *args,
+               reply_t *reply);
+const char *nextString(char **pos, char *end);
+int replyReserve(reply_t *reply, size_t len);
+int listEntry(const struct fd_dirent *entry, void *arg);
+int readFull(int fd, void *buf, size_t len);
+int writeFull(int fd, const void *buf, size_t len);
+
+
+/***********************************************************************
+ * main
+ ***********************************************************************/
+
+int main(int argc, char *argv[]) {
+   int opt;
+   int overlay = 0;
+   int ram = 0;
+   unsigned int threads = DEFAULT_THREADS;
+   const char *path;
+   int listenSock;
+   int failed;
+   struct sockaddr_un addr;
+   struct sigaction sa;
+
+   while ((opt = getopt(argc, argv, "ort:")) != -1) {
+      if (opt == 'o')
+         overlay = 1;
+      else if (opt == 'r')
+         ram = 1;
+      else if (opt == 't')
+         threads = strtoul(optarg, NULL, 0);
+      else {
+         usage();
+         return -1;
+      }
+   }
+
+   if (argc - optind != 2 || (overlay && ram) || threads == 0
+       || threads > MAX_THREADS) {
+      usage();
+      return -1;
+   }
+
+   path = argv[optind];
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path %s is too long.\n", path);
+      return -1;
+   }
+
+   if ((dev = mountImage(argv[optind + 1], overlay, ram)) == -1) {
+      fprintf(stderr, "Couldn't mount floppy image.\n");
+      return -1;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+   unlink(path);
+
+   if ((listenSock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1
+       || bind(listenSock, (struct sockaddr *) &addr, sizeof(addr)) == -1
+       || listen(listenSock, SOMAXCONN) == -1 || pipe(wakeFds) == -1
+       || fcntl(wakeFds[0], F_SETFL, O_NONBLOCK) == -1
+       || fcntl(wakeFds[1], F_SETFL, O_NONBLOCK) == -1) {
+      perror("server");
+      fd_unmount(dev);
+      return -1;
+   }
+
+   memset(&sa, 0, sizeof(sa));
+   sigemptyset(&sa.sa_mask);
+   sa.sa_handler = onSignal;
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   sa.sa_handler = SIG_IGN;
+   sigaction(SIGPIPE, &sa, NULL);
+
+   failed = serve(listenSock, threads);
+
+   close(listenSock);
+   unlink(path);
+   close(wakeFds[0]);
+   close(wakeFds[1]);
+
+   if (fd_unmount(dev) == -1)
+      failed = 1;
+
+   return failed ? -1 : 0;
+}
+
+
+void usage(void) {
+   printf("Usage: server [-o | -r] [-t threads] socket image\n");
+}
+
+
+/* Mount img with an overlay if overlay is true, or on a RAM disk if ram
+ * is true.
+ *
+ * Returns the device number, or -1 if the image couldn't be mounted.
+ */
+
+int mountImage(const char *img, int overlay, int ram) {
+   blockdev_t disk;
+   int rv;
+
+   if (overlay)
+      return fd_overlay(img);
+   if (!ram)
+      return fd_mount(img);
+
+   if (bd_openram(&disk, img) == -1)
+      return -1;
+   if ((rv = fd_mountdev(&disk)) == -1)
+      bd_close(&disk);
+
+   return rv;
+}
+
+
+/* Accept and poll connections on listenSock, with a pool of threads
+ * workers serving their requests, until a signal arrives.  Connections
+ * still open then are closed.
+ *
+ * Returns 0 on a clean shutdown, or 1 if the server failed.
+ */
+
+int serve(int listenSock, unsigned int threads) {
+   pthread_t pool[MAX_THREADS];
+   struct pollfd fds[MAX_CONNS + 2];
+   conn_t *conns[MAX_CONNS + 2];
+   unsigned int started;
+   unsigned int count = 2;
+   unsigned int i;
+   int failed = 0;
+   int sock;
+   char drain[64];
+   struct timeval timeout = { IO_TIMEOUT, 0 };
+   conn_t *conn;
+
+   for (started = 0; started < threads; started++)
+      if (pthread_create(&pool[started], NULL, worker, NULL) != 0)
+         break;
+
+   if (started == 0)
+      return 1;
+
+   fds[0].fd = listenSock;
+   fds[0].events = POLLIN;
+   fds[1].fd = wakeFds[0];
+   fds[1].events = POLLIN;
+
+   while (!signalled) {
+      if (poll(fds, count, -1) == -1) {
+         if (errno == EINTR)
+            continue;
+         failed = 1;
+         break;
+      }
+
+      /* Queue the connections with a request waiting, filling each gap
+       * in the poll set with its last connection.
+       */
+      for (i = 2; i < count; )
+         if (fds[i].revents != 0) {
+            conn = conns[i];
+            conn->next = NULL;
+            pthread_mutex_lock(&queueLock);
+            if (waitingTail == NULL)
+               waiting = conn;
+            else
+               waitingTail->next = conn;
+            waitingTail = conn;
+            pthread_cond_signal(&queueCond);
+            pthread_mutex_unlock(&queueLock);
+
+            count--;
+            fds[i] = fds[count];
+            conns[i] = conns[count];
+         }
+         else
+            i++;
+
+      /* Poll the connections the workers have finished with again. */
+      if (fds[1].revents != 0) {
+         while (read(wakeFds[0], drain, sizeof(drain)) > 0)
+            ;
+
+         pthread_mutex_lock(&queueLock);
+         conn = answered;
+         answered = NULL;
+         pthread_mutex_unlock(&queueLock);
+
+         for ( ; conn != NULL; conn = conn->next) {
+            fds[count].fd = conn->sock;
+            fds[count].events = POLLIN;
+            conns[count++] = conn;
+         }
+      }
+
+      if (fds[0].revents != 0
+          && (sock = accept(listenSock, NULL, NULL)) != -1) {
+         if (count == MAX_CONNS + 2
+             || setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                           sizeof(timeout)) == -1
+             || setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+                           sizeof(timeout)) == -1
+             || (conn = malloc(sizeof(conn_t))) == NULL)
+            close(sock);
+         else {
+            conn->sock = sock;
+            conn->cwd = 0;
+            fds[count].fd = sock;
+            fds[count].events = POLLIN;
+            conns[count++] = conn;
+         }
+      }
+   }
+
+   pthread_mutex_lock(&queueLock);
+   stopping = 1;
+   pthread_cond_broadcast(&queueCond);
+   pthread_mutex_unlock(&queueLock);
+
+   for (i = 0; i < started; i++)
+      pthread_join(pool[i], NULL);
+
+   for (i = 2; i < count; i++) {
+      close(conns[i]->sock);
+      free(conns[i]);
+   }
+
+   while ((conn = answered) != NULL) {
+      answered = conn->next;
+      close(conn->sock);
+      free(conn);
+   }
+
+   return failed;
+}
+
+
+/* SIGINT and SIGTERM handler: stop the server.
+ */
+
+void onSignal(int sig) {
+   (void) sig;
+   signalled = 1;
+   wake();
+}
+
+
+/* Wake the main thread from poll().
+ */
+
+void wake(void) {
+   char byte = 0;
+
+   if (write(wakeFds[1], &byte, 1) == -1)
+      return;
+}
+
+
+/* Worker thread: serve the waiting connections' requests until the
+ * server stops.  A connection whose client has hung up, or whose
+ * request couldn't be served, is closed.  Requests already taken when
+ * the server stops are finished first.
+ */
+
+void *worker(void *arg) {
+   conn_t *conn;
+
+   (void) arg;
+
+   while (1) {
+      pthread_mutex_lock(&queueLock);
+      while (waiting == NULL && !stopping)
+         pthread_cond_wait(&queueCond, &queueLock);
+      if ((conn = waiting) == NULL) {
+         pthread_mutex_unlock(&queueLock);
+         break;
+      }
+      if ((waiting = conn->next) == NULL)
+         waitingTail = NULL;
+      pthread_mutex_unlock(&queueLock);
+
+      if (serveRequest(conn) == -1) {
+         close(conn->sock);
+         free(conn);
+         continue;
+      }
+
+      pthread_mutex_lock(&queueLock);
+      conn->next = answered;
+      answered = conn;
+      pthread_mutex_unlock(&queueLock);
+      wake();
+   }
+
+   return NULL;
+}
+
+
+/* Read one request from conn, run it, and send the reply.
+ *
+ * Returns 0 on success, or -1 if the client hung up, the rest of the
+ * request didn't arrive or the reply wasn't taken within IO_TIMEOUT
+ * seconds, or the connection failed.
+ */
+
+int serveRequest(conn_t *conn) {
+   fdp_req_t req;
+   fdp_rep_t rep;
+   reply_t reply = { NULL, 0, 0, 0 };
+   char *args;
+   int rv = 0;
+
+   if (readFull(conn->sock, &req, sizeof(req)) == -1
+       || req.len > FDP_MAX_PAYLOAD || (args = malloc(req.len + 1)) == NULL)
+      return -1;
+
+   if (readFull(conn->sock, args, req.len) == -1) {
+      free(args);
+      return -1;
+   }
+   args[req.len] = '\0';
+
+   rep.status = runRequest(conn, &req, args, &reply);
+   rep.len = reply.len;
+
+   if (writeFull(conn->sock, &rep, sizeof(rep)) == -1
+       || writeFull(conn->sock, reply.data, reply.len) == -1)
+      rv = -1;
+
+   free(args);
+   free(reply.data);
+   return rv;
+}
+
+
+/* Run the request req, whose arguments, null terminated after the last
+ * byte, are in args, in conn's working directory, leaving any results
+ * in reply.
+ *
+ * Returns the request's status.
+ */
+
+int runRequest(conn_t *conn, const fdp_req_t *req, char *args,
+               reply_t *reply) {
+   char *pos = args;
+   char *end = args + req->len;
+   const char *s1 = nextString(&pos, end);
+   const char *s2 = s1 != NULL ? nextString(&pos, end) : NULL;
+   const char *dir = req->len != 0 ? s1 : NULL;
+   unsigned int len = req->arg[1];
+   int status = -1;
+
+   if (req->op == FDP_READ && s1 != NULL) {
+      if (len > FDP_MAX_PAYLOAD)
+         len = FDP_MAX_PAYLOAD;
+      if (replyReserve(reply, len) == -1)
+         return -1;
+   }
+   else if ((req->op == FDP_DU
+             && replyReserve(reply, sizeof(struct fd_usage)) == -1)
+            || (req->op == FDP_STATFS
+                && replyReserve(reply, sizeof(struct fd_statfs)) == -1))
+      return -1;
+
+   pthread_mutex_lock(&fsLock);
+
+   /* A working directory removed by another client leaves its
+    * connections at the root.
+    */
+   if (fd_setcwd(conn->cwd) == -1) {
+      conn->cwd = 0;
+      fd_setcwd(0);
+      pthread_mutex_unlock(&fsLock);
+      return -1;
+   }
+
+   switch (req->op) {
+   case FDP_CD:
+      if (s1 != NULL)
+         status = fd_cd(s1);
+      break;
+   case FDP_LIST:
+      if (req->len == 0 || s1 != NULL)
+         status = fd_iterdir(dir, req->arg[0], listEntry, reply);
+      break;
+   case FDP_READ:
+      if (s1 != NULL && (status = fd_read(s1, req->arg[0], reply->data, len))
+          != -1)
+         reply->len = status;
+      break;
+   case FDP_CREAT:
+      if (s1 != NULL)
+         status = fd_creat(s1);
+      break;
+   case FDP_DEL:
+      if (s1 != NULL)
+         status = fd_del(s1);
+      break;
+   case FDP_MKDIR:
+      if (s1 != NULL)
+         status = fd_mkdir(s1, req->arg[0]);
+      break;
+   case FDP_RMDIR:
+      if (s1 != NULL)
+         status = fd_rmdir(s1);
+      break;
+   case FDP_COPY:
+      if (s2 != NULL)
+         status = fd_copy(s1, s2);
+      break;
+   case FDP_RENAME:
+      if (s2 != NULL)
+         status = fd_rename(s1, s2);
+      break;
+   case FDP_APPEND:
+      if (s1 != NULL)
+         status = fd_append(s1, pos, end - pos);
+      break;
+   case FDP_TRUNCATE:
+      if (s1 != NULL)
+         status = fd_truncate(s1, req->arg[0]);
+      break;
+   case FDP_FALLOCATE:
+      if (s1 != NULL)
+         status = fd_fallocate(s1, req->arg[0]);
+      break;
+   case FDP_DU:
+      if ((req->len == 0 || s1 != NULL)
+          && (status = fd_du(dir, (struct fd_usage *) reply->data)) != -1)
+         reply->len = sizeof(struct fd_usage);
+      break;
+   case FDP_IMPORT:
+      if (s2 != NULL)
+         status = fd_import(s1, s2);
+      break;
+   case FDP_EXPORT:
+      if (s2 != NULL)
+         status = fd_export(s1, s2);
+      break;
+   case FDP_COMMIT:
+      status = fd_commit(dev);
+      break;
+   case FDP_DISCARD:
+      status = fd_discard(dev);
+      break;
+   case FDP_STATFS:
+      if ((status = fd_statfs((struct fd_statfs *) reply->data)) != -1)
+         reply->len = sizeof(struct fd_statfs);
+      break;
+   }
+
+   conn->cwd = fd_getcwd();
+   pthread_mutex_unlock(&fsLock);
+
+   /* A failed request, or a listing cut short, returns no results. */
+   if (status == -1 || reply->failed) {
+      reply->len = 0;
+      status = -1;
+   }
+
+   return status;
+}
+
+
+/* Take the null terminated string at *pos, which must end before end,
+ * and advance *pos past it.
+ *
+ * Returns the string, or NULL if there isn't one.
+ */
+
+const char *nextString(char **pos, char *end) {
+   char *s = *pos;
+   char *nul;
+
+   if (s >= end || (nul = memchr(s, '\0', end - s)) == NULL)
+      return NULL;
+
+   *pos = nul + 1;
+   return s;
+}
+
+
+/* Make room for len more bytes in reply.
+ *
+ * Returns 0 on success, or -1 if out of memory.
+ */
+
+int replyReserve(reply_t *reply, size_t len) {
+   size_t size = reply->size != 0 ? reply->size : 4096;
+   uint8_t *data;
+
+   if (reply->len + len <= reply->size)
+      return 0;
+
+   while (size < reply->len + len)
+      size *= 2;
+
+   if ((data = realloc(reply->data, size)) == NULL)
+      return -1;
+
+   reply->data = data;
+   reply->size = size;
+   return 0;
+}
+
+
+/* fd_iterdir() callback for FDP_LIST: append entry to the reply pointed
+ * to by arg.
+ */
+
+int listEntry(const struct fd_dirent *entry, void *arg) {
+   reply_t *reply = arg;
+   fdp_entry_t e;
+   size_t nameLen = strlen(entry->name);
+   size_t longLen = strlen(entry->longName);
+
+   if (replyReserve(reply, sizeof(e) + nameLen + longLen) == -1) {
+      reply->failed = 1;
+      return 1;
+   }
+
+   e.size = entry->size;
+   e.cluster = entry->cluster;
+   e.attributes = entry->attributes;
+   e.nameLen = nameLen;
+   e.longLen = longLen;
+
+   memcpy(reply->data + reply->len, &e, sizeof(e));
+   memcpy(reply->data + reply->len + sizeof(e), entry->name, nameLen);
+   memcpy(reply->data + reply->len + sizeof(e) + nameLen, entry->longName,
+          longLen);
+   reply->len += sizeof(e) + nameLen + longLen;
+
+   return 0;
+}
+
+
+/* Read exactly len bytes from fd into buf.
+ *
+ * Returns 0 on success, or -1 on failure or end of file.
+ */
+
+int readFull(int fd, void *buf, size_t len) {
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len) {
+      n = read(fd, (char *) buf + done, len - done);
+      if (n == -1 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      done += n;
+   }
+
+   return 0;
+}
+
+
+/* Write the len bytes in buf to fd.
+ *
+ * Returns 0 on success, or -1 on failure.
+ */
+
+int writeFull(int fd, const void *buf, size_t len) {
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len) {
+      n = write(fd, (const char *) buf + done, len - done);
+      if (n == -1 && errno == EINTR)
+         continue;
+      if (n <= 0)
+         return -1;
+      done += n;
+   }
+
+   return 0;
+}
@@ -3,24 +3,89 @@
  *
  * Tom Kelliher, Goucher College (c) 2016
  *
- * A simple interactive shell program for interacting with the DOS
- * FAT12 file system operations for Project 5.
+ * A simple shell program for interacting with the DOS FAT12 file system
+ * operations for Project 5.
+ *
+ * Usage: shell [-e] [-l] [-o | -r] [-s] [-i index] [-c commands] image
+ *              [script]
+ *
+ * With just an image, and a terminal on stdin, the shell is
+ * interactive.  Otherwise it runs in batch mode, taking its commands
+ * from the -c argument (separated by semicolons), the script file, or
+ * stdin.  In batch mode no banner, prompts or return values are
+ * printed, output is fully buffered, and failed commands are reported
+ * on stderr.  -e stops a batch at the first failed command; otherwise
+ * the remaining commands still run.  The exit status is 1 if any
+ * command failed.
+ *
+ * -o mounts the image with an overlay: changes are kept in memory until
+ * a commit command writes them to the image, and a discard command, or
+ * leaving the shell, drops them.  -r loads the image into a RAM disk,
+ * so changes never reach the image file.  -s runs the image through a
+ * simulated floppy drive and reports the drive's simulated I/O time on
+ * stderr on the way out.  -l mounts the image lazily, reading its FAT
+ * and root directory only as they are used.  -i keeps an index of the
+ * image in the file index, loaded at startup if it is up to date and
+ * written on the way out, so that counts and totals computed in one run
+ * needn't be computed again in the next.
  ***********************************************************************/
 
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include "fstypes.h"
 #include "fsops.h"
 
 
 #define COMMAND_LEN 1024
 #define DELIMS " \n\r\r"
 #define MAX_TOKENS 3
-#define FILE_SIZE_LIMIT 64 * 1024
-
-
+#define OUTPUT_BUF (64 * 1024)
+
+/* Results of runCommand(). */
+#define CMD_OK 0
+#define CMD_FAILED 1
+#define CMD_EXIT 2
+
+
+/* The commands and the number of arguments each requires. */
+static const struct {
+   const char *name;
+   int args;
+} commands[] = {
+   { "help", 0 }, { "exit", 0 }, { "dir", 0 }, { "ls", 0 }, { "cd", 1 },
+   { "type", 1 }, { "del", 1 }, { "creat", 1 }, { "appends", 2 },
+   { "appendf", 2 }, { "import", 2 }, { "export", 2 }, { "du", 0 },
+   { "df", 0 }, { "find", 0 }, { "tree", 0 }, { "mkdir", 1 }, { "rmdir", 1 },
+   { "copy", 2 }, { "rename", 2 },
+   { "truncate", 2 }, { "fallocate", 2 }, { "commit", 0 }, { "discard", 0 }
+};
+
+
+/* Device number of the mounted image. */
+static int dev = -1;
+
+
+void usage(void);
+int mountImage(const char *img, int overlay, int ram, int lazy,
+               bdsimstats_t *sim);
+int runScript(FILE *in, int interactive, int stopOnError);
+int runCommands(const char *cmds, int stopOnError);
+int runCommand(const char *line, int interactive);
+int typeFile(const char *file);
+int ls(const char *options);
+int lsEntry(const struct fd_dirent *entry, void *arg);
+int du(const char *dir);
+int df(void);
+int findEntry(const char *path, const struct fd_dirent *entry,
+              unsigned int depth, void *arg);
+int treeEntry(const char *path, const struct fd_dirent *entry,
+              unsigned int depth, void *arg);
 void listHelp(void);
-int appendf(const char *destFile, const char *srcFile);
 char *getStringArg(char *cmd);
 
 
@@ -29,77 +94,503 @@ char *getStringArg(char *cmd);
  ***********************************************************************/
 
 int main(int argc, char *argv[]) {
-   int dev;
-   char command[1024];
-   char *tokens[MAX_TOKENS];
+   int opt;
+   int overlay = 0;
+   int ram = 0;
+   int simulate = 0;
+   int lazy = 0;
+   bdsimstats_t sim = { 0, 0, 0, 0 };
+   int stopOnError = 0;
+   int interactive;
+   int failed;
+   const char *cmds = NULL;
+   const char *indexPath = NULL;
+   FILE *script = stdin;
+
+   while ((opt = getopt(argc, argv, "elorsi:c:")) != -1) {
+      if (opt == 'e')
+         stopOnError = 1;
+      else if (opt == 'l')
+         lazy = 1;
+      else if (opt == 'o')
+         overlay = 1;
+      else if (opt == 'r')
+         ram = 1;
+      else if (opt == 's')
+         simulate = 1;
+      else if (opt == 'i')
+         indexPath = optarg;
+      else if (opt == 'c')
+         cmds = optarg;
+      else {
+         usage();
+         return -1;
+      }
+   }
 
-   if (argc != 2) {
-      printf("File name for floppy image expected.\n");
+   if (optind == argc || argc - optind > 2 || (cmds && argc - optind > 1)
+       || (overlay && (ram || simulate || lazy))) {
+      usage();
       return -1;
    }
 
-   if ((dev = fd_mount(argv[1])) == -1) {
+   if ((dev = mountImage(argv[optind], overlay, ram, lazy,
+                         simulate ? &sim : NULL)) == -1) {
       printf("Couldn't mount floppy image.\n");
+      return -1;
+   }
+
+   if (indexPath != NULL && fd_index(indexPath) == -1)
+      fprintf(stderr, "Can't keep an index of this image.\n");
+
+   if (argc - optind == 2 && (script = fopen(argv[optind + 1], "r")) == NULL) {
+      printf("Couldn't open script %s.\n", argv[optind + 1]);
+      fd_unmount(dev);
+      return -1;
+   }
+
+   interactive = cmds == NULL && script == stdin && isatty(fileno(stdin));
+
+   if (interactive)
+      listHelp();
+   else
+      setvbuf(stdout, NULL, _IOFBF, OUTPUT_BUF);
+
+   if (cmds != NULL)
+      failed = runCommands(cmds, stopOnError);
+   else
+      failed = runScript(script, interactive, stopOnError);
+
+   if (script != stdin)
+      fclose(script);
+
+   fd_unmount(dev);
+
+   if (simulate)
+      fprintf(stderr, "Simulated I/O: %lu requests, %lu blocks, %lu seeks, "
+              "%.3f s\n", sim.requests, sim.blocks, sim.seeks,
+              sim.time / 1e6);
+
+   return interactive ? 0 : failed;
+}
+
+
+/* Print a usage message.
+ */
+
+void usage(void) {
+   printf("Usage: shell [-e] [-l] [-o | -r] [-s] [-i index] [-c commands] "
+          "image [script]\n");
+}
+
+
+/* Mount img with an overlay if overlay is true, or on a RAM disk if ram
+ * is true, and lazily if lazy is true.  If sim isn't NULL, the image is
+ * reached through a simulated drive that adds its totals to *sim.
+ *
+ * Returns the device number, or -1 on failure.
+ */
+
+int mountImage(const char *img, int overlay, int ram, int lazy,
+               bdsimstats_t *sim) {
+   blockdev_t lower;
+   blockdev_t disk;
+   int rv;
+
+   if (overlay)
+      return fd_overlay(img);
+   if (!ram && !lazy && sim == NULL)
+      return fd_mount(img);
+
+   if ((ram ? bd_openram(&lower, img) : bd_openfile(&lower, img)) == -1)
+      return -1;
+
+   if (sim == NULL)
+      disk = lower;
+   else if (bd_opensim(&disk, &lower, sim) == -1) {
+      bd_close(&lower);
+      return -1;
    }
 
-   listHelp();
+   if ((rv = lazy ? fd_mountlazy(&disk) : fd_mountdev(&disk)) == -1)
+      bd_close(&disk);
+
+   return rv;
+}
+
+
+/* Run the commands read from in, one per line, until the end of the
+ * input or an exit command.  If interactive is true, a prompt is
+ * printed before each command.  Otherwise, failed commands are reported
+ * on stderr, and if stopOnError is true the first one ends the run.
+ *
+ * Returns 1 if any command failed, otherwise 0.
+ */
+
+int runScript(FILE *in, int interactive, int stopOnError) {
+   char line[COMMAND_LEN];
+   unsigned int lineno = 0;
+   int failed = 0;
+   int result;
+   int c;
+   size_t len;
 
    while (1) {
-      printf("> ");
+      if (interactive)
+         printf("> ");
+
+      if (fgets(line, COMMAND_LEN, in) == NULL) {
+         if (interactive)
+            printf("\n");
+         break;
+      }
+
+      lineno++;
+      len = strlen(line);
+
+      /* Don't run what's left of an overlong line as a command. */
+
+      if (len == COMMAND_LEN - 1 && line[len - 1] != '\n') {
+         while ((c = fgetc(in)) != EOF && c != '\n')
+            ;
+         printf("Command too long.\n");
+         result = CMD_FAILED;
+      }
+      else
+         result = runCommand(line, interactive);
+
+      if (result == CMD_EXIT)
+         break;
 
-      /* Check for an empty input line. */
+      if (result == CMD_FAILED && !interactive) {
+         failed = 1;
+         fprintf(stderr, "shell: line %u failed: %s", lineno, line);
+         if (len > 0 && line[len - 1] != '\n')
+            fprintf(stderr, "\n");
+         if (stopOnError)
+            break;
+      }
+   }
 
-      if (*fgets(command, COMMAND_LEN, stdin) == '\n')
-         continue;
+   return failed;
+}
 
-      /* Tokenize the command read from stdin. */
 
-      tokens[0] = strtok(command, DELIMS);
+/* Run the semicolon separated commands in cmds, as for runScript().
+ * Semicolons within quoted strings don't separate commands.
+ *
+ * Returns 1 if any command failed, otherwise 0.
+ */
 
-      if (strcmp(tokens[0], "appends") == 0) {
-         tokens[1] = strtok(NULL, DELIMS);
-         tokens[2] = getStringArg(command);
-         if (tokens[2] != NULL)
-            strcat(tokens[2], "\n");
+int runCommands(const char *cmds, int stopOnError) {
+   char command[COMMAND_LEN];
+   unsigned int n = 0;
+   unsigned int len;
+   int quoted;
+   int failed = 0;
+   int result;
+   const char *end;
+
+   while (*cmds != '\0') {
+      while (*cmds == ' ')
+         cmds++;
+
+      for (end = cmds, quoted = 0; *end != '\0' && (quoted || *end != ';');
+           end++)
+         if (*end == '\"')
+            quoted = !quoted;
+
+      n++;
+      len = end - cmds;
+      if (len >= COMMAND_LEN) {
+         printf("Command too long.\n");
+         result = CMD_FAILED;
       }
       else {
-         tokens[1] = strtok(NULL, DELIMS);
-         tokens[2] = NULL;
+         memcpy(command, cmds, len);
+         command[len] = '\0';
+         result = runCommand(command, 0);
       }
 
-      if (strcmp(tokens[0], "appendf") == 0)
-         tokens[2] = strtok(NULL, DELIMS);
+      if (result == CMD_EXIT)
+         break;
+
+      if (result == CMD_FAILED) {
+         failed = 1;
+         fprintf(stderr, "shell: command %u failed: %.*s\n", n, (int) len,
+                 cmds);
+         if (stopOnError)
+            break;
+      }
+
+      cmds = *end == ';' ? end + 1 : end;
+   }
+
+   return failed;
+}
+
+
+/* Parse and run the command in line.  If interactive is true, the
+ * command's return value is printed after it runs.
+ *
+ * Returns CMD_EXIT for the exit command, CMD_FAILED if the command is
+ * unrecognized, is missing arguments, or returns -1, and CMD_OK
+ * otherwise.  Blank lines and lines beginning with # are ignored.
+ */
+
+int runCommand(const char *line, int interactive) {
+   char command[COMMAND_LEN];
+   char *tokens[MAX_TOKENS];
+   int rv;
+   int args;
+   unsigned int i;
+
+   /* getStringArg() scans the whole buffer, so clear it first. */
 
-      /* Actual command parsing begins here. */
+   memset(command, 0, COMMAND_LEN);
+   strncpy(command, line, COMMAND_LEN - 1);
 
-      if (strcmp(tokens[0], "help") == 0)
-         listHelp();
-      else if (strcmp(tokens[0], "exit") == 0)
+   /* Tokenize the command. */
+
+   if ((tokens[0] = strtok(command, DELIMS)) == NULL || tokens[0][0] == '#')
+      return CMD_OK;
+
+   if (strcmp(tokens[0], "appends") == 0) {
+      tokens[1] = strtok(NULL, DELIMS);
+      tokens[2] = getStringArg(command);
+      if (tokens[2] != NULL)
+         strcat(tokens[2], "\n");
+   }
+   else {
+      tokens[1] = strtok(NULL, DELIMS);
+      tokens[2] = NULL;
+   }
+
+   if (strcmp(tokens[0], "appendf") == 0
+       || strcmp(tokens[0], "import") == 0
+       || strcmp(tokens[0], "export") == 0
+       || strcmp(tokens[0], "mkdir") == 0
+       || strcmp(tokens[0], "copy") == 0
+       || strcmp(tokens[0], "rename") == 0
+       || strcmp(tokens[0], "truncate") == 0
+       || strcmp(tokens[0], "fallocate") == 0)
+      tokens[2] = strtok(NULL, DELIMS);
+
+   /* Check the command and its arguments. */
+
+   for (i = 0; i < sizeof commands / sizeof commands[0]; i++)
+      if (strcmp(tokens[0], commands[i].name) == 0)
          break;
-      else if (strcmp(tokens[0], "dir") == 0)
-         printf("\nReturn value: %d\n", fd_dir(tokens[1] != NULL));
-      else if (strcmp(tokens[0], "cd") == 0)
-         printf("\nReturn value: %d\n", fd_cd(tokens[1]));
-      else if (strcmp(tokens[0], "type") == 0)
-         printf("\nReturn value: %d\n", fd_type(tokens[1]));
-      else if (strcmp(tokens[0], "del") == 0)
-         printf("\nReturn value: %d\n", fd_del(tokens[1]));
-      else if (strcmp(tokens[0], "creat") == 0)
-         printf("\nReturn value: %d\n", fd_creat(tokens[1]));
-      else if (strcmp(tokens[0], "appends") == 0)
-         printf("\nReturn value: %d\n", fd_append(tokens[1], tokens[2],
-                                                  strlen(tokens[2])));
-      else if (strcmp(tokens[0], "appendf") == 0)
-         printf("\nReturn value: %d\n", appendf(tokens[1], tokens[2]));
-      else
-         printf("Unrecognized command: %s\n", tokens[0]);
+
+   if (i == sizeof commands / sizeof commands[0]) {
+      printf("Unrecognized command: %s\n", tokens[0]);
+      return CMD_FAILED;
    }
 
-   fd_unmount(dev);
+   args = (tokens[1] != NULL) + (tokens[1] != NULL && tokens[2] != NULL);
+   if (args < commands[i].args) {
+      printf("Missing argument for %s.\n", tokens[0]);
+      return CMD_FAILED;
+   }
+
+   /* Actual command parsing begins here. */
+
+   if (strcmp(tokens[0], "help") == 0) {
+      listHelp();
+      return CMD_OK;
+   }
+   else if (strcmp(tokens[0], "exit") == 0)
+      return CMD_EXIT;
+   else if (strcmp(tokens[0], "dir") == 0)
+      rv = fd_dir(tokens[1] != NULL);
+   else if (strcmp(tokens[0], "ls") == 0)
+      rv = ls(tokens[1]);
+   else if (strcmp(tokens[0], "cd") == 0)
+      rv = fd_cd(tokens[1]);
+   else if (strcmp(tokens[0], "type") == 0)
+      rv = typeFile(tokens[1]);
+   else if (strcmp(tokens[0], "del") == 0)
+      rv = fd_del(tokens[1]);
+   else if (strcmp(tokens[0], "creat") == 0)
+      rv = fd_creat(tokens[1]);
+   else if (strcmp(tokens[0], "appends") == 0)
+      rv = fd_append(tokens[1], tokens[2], strlen(tokens[2]));
+   else if (strcmp(tokens[0], "appendf") == 0)
+      rv = fd_import(tokens[2], tokens[1]);
+   else if (strcmp(tokens[0], "import") == 0)
+      rv = fd_import(tokens[1], tokens[2]);
+   else if (strcmp(tokens[0], "export") == 0)
+      rv = fd_export(tokens[1], tokens[2]);
+   else if (strcmp(tokens[0], "du") == 0)
+      rv = du(tokens[1]);
+   else if (strcmp(tokens[0], "df") == 0)
+      rv = df();
+   else if (strcmp(tokens[0], "mkdir") == 0)
+      rv = fd_mkdir(tokens[1], tokens[2] != NULL ? atoi(tokens[2]) : 0);
+   else if (strcmp(tokens[0], "rmdir") == 0)
+      rv = fd_rmdir(tokens[1]);
+   else if (strcmp(tokens[0], "copy") == 0)
+      rv = fd_copy(tokens[1], tokens[2]);
+   else if (strcmp(tokens[0], "commit") == 0)
+      rv = fd_commit(dev);
+   else if (strcmp(tokens[0], "discard") == 0)
+      rv = fd_discard(dev);
+   else if (strcmp(tokens[0], "truncate") == 0)
+      rv = fd_truncate(tokens[1], strtoul(tokens[2], NULL, 0));
+   else if (strcmp(tokens[0], "fallocate") == 0)
+      rv = fd_fallocate(tokens[1], strtoul(tokens[2], NULL, 0));
+   else if (strcmp(tokens[0], "rename") == 0)
+      rv = fd_rename(tokens[1], tokens[2]);
+   else if (strcmp(tokens[0], "find") == 0)
+      rv = fd_walk(tokens[1], FD_DIR_HIDDEN, findEntry, tokens[1]);
+   else
+      rv = fd_walk(tokens[1], FD_DIR_HIDDEN | FD_SORT_NAME, treeEntry, NULL);
+
+   if (interactive)
+      printf("\nReturn value: %d\n", rv);
+
+   return rv == -1 ? CMD_FAILED : CMD_OK;
+}
+
+
+/* Type file on stdout.  A single file is sent straight from the image
+ * with fd_sendfile(), after whatever output is buffered; a pattern is
+ * typed by fd_type().
+ *
+ * Returns the number of bytes typed, or -1.
+ */
+
+int typeFile(const char *file) {
+   if (strpbrk(file, "*?") != NULL)
+      return fd_type(file);
+
+   fflush(stdout);
+   return fd_sendfile(file, STDOUT_FILENO);
+}
+
+
+/* List the current working directory in a compact, machine readable
+ * form.  options, which may be NULL, holds the option letters described
+ * by listHelp(), optionally preceded by a /.
+ *
+ * Returns the number of entries listed, or -1 for an unknown option.
+ */
+
+int ls(const char *options) {
+   unsigned int flags = FD_DIR_NODOTS | FD_DIR_NOLABEL;
+
+   if (options != NULL && *options == '/')
+      options++;
+
+   for (; options != NULL && *options != '\0'; options++) {
+      switch (*options) {
+      case 'h': flags |= FD_DIR_HIDDEN; break;
+      case 'f': flags |= FD_DIR_NODIRS; break;
+      case 'd': flags |= FD_DIR_NOFILES; break;
+      case 'n': flags = (flags & ~FD_SORT_MASK) | FD_SORT_NAME; break;
+      case 's': flags = (flags & ~FD_SORT_MASK) | FD_SORT_SIZE; break;
+      case 't': flags = (flags & ~FD_SORT_MASK) | FD_SORT_TIME; break;
+      case 'r': flags |= FD_SORT_REVERSE; break;
+      default:
+         printf("Unknown ls option: %c\n", *options);
+         return -1;
+      }
+   }
+
+   return fd_iterdir(NULL, flags, lsEntry, NULL);
+}
+
+
+/* fd_iterdir() callback for ls().  The long file name, if any, is the
+ * last column.
+ */
+
+int lsEntry(const struct fd_dirent *entry, void *arg) {
+   const struct fd_time *t = &entry->written;
+
+   (void) arg;
+   printf("%s\t%02x\t%u\t%u\t%04u-%02u-%02uT%02u:%02u:%02u\t%s\n",
+          entry->name, entry->attributes, entry->size, entry->cluster,
+          t->year, t->month, t->day, t->hour, t->minute, t->second,
+          entry->longName);
+   return 0;
+}
+
+
+/* Print the totals for the tree below dir, or below the current working
+ * directory if dir is NULL: bytes, files and directories, tab
+ * separated, then the directory.
+ *
+ * Returns 0, or -1 if the totals couldn't be found.
+ */
+
+int du(const char *dir) {
+   struct fd_usage usage;
+
+   if (fd_du(dir, &usage) == -1)
+      return -1;
+
+   printf("%llu\t%u\t%u\t%s\n", usage.bytes, usage.files, usage.dirs,
+          dir != NULL ? dir : ".");
+   return 0;
+}
+
+
+/* Print the volume's statistics: data clusters, free, bad and the
+ * longest run of free clusters, then the cluster size in bytes and the
+ * files and directories on the volume, tab separated.
+ *
+ * Returns 0, or -1 if the statistics couldn't be found.
+ */
+
+int df(void) {
+   struct fd_statfs st;
+
+   if (fd_statfs(&st) == -1)
+      return -1;
+
+   printf("%u\t%u\t%u\t%u\t%u\t%u\t%u\n", st.clusters, st.freeClusters,
+          st.badClusters, st.largestFree, st.clusterBytes, st.files,
+          st.dirs);
    return 0;
 }
 
 
+/* fd_walk() callback for find.  arg is the directory being walked, or
+ * NULL for the current working directory; paths are printed below it.
+ */
+
+int findEntry(const char *path, const struct fd_dirent *entry,
+              unsigned int depth, void *arg) {
+   const char *dir = arg;
+
+   (void) entry;
+   (void) depth;
+   if (dir == NULL)
+      printf("%s\n", path);
+   else
+      printf("%s%s%s\n", dir, strchr("/\\", dir[strlen(dir) - 1]) ? "" : "/",
+             path);
+   return FD_WALK_CONTINUE;
+}
+
+
+/* fd_walk() callback for tree.  Entries are indented by depth, long
+ * file names are shown in place of short ones, and directory names end
+ * in a /.
+ */
+
+int treeEntry(const char *path, const struct fd_dirent *entry,
+              unsigned int depth, void *arg) {
+   (void) path;
+   (void) arg;
+   printf("%*s%s%s\n", (int) depth * 3, "",
+          entry->longName[0] != '\0' ? entry->longName : entry->name,
+          entry->attributes & SUBDIRECTORY ? "/" : "");
+   return FD_WALK_CONTINUE;
+}
+
+
 /* List the commands available.  Maybe I should have named this
  * listCommands()?
  */
@@ -110,38 +601,65 @@ void listHelp(void) {
    printf("\n   exit\n");
    printf("\n   dir [/h]\n");
    printf("      /h --- list hidden files.\n");
+   printf("\n   ls [/options]\n");
+   printf("      One tab separated line per entry: name, attributes, "
+          "size,\n      first cluster and last write time.  Options:\n");
+   printf("      h --- list hidden files.\n");
+   printf("      f, d --- list only files, only directories.\n");
+   printf("      n, s, t --- sort by name, size, time.\n");
+   printf("      r --- reverse the sort.\n");
    printf("\n   cd directory\n");
    printf("\n   type file\n");
    printf("\n   del file\n");
+   printf("      For type and del, file may contain the wildcards * and "
+          "?,\n      for example *.TMP or FILE?.TXT.\n");
    printf("\n   creat file\n");
+   printf("\n   mkdir directory [entries]\n");
+   printf("      entries is the number of entries expected; space for "
+          "them is\n      allocated up front.\n");
+   printf("\n   rmdir directory\n");
+   printf("      The directory must be empty.\n");
+   printf("\n   copy srcFile destFile\n");
+   printf("      Copy srcFile within the image.  If destFile is a "
+          "directory,\n      the copy is made there with srcFile's "
+          "name.\n");
+   printf("\n   rename oldName newName\n");
+   printf("      Rename or move a file or directory.  If newName is a "
+          "directory,\n      it is moved there with its name.\n");
    printf("\n   appends file stringToAppend\n");
    printf("      stringToAppend should be delimited by quotes "
           "and not contain quotes.\n");
    printf("      A new line character will be appended to the string.\n");
+   printf("\n   truncate file size\n");
+   printf("      Cut file to size bytes.\n");
+   printf("\n   fallocate file size\n");
+   printf("      Reserve space for file to grow to size bytes.\n");
+   printf("\n   commit\n");
+   printf("      Write the changes made under -o to the image.\n");
+   printf("\n   discard\n");
+   printf("      Drop the changes made under -o since the last commit.\n");
    printf("\n   appendf destFile srcFile\n");
-   printf("      srcFile should exist in the host file system\n\n");
-}
-
-
-/* Handle appending a file in the host file system to a file in the
- * floppy image.
- */
-
-int appendf(const char *destFile, const char *srcFile) {
-   FILE *src;
-   char buffer[FILE_SIZE_LIMIT];
-   int count = 0;
-
-   if ((src = fopen(srcFile, "r")) == NULL)
-       return 0;
-
-   /* Read the source file into a buffer. */
-
-   while (count < FILE_SIZE_LIMIT && (buffer[count] = fgetc(src)) != EOF)
-      count++;
-
-   fclose(src);
-   return fd_append(destFile, buffer, count);
+   printf("      srcFile should exist in the host file system\n");
+   printf("\n   import srcFile destFile\n");
+   printf("      Copy srcFile, in the host file system, to destFile.\n");
+   printf("      destFile is created if it doesn't exist, otherwise "
+          "srcFile is appended.\n");
+   printf("\n   export directory hostDir\n");
+   printf("      Copy directory and everything below it to hostDir, "
+          "in the host file system.\n");
+   printf("      Use / for the root directory.\n");
+   printf("\n   du [directory]\n");
+   printf("      Print the bytes, files and sub-directories below "
+          "directory.\n");
+   printf("\n   df\n");
+   printf("      Print the volume's clusters, free clusters, bad "
+          "clusters,\n      longest free extent in clusters, cluster "
+          "size, files and\n      directories.\n");
+   printf("\n   find [directory]\n");
+   printf("      Print the path of everything below directory.\n");
+   printf("\n   tree [directory]\n");
+   printf("      Print the tree below directory, indented.\n");
+   printf("\n   The directory defaults to the current one.\n\n");
 }
 
 
@@ -0,0 +1,640 @@
+/***********************************************************************
+ * vecops.c
+ *
+ * Vectorized kernels for the file system layer.  See vecops.h for
+ * documentation.
+ *
+ * The x86 kernels are compiled with per-function target attributes, so
+ * the rest of the program doesn't need to be built for SSSE3 or AVX2.
+ * The kernels are only called after the CPU has been checked for
+ * support.
+ ***********************************************************************/
+
+
+#include <stddef.h>
+#include <string.h>
+#include "vecops.h"
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VEC_X86
+#include <immintrin.h>
+#endif
+
+
+/* A set of kernels for one implementation level. */
+typedef struct kernels_t
+{
+   int level;
+   void (*unpack12)(uint16_t *dst, const uint8_t *src, unsigned int n);
+   void (*pack12)(uint8_t *dst, const uint16_t *src, unsigned int n);
+   unsigned int (*findzero)(const uint16_t *fat, unsigned int i,
+                            unsigned int end);
+   unsigned int (*findnonzero)(const uint16_t *fat, unsigned int i,
+                               unsigned int end);
+   void (*scandir)(const uint8_t *block, const uint8_t *name,
+                   dirmasks_t *masks);
+} kernels_t;
+
+
+/* Offsets of the fields of a directory entry examined by scandir. */
+#define DIRENT_NAME_LEN 11
+#define DIRENT_ATTR 11
+#define DIRENT_DELETED 0xe5
+#define ATTR_LFN 0x0f
+#define ATTR_HIDDEN 0x02
+
+
+/* Prototypes for private kernels. */
+static void unpack12Scalar(uint16_t *dst, const uint8_t *src, unsigned int n);
+static void pack12Scalar(uint8_t *dst, const uint16_t *src, unsigned int n);
+static unsigned int findzeroScalar(const uint16_t *fat, unsigned int i,
+                                   unsigned int end);
+static unsigned int findnonzeroScalar(const uint16_t *fat, unsigned int i,
+                                      unsigned int end);
+static void scandirScalar(const uint8_t *block, const uint8_t *name,
+                          dirmasks_t *masks);
+#ifdef VEC_X86
+static void unpack12Ssse3(uint16_t *dst, const uint8_t *src, unsigned int n);
+static void pack12Ssse3(uint8_t *dst, const uint16_t *src, unsigned int n);
+static unsigned int findzeroSse2(const uint16_t *fat, unsigned int i,
+                                 unsigned int end);
+static unsigned int findnonzeroSse2(const uint16_t *fat, unsigned int i,
+                                    unsigned int end);
+static void scandirSse2(const uint8_t *block, const uint8_t *name,
+                        dirmasks_t *masks);
+static void unpack12Avx2(uint16_t *dst, const uint8_t *src, unsigned int n);
+static void pack12Avx2(uint8_t *dst, const uint16_t *src, unsigned int n);
+static unsigned int findzeroAvx2(const uint16_t *fat, unsigned int i,
+                                 unsigned int end);
+static unsigned int findnonzeroAvx2(const uint16_t *fat, unsigned int i,
+                                    unsigned int end);
+static void scandirAvx2(const uint8_t *block, const uint8_t *name,
+                        dirmasks_t *masks);
+static __m256i load2entries(const uint8_t *entry);
+#endif
+static const kernels_t *kernels(void);
+
+
+static const kernels_t scalarKernels =
+   { VEC_SCALAR, unpack12Scalar, pack12Scalar, findzeroScalar,
+     findnonzeroScalar, scandirScalar };
+#ifdef VEC_X86
+static const kernels_t ssse3Kernels =
+   { VEC_SSSE3, unpack12Ssse3, pack12Ssse3, findzeroSse2,
+     findnonzeroSse2, scandirSse2 };
+static const kernels_t avx2Kernels =
+   { VEC_AVX2, unpack12Avx2, pack12Avx2, findzeroAvx2, findnonzeroAvx2,
+     scandirAvx2 };
+#endif
+
+
+/* The selected kernels; NULL until first use. */
+static const kernels_t *g_kernels = NULL;
+
+
+int vec_setlevel(int level)
+{
+#ifdef VEC_X86
+   __builtin_cpu_init();
+
+   if (level >= VEC_AVX2 && __builtin_cpu_supports("avx2"))
+      g_kernels = &avx2Kernels;
+   else if (level >= VEC_SSSE3 && __builtin_cpu_supports("ssse3"))
+      g_kernels = &ssse3Kernels;
+   else
+      g_kernels = &scalarKernels;
+#else
+   (void) level;
+   g_kernels = &scalarKernels;
+#endif
+
+   return g_kernels->level;
+}
+
+
+const char *vec_levelname(int level)
+{
+   switch (level)
+   {
+   case VEC_AVX2:
+      return "avx2";
+   case VEC_SSSE3:
+      return "ssse3";
+   default:
+      return "scalar";
+   }
+}
+
+
+void vec_unpack12(uint16_t *dst, const uint8_t *src, unsigned int n)
+{
+   kernels()->unpack12(dst, src, n);
+}
+
+
+void vec_pack12(uint8_t *dst, const uint16_t *src, unsigned int n)
+{
+   kernels()->pack12(dst, src, n);
+}
+
+
+unsigned int vec_findfree(const uint16_t *fat, unsigned int start,
+                          unsigned int end, unsigned int run)
+{
+   const kernels_t *k = kernels();
+   unsigned int i = start;
+   unsigned int used;
+
+   while (i < end)
+   {
+      /* Find a candidate start, then look for a used entry within the
+       * candidate run.  If there is one, no run can start before the
+       * entry following it.
+       */
+      i = k->findzero(fat, i, end);
+      if (i >= end || end - i < run)
+         return end;
+
+      if (run == 1 || (used = k->findnonzero(fat, i + 1, i + run)) == i + run)
+         return i;
+
+      i = used + 1;
+   }
+
+   return end;
+}
+
+
+void vec_scandir(const uint8_t *block, const uint8_t *name,
+                 dirmasks_t *masks)
+{
+   kernels()->scandir(block, name, masks);
+}
+
+
+/* Return the selected kernels, selecting the best supported ones on
+ * first use.
+ */
+static const kernels_t *kernels(void)
+{
+   if (g_kernels == NULL)
+      vec_setlevel(VEC_AVX2);
+
+   return g_kernels;
+}
+
+
+/* Scalar kernels.  These also finish the ragged ends of the vector
+ * kernels' ranges.
+ */
+
+static void unpack12Scalar(uint16_t *dst, const uint8_t *src, unsigned int n)
+{
+   unsigned int i;
+
+   /* Every three bytes hold two entries. */
+   for (i = 0; i + 1 < n; i += 2, src += 3)
+   {
+      dst[i] = src[0] | ((src[1] & 0x0f) << 8);
+      dst[i + 1] = (src[1] >> 4) | (src[2] << 4);
+   }
+
+   if (i < n)
+      dst[i] = src[0] | ((src[1] & 0x0f) << 8);
+}
+
+
+static void pack12Scalar(uint8_t *dst, const uint16_t *src, unsigned int n)
+{
+   unsigned int i;
+
+   for (i = 0; i < n; i += 2, dst += 3)
+   {
+      dst[0] = (uint8_t) (src[i] & 0xff);
+      dst[1] = (uint8_t) (((src[i] >> 8) & 0x0f) | ((src[i + 1] << 4) & 0xf0));
+      dst[2] = (uint8_t) ((src[i + 1] >> 4) & 0xff);
+   }
+}
+
+
+static unsigned int findzeroScalar(const uint16_t *fat, unsigned int i,
+                                   unsigned int end)
+{
+   while (i < end && fat[i] != 0)
+      i++;
+
+   return i;
+}
+
+
+static unsigned int findnonzeroScalar(const uint16_t *fat, unsigned int i,
+                                      unsigned int end)
+{
+   while (i < end && fat[i] == 0)
+      i++;
+
+   return i;
+}
+
+
+static void scandirScalar(const uint8_t *block, const uint8_t *name,
+                          dirmasks_t *masks)
+{
+   unsigned int i;
+   uint16_t bit;
+
+   memset(masks, 0, sizeof(dirmasks_t));
+
+   for (i = 0, bit = 1; i < VEC_DIR_ENTRIES; i++, bit <<= 1,
+           block += VEC_DIRENT_SIZE)
+   {
+      if (block[0] == 0x00)
+         masks->end |= bit;
+      if (block[0] == 0x00 || block[0] == DIRENT_DELETED)
+         masks->free |= bit;
+      if ((block[DIRENT_ATTR] & ATTR_LFN) == ATTR_LFN)
+         masks->lfn |= bit;
+      if (block[DIRENT_ATTR] & ATTR_HIDDEN)
+         masks->hidden |= bit;
+      if (name != NULL && memcmp(block, name, DIRENT_NAME_LEN) == 0)
+         masks->match |= bit;
+   }
+}
+
+
+#ifdef VEC_X86
+
+/* SSSE3 kernels.  Unpacking gathers the two bytes holding each entry
+ * into a 16-bit lane with one shuffle; even entries are then the low 12
+ * bits of their lane and odd entries the high 12 bits.  Packing does
+ * the reverse with a 32-bit lane per entry pair.
+ */
+
+__attribute__ ((target("ssse3")))
+static void unpack12Ssse3(uint16_t *dst, const uint8_t *src, unsigned int n)
+{
+   unsigned int i;
+   const __m128i gather = _mm_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+                                        6, 7, 7, 8, 9, 10, 10, 11);
+   const __m128i evenMask = _mm_set1_epi32(0x00000fff);
+   const __m128i oddMask = _mm_set1_epi32((int) 0xffff0000);
+   __m128i v;
+
+   /* Each step consumes 12 bytes but loads 16. */
+   for (i = 0; i + 12 <= n; i += 8)
+   {
+      v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)
+                                           (src + 3 * i / 2)), gather);
+      v = _mm_or_si128(_mm_and_si128(v, evenMask),
+                       _mm_and_si128(_mm_srli_epi16(v, 4), oddMask));
+      _mm_storeu_si128((__m128i *) (dst + i), v);
+   }
+
+   unpack12Scalar(dst + i, src + 3 * i / 2, n - i);
+}
+
+
+__attribute__ ((target("ssse3")))
+static void pack12Ssse3(uint8_t *dst, const uint16_t *src, unsigned int n)
+{
+   unsigned int i;
+   const __m128i compact = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+                                         12, 13, 14, -1, -1, -1, -1);
+   const __m128i evenMask = _mm_set1_epi32(0x00000fff);
+   const __m128i oddMask = _mm_set1_epi32(0x0fff0000);
+   __m128i v;
+
+   /* Each step produces 12 bytes but stores 16; the extra bytes are
+    * overwritten by the following step or the scalar tail.
+    */
+   for (i = 0; i + 12 <= n; i += 8)
+   {
+      v = _mm_loadu_si128((const __m128i *) (src + i));
+      v = _mm_or_si128(_mm_and_si128(v, evenMask),
+                       _mm_srli_epi32(_mm_and_si128(v, oddMask), 4));
+      _mm_storeu_si128((__m128i *) (dst + 3 * i / 2),
+                       _mm_shuffle_epi8(v, compact));
+   }
+
+   pack12Scalar(dst + 3 * i / 2, src + i, n - i);
+}
+
+
+__attribute__ ((target("sse2")))
+static unsigned int findzeroSse2(const uint16_t *fat, unsigned int i,
+                                 unsigned int end)
+{
+   const __m128i zero = _mm_setzero_si128();
+   unsigned int mask;
+
+   for (; i + 8 <= end; i += 8)
+   {
+      mask = _mm_movemask_epi8(_mm_cmpeq_epi16(
+         _mm_loadu_si128((const __m128i *) (fat + i)), zero));
+      if (mask != 0)
+         return i + __builtin_ctz(mask) / 2;
+   }
+
+   return findzeroScalar(fat, i, end);
+}
+
+
+__attribute__ ((target("sse2")))
+static unsigned int findnonzeroSse2(const uint16_t *fat, unsigned int i,
+                                    unsigned int end)
+{
+   const __m128i zero = _mm_setzero_si128();
+   unsigned int mask;
+
+   for (; i + 8 <= end; i += 8)
+   {
+      mask = 0xffff & ~_mm_movemask_epi8(_mm_cmpeq_epi16(
+         _mm_loadu_si128((const __m128i *) (fat + i)), zero));
+      if (mask != 0)
+         return i + __builtin_ctz(mask) / 2;
+   }
+
+   return findnonzeroScalar(fat, i, end);
+}
+
+
+/* Load the first 16 bytes of four entries and transpose them, so
+ * that w0, w1 and w2 hold the first, second and third 32-bit words of
+ * the four entries.  The name and the attribute byte lie in these
+ * words, so each field is then tested for four entries at once.
+ */
+__attribute__ ((target("sse2")))
+static void scandirSse2(const uint8_t *block, const uint8_t *name,
+                        dirmasks_t *masks)
+{
+   unsigned int i;
+   unsigned int end = 0;
+   unsigned int free = 0;
+   unsigned int lfn = 0;
+   unsigned int hid = 0;
+   unsigned int match = 0;
+   uint32_t words[3] = { 0, 0, 0 };
+   const __m128i byteMask = _mm_set1_epi32(0xff);
+   const __m128i nameMask = _mm_set1_epi32(0x00ffffff);
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i deleted = _mm_set1_epi32(DIRENT_DELETED);
+   const __m128i lfnBits = _mm_set1_epi32(ATTR_LFN);
+   const __m128i hiddenBit = _mm_set1_epi32(ATTR_HIDDEN);
+   __m128i name0;
+   __m128i name1;
+   __m128i name2;
+   __m128i r0, r1, r2, r3;
+   __m128i t0, t1, t2, t3;
+   __m128i w0, w1, w2;
+   __m128i first;
+   __m128i attr;
+   __m128i same;
+
+   if (name != NULL)
+      memcpy(words, name, DIRENT_NAME_LEN);
+   name0 = _mm_set1_epi32((int) words[0]);
+   name1 = _mm_set1_epi32((int) words[1]);
+   name2 = _mm_set1_epi32((int) words[2]);
+
+   for (i = 0; i < VEC_DIR_ENTRIES; i += 4, block += 4 * VEC_DIRENT_SIZE)
+   {
+      r0 = _mm_loadu_si128((const __m128i *) block);
+      r1 = _mm_loadu_si128((const __m128i *) (block + VEC_DIRENT_SIZE));
+      r2 = _mm_loadu_si128((const __m128i *) (block + 2 * VEC_DIRENT_SIZE));
+      r3 = _mm_loadu_si128((const __m128i *) (block + 3 * VEC_DIRENT_SIZE));
+
+      t0 = _mm_unpacklo_epi32(r0, r1);
+      t1 = _mm_unpacklo_epi32(r2, r3);
+      t2 = _mm_unpackhi_epi32(r0, r1);
+      t3 = _mm_unpackhi_epi32(r2, r3);
+      w0 = _mm_unpacklo_epi64(t0, t1);
+      w1 = _mm_unpackhi_epi64(t0, t1);
+      w2 = _mm_unpacklo_epi64(t2, t3);
+
+      first = _mm_and_si128(w0, byteMask);
+      attr = _mm_srli_epi32(w2, 24);
+
+      end |= _mm_movemask_ps(_mm_castsi128_ps(
+         _mm_cmpeq_epi32(first, zero))) << i;
+      free |= _mm_movemask_ps(_mm_castsi128_ps(
+         _mm_cmpeq_epi32(first, deleted))) << i;
+      lfn |= _mm_movemask_ps(_mm_castsi128_ps(
+         _mm_cmpeq_epi32(_mm_and_si128(attr, lfnBits), lfnBits))) << i;
+      hid |= _mm_movemask_ps(_mm_castsi128_ps(
+         _mm_cmpeq_epi32(_mm_and_si128(attr, hiddenBit), hiddenBit))) << i;
+
+      if (name != NULL)
+      {
+         same = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi32(w0, name0),
+                          _mm_cmpeq_epi32(w1, name1)),
+            _mm_cmpeq_epi32(_mm_and_si128(w2, nameMask), name2));
+         match |= _mm_movemask_ps(_mm_castsi128_ps(same)) << i;
+      }
+   }
+
+   masks->end = end;
+   masks->free = free | end;
+   masks->lfn = lfn;
+   masks->hidden = hid;
+   masks->match = match;
+}
+
+
+/* AVX2 kernels.  Shuffles work within 128-bit lanes, so each lane
+ * handles its own 12-byte group exactly as in the SSSE3 kernels.
+ */
+
+__attribute__ ((target("avx2")))
+static void unpack12Avx2(uint16_t *dst, const uint8_t *src, unsigned int n)
+{
+   unsigned int i;
+   const __m256i gather = _mm256_setr_epi8(0, 1, 1, 2, 3, 4, 4, 5,
+                                           6, 7, 7, 8, 9, 10, 10, 11,
+                                           0, 1, 1, 2, 3, 4, 4, 5,
+                                           6, 7, 7, 8, 9, 10, 10, 11);
+   const __m256i evenMask = _mm256_set1_epi32(0x00000fff);
+   const __m256i oddMask = _mm256_set1_epi32((int) 0xffff0000);
+   const uint8_t *in;
+   __m256i v;
+
+   /* Each step consumes 24 bytes but loads 28. */
+   for (i = 0; i + 20 <= n; i += 16)
+   {
+      in = src + 3 * i / 2;
+      v = _mm256_inserti128_si256(
+         _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) in)),
+         _mm_loadu_si128((const __m128i *) (in + 12)), 1);
+      v = _mm256_shuffle_epi8(v, gather);
+      v = _mm256_or_si256(_mm256_and_si256(v, evenMask),
+                          _mm256_and_si256(_mm256_srli_epi16(v, 4), oddMask));
+      _mm256_storeu_si256((__m256i *) (dst + i), v);
+   }
+
+   unpack12Scalar(dst + i, src + 3 * i / 2, n - i);
+}
+
+
+__attribute__ ((target("avx2")))
+static void pack12Avx2(uint8_t *dst, const uint16_t *src, unsigned int n)
+{
+   unsigned int i;
+   const __m256i compact = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10,
+                                            12, 13, 14, -1, -1, -1, -1,
+                                            0, 1, 2, 4, 5, 6, 8, 9, 10,
+                                            12, 13, 14, -1, -1, -1, -1);
+   const __m256i evenMask = _mm256_set1_epi32(0x00000fff);
+   const __m256i oddMask = _mm256_set1_epi32(0x0fff0000);
+   uint8_t *out;
+   __m256i v;
+
+   /* Each step produces 24 bytes but stores 28; see pack12Ssse3(). */
+   for (i = 0; i + 20 <= n; i += 16)
+   {
+      out = dst + 3 * i / 2;
+      v = _mm256_loadu_si256((const __m256i *) (src + i));
+      v = _mm256_or_si256(_mm256_and_si256(v, evenMask),
+                          _mm256_srli_epi32(_mm256_and_si256(v, oddMask), 4));
+      v = _mm256_shuffle_epi8(v, compact);
+      _mm_storeu_si128((__m128i *) out, _mm256_castsi256_si128(v));
+      _mm_storeu_si128((__m128i *) (out + 12),
+                       _mm256_extracti128_si256(v, 1));
+   }
+
+   pack12Scalar(dst + 3 * i / 2, src + i, n - i);
+}
+
+
+__attribute__ ((target("avx2")))
+static unsigned int findzeroAvx2(const uint16_t *fat, unsigned int i,
+                                 unsigned int end)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   unsigned int mask;
+
+   for (; i + 16 <= end; i += 16)
+   {
+      mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+         _mm256_loadu_si256((const __m256i *) (fat + i)), zero));
+      if (mask != 0)
+         return i + __builtin_ctz(mask) / 2;
+   }
+
+   return findzeroSse2(fat, i, end);
+}
+
+
+__attribute__ ((target("avx2")))
+static unsigned int findnonzeroAvx2(const uint16_t *fat, unsigned int i,
+                                    unsigned int end)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   unsigned int mask;
+
+   for (; i + 16 <= end; i += 16)
+   {
+      mask = ~(unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+         _mm256_loadu_si256((const __m256i *) (fat + i)), zero));
+      if (mask != 0)
+         return i + __builtin_ctz(mask) / 2;
+   }
+
+   return findnonzeroSse2(fat, i, end);
+}
+
+/* Load the first 16 bytes of the entry at entry into the low lane, and
+ * of the entry four entries later into the high lane.
+ */
+__attribute__ ((target("avx2")))
+static inline __m256i load2entries(const uint8_t *entry)
+{
+   return _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) entry)),
+      _mm_loadu_si128((const __m128i *) (entry + 4 * VEC_DIRENT_SIZE)), 1);
+}
+
+
+/* The same transpose as scandirSse2(), with entries i through i + 3
+ * in the low lanes and entries i + 4 through i + 7 in the high lanes,
+ * so each vector compare tests a field of eight entries.
+ */
+__attribute__ ((target("avx2")))
+static void scandirAvx2(const uint8_t *block, const uint8_t *name,
+                        dirmasks_t *masks)
+{
+   unsigned int i;
+   unsigned int end = 0;
+   unsigned int free = 0;
+   unsigned int lfn = 0;
+   unsigned int hid = 0;
+   unsigned int match = 0;
+   uint32_t words[3] = { 0, 0, 0 };
+   const __m256i byteMask = _mm256_set1_epi32(0xff);
+   const __m256i nameMask = _mm256_set1_epi32(0x00ffffff);
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i deleted = _mm256_set1_epi32(DIRENT_DELETED);
+   const __m256i lfnBits = _mm256_set1_epi32(ATTR_LFN);
+   const __m256i hiddenBit = _mm256_set1_epi32(ATTR_HIDDEN);
+   __m256i name0;
+   __m256i name1;
+   __m256i name2;
+   __m256i r0, r1, r2, r3;
+   __m256i t0, t1, t2, t3;
+   __m256i w0, w1, w2;
+   __m256i first;
+   __m256i attr;
+   __m256i same;
+
+   if (name != NULL)
+      memcpy(words, name, DIRENT_NAME_LEN);
+   name0 = _mm256_set1_epi32((int) words[0]);
+   name1 = _mm256_set1_epi32((int) words[1]);
+   name2 = _mm256_set1_epi32((int) words[2]);
+
+   for (i = 0; i < VEC_DIR_ENTRIES; i += 8, block += 8 * VEC_DIRENT_SIZE)
+   {
+      r0 = load2entries(block);
+      r1 = load2entries(block + VEC_DIRENT_SIZE);
+      r2 = load2entries(block + 2 * VEC_DIRENT_SIZE);
+      r3 = load2entries(block + 3 * VEC_DIRENT_SIZE);
+
+      t0 = _mm256_unpacklo_epi32(r0, r1);
+      t1 = _mm256_unpacklo_epi32(r2, r3);
+      t2 = _mm256_unpackhi_epi32(r0, r1);
+      t3 = _mm256_unpackhi_epi32(r2, r3);
+      w0 = _mm256_unpacklo_epi64(t0, t1);
+      w1 = _mm256_unpackhi_epi64(t0, t1);
+      w2 = _mm256_unpacklo_epi64(t2, t3);
+
+      first = _mm256_and_si256(w0, byteMask);
+      attr = _mm256_srli_epi32(w2, 24);
+
+      end |= _mm256_movemask_ps(_mm256_castsi256_ps(
+         _mm256_cmpeq_epi32(first, zero))) << i;
+      free |= _mm256_movemask_ps(_mm256_castsi256_ps(
+         _mm256_cmpeq_epi32(first, deleted))) << i;
+      lfn |= _mm256_movemask_ps(_mm256_castsi256_ps(
+         _mm256_cmpeq_epi32(_mm256_and_si256(attr, lfnBits), lfnBits))) << i;
+      hid |= _mm256_movemask_ps(_mm256_castsi256_ps(
+         _mm256_cmpeq_epi32(_mm256_and_si256(attr, hiddenBit), hiddenBit)))
+         << i;
+
+      if (name != NULL)
+      {
+         same = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi32(w0, name0),
+                             _mm256_cmpeq_epi32(w1, name1)),
+            _mm256_cmpeq_epi32(_mm256_and_si256(w2, nameMask), name2));
+         match |= _mm256_movemask_ps(_mm256_castsi256_ps(same)) << i;
+      }
+   }
+
+   masks->end = end;
+   masks->free = free | end;
+   masks->lfn = lfn;
+   masks->hidden = hid;
+   masks->match = match;
+}
+
+#endif
@@ -0,0 +1,88 @@
+/***********************************************************************
+ * vecops.h
+ *
+ * Vectorized kernels for the file system layer.  Each kernel has a
+ * portable scalar version and, on x86, SSSE3 and AVX2 versions.  The
+ * best version the CPU supports is selected at run time.
+ ***********************************************************************/
+
+
+#ifndef __VECOPS_H
+#define __VECOPS_H
+
+
+#include <stdint.h>
+
+
+/* Kernel implementation levels, in increasing order of preference. */
+#define VEC_SCALAR 0
+#define VEC_SSSE3 1
+#define VEC_AVX2 2
+
+
+/* Select the kernels for the given level.  If the CPU doesn't support
+ * level, the best supported level below it is used instead.  The
+ * kernels select the best supported level on first use, so calling this
+ * function is only necessary to override that choice (for example, to
+ * benchmark the scalar kernels).
+ *
+ * Returns the level actually selected.
+ */
+int vec_setlevel(int level);
+
+
+/* Returns the name of a kernel level, for diagnostics. */
+const char *vec_levelname(int level);
+
+
+/* Unpack n 12-bit FAT entries from the packed FAT bytes at src into the
+ * 16-bit array dst.  src must hold at least (3 * n + 1) / 2 bytes.
+ */
+void vec_unpack12(uint16_t *dst, const uint8_t *src, unsigned int n);
+
+
+/* Pack n 16-bit FAT entries at src into 12-bit entries at dst.  n must
+ * be even.  dst receives 3 * n / 2 bytes.  Only the low 12 bits of each
+ * entry are stored.
+ */
+void vec_pack12(uint8_t *dst, const uint16_t *src, unsigned int n);
+
+
+/* Search the FAT entries fat[start] through fat[end - 1] for run
+ * consecutive free (zero) entries.  The run must lie entirely within
+ * the range.  run must be at least 1.
+ *
+ * Returns the index of the first entry of the first such run, or end if
+ * there is none.
+ */
+unsigned int vec_findfree(const uint16_t *fat, unsigned int start,
+                          unsigned int end, unsigned int run);
+
+
+/* Number of directory entries in a block, and the size of an entry. */
+#define VEC_DIR_ENTRIES 16
+#define VEC_DIRENT_SIZE 32
+
+
+/* Bit masks describing the VEC_DIR_ENTRIES directory entries of a
+ * block.  Bit i of each mask describes entry i.
+ */
+typedef struct dirmasks_t
+{
+   uint16_t free;     /* Unused: first byte 0x00 or 0xe5 */
+   uint16_t end;      /* First byte 0x00, marking the end of the directory */
+   uint16_t lfn;      /* Long file name entry: attribute bits 0-3 all set */
+   uint16_t hidden;   /* Hidden attribute set */
+   uint16_t match;    /* 11 byte name and extension equal to name */
+} dirmasks_t;
+
+
+/* Scan the directory block at block.  name points to the 11 byte,
+ * space-padded name and extension to match, or is NULL if no match mask
+ * is needed.
+ */
+void vec_scandir(const uint8_t *block, const uint8_t *name,
+                 dirmasks_t *masks);
+
+
+#endif